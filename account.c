@@ -0,0 +1,299 @@
+#include <pthread.h>
+#include <stdio.h>
+
+#include "slab.h"
+#include "account.h"
+
+/**
+ * Bytes this thread already charged to an account but hasn't
+ * handed out yet. Only one account at a time, switching drains
+ * the old one back. Only the owning thread changes bytes, but
+ * kmem_account_destroy can drain a stock from another thread,
+ * so whoever drains one claims it by swapping acct out first
+ */
+struct kmem_account_stock {
+        _Atomic(struct kmem_account *) acct;
+        atomic_size_t bytes;
+        struct kmem_account_stock *next;        /* On the stocks list, */
+        struct kmem_account_stock *last;        /* once listed is set */
+        int listed;
+};
+
+static _Thread_local struct kmem_account_stock stock;
+
+/* Drains a thread's stock when it exits */
+static pthread_key_t stock_key;
+static pthread_once_t stock_key_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Every live thread's stock, so a forked child can drain the
+ * ones whose threads it didn't get. Only touched the first time
+ * a thread stocks up and when it exits
+ */
+static struct kmem_account_stock *stocks = NULL;
+static pthread_mutex_t stocks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+__stock_drain(struct kmem_account_stock *st)
+{
+        struct kmem_account *acct;
+        size_t bytes;
+
+        bytes = atomic_load_explicit(&st->bytes, memory_order_relaxed);
+        acct = atomic_exchange_explicit(&st->acct, NULL, memory_order_acq_rel);
+        if (!acct) return;
+
+        DEBUG_PRINT("Draining %lu bytes of stock for account %s\n", bytes, acct->name);
+        atomic_fetch_sub_explicit(&acct->usage, bytes, memory_order_relaxed);
+}
+
+/**
+ * Take a stock off the stocks list
+ * ASSUMED: the caller holds stocks_lock
+ */
+static void
+__stock_unlist(struct kmem_account_stock *st)
+{
+        if (st->last) {
+                st->last->next = st->next;
+        } else {
+                stocks = st->next;
+        }
+        if (st->next) {
+                st->next->last = st->last;
+        }
+        st->listed = 0;
+}
+
+static void
+__stock_destructor(void *arg)
+{
+        struct kmem_account_stock *st = arg;
+
+        __stock_drain(st);
+        pthread_mutex_lock(&stocks_lock);
+        __stock_unlist(st);
+        pthread_mutex_unlock(&stocks_lock);
+}
+
+static void
+__stock_key_init()
+{
+        pthread_key_create(&stock_key, __stock_destructor);
+}
+
+/**
+ * Put this thread's stock on the list, and get it drained on exit
+ */
+static void
+__stock_list()
+{
+        pthread_once(&stock_key_once, __stock_key_init);
+        pthread_setspecific(stock_key, &stock);
+
+        pthread_mutex_lock(&stocks_lock);
+        stock.last = NULL;
+        stock.next = stocks;
+        if (stocks) {
+                stocks->last = &stock;
+        }
+        stocks = &stock;
+        stock.listed = 1;
+        pthread_mutex_unlock(&stocks_lock);
+}
+
+static inline void
+__account_update_max(struct kmem_account *acct, size_t usage)
+{
+        size_t max;
+
+        max = atomic_load_explicit(&acct->max_usage, memory_order_relaxed);
+        while (usage > max
+               && !atomic_compare_exchange_weak_explicit(&acct->max_usage, &max, usage,
+                                                         memory_order_relaxed,
+                                                         memory_order_relaxed));
+}
+
+/**
+ * Charge the shared counter, unless that would pass the limit
+ * Returns 0 on success, -1 if it doesn't fit
+ */
+static int
+__account_try_charge(struct kmem_account *acct, size_t bytes)
+{
+        size_t usage;
+
+        usage = atomic_load_explicit(&acct->usage, memory_order_relaxed);
+        do {
+                if (acct->limit && usage + bytes > acct->limit) return -1;
+        } while (!atomic_compare_exchange_weak_explicit(&acct->usage, &usage, usage + bytes,
+                                                        memory_order_relaxed,
+                                                        memory_order_relaxed));
+
+        __account_update_max(acct, usage + bytes);
+        return 0;
+}
+
+void
+kmem_account_init(struct kmem_account *acct, char *name, size_t limit)
+{
+        acct->name = name;
+        acct->limit = limit;
+        atomic_init(&acct->usage, 0);
+        atomic_init(&acct->max_usage, 0);
+        atomic_init(&acct->failcnt, 0);
+        acct->wake = NULL;
+        acct->wake_arg = NULL;
+}
+
+void
+kmem_account_set_wake(struct kmem_account *acct, kmem_account_wake_fn fn, void *arg)
+{
+        acct->wake_arg = arg;
+        acct->wake = fn;
+}
+
+void
+kmem_cache_set_account(struct kmem_cache *cp, struct kmem_account *acct)
+{
+        DEBUG_PRINT("Charging cache %s to account %s\n", cp->name, acct ? acct->name : "(none)");
+        cp->account = acct;
+}
+
+int
+kmem_account_charge(struct kmem_account *acct, size_t bytes, int flags)
+{
+        size_t have;
+
+        have = atomic_load_explicit(&stock.bytes, memory_order_relaxed);
+        if (atomic_load_explicit(&stock.acct, memory_order_relaxed) == acct && have >= bytes) {
+                atomic_store_explicit(&stock.bytes, have - bytes, memory_order_relaxed);
+                return 0;
+        }
+
+        if (!acct->wake) {
+                // Out of stock, so go to the shared counter. Grab a
+                // batch extra while we're there, if the limit allows
+                __stock_drain(&stock);
+                if (!__account_try_charge(acct, bytes + KM_ACCOUNT_BATCH)) {
+                        if (!stock.listed) __stock_list();
+                        atomic_store_explicit(&stock.bytes, KM_ACCOUNT_BATCH, memory_order_relaxed);
+                        atomic_store_explicit(&stock.acct, acct, memory_order_release);
+                        return 0;
+                }
+        }
+        // Waiters can't see bytes sitting in a stock, so
+        // accounts with a waker only ever charge exactly
+        if (!__account_try_charge(acct, bytes)) {
+                return 0;
+        }
+
+        if (flags & KM_NOSLEEP) {
+                DEBUG_PRINT("Account %s is over its %lu byte limit\n", acct->name, acct->limit);
+                atomic_fetch_add_explicit(&acct->failcnt, 1, memory_order_relaxed);
+                return -1;
+        }
+
+        // KM_SLEEP callers can't be told no, so let them overshoot
+        __account_update_max(acct, atomic_fetch_add_explicit(&acct->usage, bytes,
+                                                             memory_order_relaxed) + bytes);
+        return 0;
+}
+
+void
+kmem_account_uncharge(struct kmem_account *acct, size_t bytes)
+{
+        size_t have;
+
+        if (acct->wake) {
+                atomic_fetch_sub_explicit(&acct->usage, bytes, memory_order_relaxed);
+                acct->wake(acct, acct->wake_arg);
+                return;
+        }
+
+        if (atomic_load_explicit(&stock.acct, memory_order_relaxed) != acct) {
+                atomic_fetch_sub_explicit(&acct->usage, bytes, memory_order_relaxed);
+                return;
+        }
+
+        // Keep it for the next charge, but don't hoard
+        have = atomic_load_explicit(&stock.bytes, memory_order_relaxed) + bytes;
+        if (have > 2 * KM_ACCOUNT_BATCH) {
+                atomic_fetch_sub_explicit(&acct->usage, have - KM_ACCOUNT_BATCH,
+                                          memory_order_relaxed);
+                have = KM_ACCOUNT_BATCH;
+        }
+        atomic_store_explicit(&stock.bytes, have, memory_order_relaxed);
+}
+
+void
+kmem_account_flush()
+{
+        __stock_drain(&stock);
+}
+
+void
+kmem_account_destroy(struct kmem_account *acct)
+{
+        struct kmem_account_stock *st;
+        struct kmem_account *expected;
+        size_t bytes;
+
+        // Nothing charges acct any more, so a stock still holding it
+        // only changes when its thread drains it to switch accounts.
+        // The bytes read before the swap are then the ones we claim
+        pthread_mutex_lock(&stocks_lock);
+        for (st = stocks; st; st = st->next) {
+                bytes = atomic_load_explicit(&st->bytes, memory_order_relaxed);
+                expected = acct;
+                if (atomic_compare_exchange_strong_explicit(&st->acct, &expected, NULL,
+                                                            memory_order_acq_rel,
+                                                            memory_order_relaxed)) {
+                        DEBUG_PRINT("Draining %lu bytes of stock for destroyed account %s\n",
+                                    bytes, acct->name);
+                        atomic_fetch_sub_explicit(&acct->usage, bytes, memory_order_relaxed);
+                }
+        }
+        pthread_mutex_unlock(&stocks_lock);
+}
+
+void
+__kmem_account_fork_prepare()
+{
+        pthread_mutex_lock(&stocks_lock);
+}
+
+void
+__kmem_account_fork_parent()
+{
+        pthread_mutex_unlock(&stocks_lock);
+}
+
+void
+__kmem_account_fork_child()
+{
+        struct kmem_account_stock *st;
+        struct kmem_account_stock *temp;
+
+        pthread_mutex_init(&stocks_lock, NULL);
+
+        // The other threads didn't come with us, so their stocks are
+        // only charged bytes nobody will ever hand out. Their memory
+        // did come with us, so give the bytes back and forget them
+        for (st = stocks; st; st = temp) {
+                temp = st->next;
+                if (st == &stock) continue;
+                __stock_drain(st);
+                __stock_unlist(st);
+        }
+}
+
+void
+kmem_account_report(struct kmem_account *acct, struct kmem_account_stats *stats)
+{
+        stats->name = acct->name;
+        stats->limit = acct->limit;
+        stats->usage = atomic_load_explicit(&acct->usage, memory_order_relaxed);
+        stats->max_usage = atomic_load_explicit(&acct->max_usage, memory_order_relaxed);
+        stats->failcnt = atomic_load_explicit(&acct->failcnt, memory_order_relaxed);
+}
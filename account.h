@@ -0,0 +1,151 @@
+#ifndef PLOPREIATO_SLAB_ACCOUNT_H
+#define PLOPREIATO_SLAB_ACCOUNT_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "slab.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Per-tenant memory accounting
+ * An account is charged object_size for every allocation from the
+ * caches bound to it, and uncharged on free. Since we don't keep a
+ * header on each object, the binding is per cache: give each tenant
+ * its own caches (like memcg's per-cgroup kmem caches) and point them
+ * all at the tenant's account.
+ *
+ * Charges go through a small per-thread stock, so most allocations
+ * only touch thread local memory, and the shared counter is only hit
+ * once per KM_ACCOUNT_BATCH bytes. The flip side is that usage can
+ * run ahead of what's really allocated by up to a batch per thread.
+ */
+
+#define KM_ACCOUNT_BATCH (32 * 1024)
+
+struct kmem_account;
+
+/* Called after bytes go back to an account, see kmem_account_set_wake */
+typedef void (*kmem_account_wake_fn)(struct kmem_account *acct, void *arg);
+
+struct kmem_account {
+        char *name;               /* Used for reports */
+        size_t limit;             /* KM_NOSLEEP allocations fail past this,
+                                   * 0 for no limit */
+        atomic_size_t usage;      /* Bytes charged, including stocks */
+        atomic_size_t max_usage;  /* High water mark of usage */
+        atomic_ulong failcnt;     /* Allocations refused for the limit */
+        kmem_account_wake_fn wake; /* Run on every uncharge, or NULL */
+        void *wake_arg;
+};
+
+struct kmem_account_stats {
+        char *name;
+        size_t limit;
+        size_t usage;
+        size_t max_usage;
+        unsigned long failcnt;
+};
+
+/**
+ * Set up an account, limit 0 means unlimited
+ */
+void
+kmem_account_init(
+        struct kmem_account *acct,
+        char *name,
+        size_t limit
+);
+
+/**
+ * Charge every allocation from cp to acct (NULL to stop)
+ * Only switch while the cache has nothing allocated, or
+ * frees will uncharge the wrong account
+ */
+void
+kmem_cache_set_account(
+        struct kmem_cache *cp,
+        struct kmem_account *acct
+);
+
+/**
+ * Run fn(acct, arg) after every uncharge, so whoever had a
+ * KM_NOSLEEP allocation refused can try again (NULL to stop)
+ * Accounts with a waker skip the per-thread stock, so bytes
+ * show up as free the moment they're uncharged
+ * Set this before the account's caches are in use
+ */
+void
+kmem_account_set_wake(
+        struct kmem_account *acct,
+        kmem_account_wake_fn fn,
+        void *arg
+);
+
+/**
+ * Charge bytes to the account
+ * Going over the limit is only allowed for KM_SLEEP
+ * Returns 0 on success, -1 if the charge was refused
+ */
+int
+kmem_account_charge(
+        struct kmem_account *acct,
+        size_t bytes,
+        int flags
+);
+
+/**
+ * Give bytes back to the account
+ */
+void
+kmem_account_uncharge(
+        struct kmem_account *acct,
+        size_t bytes
+);
+
+/**
+ * Return the calling thread's stock to its account, so the
+ * usage reported right after is exact for this thread
+ */
+void
+kmem_account_flush(void);
+
+/**
+ * Take every thread's stock off acct, before it's freed or goes
+ * out of scope
+ * Stocks keep a pointer to their account, and a thread drains
+ * its stock into that account whenever it switches accounts or
+ * exits, so this is required before an account's memory goes.
+ * Call it once nothing will charge acct again: its caches are
+ * destroyed or pointed elsewhere with kmem_cache_set_account
+ */
+void
+kmem_account_destroy(
+        struct kmem_account *acct
+);
+
+/**
+ * Snapshot an account's numbers
+ */
+void
+kmem_account_report(
+        struct kmem_account *acct,
+        struct kmem_account_stats *stats
+);
+
+/**
+ * Fork handling, called from slab.c's pthread_atfork handlers
+ * so every lock is taken in the allocator's lock order
+ */
+void __kmem_account_fork_prepare(void);
+void __kmem_account_fork_parent(void);
+void __kmem_account_fork_child(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,219 @@
+#ifndef PLOPREIATO_SLAB_ASYNC_HPP
+#define PLOPREIATO_SLAB_ASYNC_HPP
+
+#include <atomic>
+#include <coroutine>
+#include <functional>
+#include <mutex>
+
+#include "slab.h"
+#include "account.h"
+
+/**
+ * Coroutine allocation under an account's limit
+ *
+ *     kmem::waitq q(&acct, [&](auto fn) { loop.post(fn); });
+ *     ...
+ *     void *buf = co_await kmem::async_alloc(cp);
+ *
+ * The await completes straight away when the account has room.
+ * Otherwise the coroutine parks on the account's waitq, and the
+ * next free charged to that account hands it to post() to try
+ * again, instead of blocking the thread like KM_SLEEP would (or
+ * overshooting the limit, which is what KM_SLEEP really does).
+ *
+ * Caches with no account, or whose account has no waitq, just
+ * do a KM_SLEEP allocation, and the await gives whatever that
+ * returns: NULL from a signal-safe cache whose reserve is out.
+ *
+ * Build with -std=c++23: coroutines are C++20, but slab.h's
+ * structs have _Atomic fields, which C++ only accepts through
+ * C++23's <stdatomic.h> (-std=c++20 fails to compile them).
+ */
+
+namespace kmem {
+
+class async_alloc;
+
+/**
+ * Coroutines waiting for room in one account
+ * Must outlive every free charged to the account, and
+ * shouldn't be destroyed with coroutines still parked
+ */
+class waitq {
+public:
+        using executor = std::function<void(std::function<void()>)>;
+
+        /* Without an executor, waiters resume inside kmem_cache_free */
+        explicit waitq(kmem_account *acct, executor post = nullptr)
+                : acct_(acct), post_(std::move(post))
+        {
+                kmem_account_set_wake(acct_, &waitq::on_uncharge, this);
+        }
+
+        ~waitq()
+        {
+                kmem_account_set_wake(acct_, nullptr, nullptr);
+        }
+
+        waitq(const waitq &) = delete;
+        waitq &operator=(const waitq &) = delete;
+
+        /* The queue cp's allocations wait on, if any */
+        static waitq *of(kmem_cache *cp)
+        {
+                if (!cp->account || cp->account->wake != &waitq::on_uncharge) return nullptr;
+                return static_cast<waitq *>(cp->account->wake_arg);
+        }
+
+        size_t waiting() const
+        {
+                return waiting_.load(std::memory_order_relaxed);
+        }
+
+private:
+        friend class async_alloc;
+
+        /**
+         * Try to allocate for w, parking it if there's no room
+         * Returns true if w got its buf. Once w is parked another
+         * thread can resume it, so w mustn't be touched after
+         */
+        inline bool try_or_park(async_alloc *w);
+
+        /* A free made room, wake the oldest waiter (if any) */
+        void wake()
+        {
+                async_alloc *w;
+
+                // Pairs with the check in try_or_park: either we see
+                // the waiter, or it sees the wakeup and tries again
+                wakeups_.fetch_add(1, std::memory_order_seq_cst);
+                if (!waiting_.load(std::memory_order_seq_cst)) return;
+
+                {
+                        std::lock_guard<std::mutex> guard(lock_);
+                        w = pop();
+                }
+                if (!w) return;
+
+                if (post_) {
+                        post_([this, w] { retry(w); });
+                } else {
+                        retry(w);
+                }
+        }
+
+        inline void retry(async_alloc *w);
+        inline void push(async_alloc *w);
+        inline async_alloc *pop();
+
+        static void on_uncharge(kmem_account *, void *arg)
+        {
+                static_cast<waitq *>(arg)->wake();
+        }
+
+        kmem_account *acct_;
+        executor post_;
+        std::mutex lock_;
+        async_alloc *head_ = nullptr;
+        async_alloc *tail_ = nullptr;
+        std::atomic<size_t> waiting_{0};
+        std::atomic<unsigned long> wakeups_{0};
+};
+
+/**
+ * co_await kmem::async_alloc(cp) gives a buf from cp
+ * With a waitq it never gives NULL, it waits until there's room
+ * instead. Without one there's nothing to wait on, so it never
+ * suspends
+ */
+class async_alloc {
+public:
+        explicit async_alloc(kmem_cache *cp) : cp_(cp) {}
+
+        bool await_ready()
+        {
+                q_ = waitq::of(cp_);
+                buf_ = kmem_cache_alloc(cp_, q_ ? KM_NOSLEEP : KM_SLEEP);
+                return buf_ != nullptr || !q_;
+        }
+
+        bool await_suspend(std::coroutine_handle<> h)
+        {
+                handle_ = h;
+                return !q_->try_or_park(this);
+        }
+
+        void *await_resume() const
+        {
+                return buf_;
+        }
+
+private:
+        friend class waitq;
+
+        kmem_cache *cp_;
+        waitq *q_ = nullptr;
+        void *buf_ = nullptr;
+        std::coroutine_handle<> handle_;
+        async_alloc *next_ = nullptr;
+};
+
+inline void
+waitq::push(async_alloc *w)
+{
+        w->next_ = nullptr;
+        if (tail_) {
+                tail_->next_ = w;
+        } else {
+                head_ = w;
+        }
+        tail_ = w;
+}
+
+inline async_alloc *
+waitq::pop()
+{
+        async_alloc *w = head_;
+
+        if (w) {
+                head_ = w->next_;
+                if (!head_) tail_ = nullptr;
+                waiting_.fetch_sub(1, std::memory_order_relaxed);
+        }
+        return w;
+}
+
+inline bool
+waitq::try_or_park(async_alloc *w)
+{
+        unsigned long seen;
+
+        for (;;) {
+                seen = wakeups_.load(std::memory_order_seq_cst);
+                w->buf_ = kmem_cache_alloc(w->cp_, KM_NOSLEEP);
+                if (w->buf_) return true;
+
+                std::lock_guard<std::mutex> guard(lock_);
+                waiting_.fetch_add(1, std::memory_order_seq_cst);
+                if (wakeups_.load(std::memory_order_seq_cst) == seen) {
+                        push(w);
+                        return false;
+                }
+                // Something was freed since we tried, go again
+                waiting_.fetch_sub(1, std::memory_order_relaxed);
+        }
+}
+
+inline void
+waitq::retry(async_alloc *w)
+{
+        if (try_or_park(w)) {
+                w->handle_.resume();
+        }
+}
+
+}
+
+#endif
@@ -0,0 +1,803 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "slab.h"
+#include "trace.h"
+#include "pages.h"
+#include "kmem_alloc.h"
+
+#define BENCH_ROUNDS 20
+
+static uint64_t
+now_ns()
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct big_foo {
+        int nums[128];
+};
+
+/**
+ * Free a few thousand large objects, one kmem_cache_free
+ * at a time vs. one kmem_cache_free_bulk. Compare against
+ * slab_bench_noprefetch, whose bulk free still takes the lock
+ * once a batch but skips kmem_hash_get_many, to see what the
+ * prefetching alone buys
+ */
+#define BULK_ITEMS 4096
+static void
+bench_bulk_free()
+{
+        static void *items[BULK_ITEMS];
+        struct kmem_cache *cp;
+        uint64_t single = 0;
+        uint64_t bulk = 0;
+        uint64_t start;
+
+        cp = kmem_cache_create("bench bulk", sizeof(struct big_foo), 0);
+        for (int round = 0; round < BENCH_ROUNDS; round++) {
+                for (int i = 0; i < BULK_ITEMS; i++) {
+                        items[i] = kmem_cache_alloc(cp, KM_SLEEP);
+                }
+                start = now_ns();
+                for (int i = 0; i < BULK_ITEMS; i++) {
+                        kmem_cache_free(cp, items[i]);
+                }
+                single += now_ns() - start;
+
+                for (int i = 0; i < BULK_ITEMS; i++) {
+                        items[i] = kmem_cache_alloc(cp, KM_SLEEP);
+                }
+                start = now_ns();
+                kmem_cache_free_bulk(cp, BULK_ITEMS, items);
+                bulk += now_ns() - start;
+        }
+        kmem_cache_destroy(cp);
+
+        printf("free, one at a time: %8.1f ns/object\n",
+               (double)single / (BENCH_ROUNDS * BULK_ITEMS));
+#if defined(KM_BULK_PREFETCH) && !KM_BULK_PREFETCH
+        // slab_bench_noprefetch: one lock a batch, but plain lookups
+        printf("free, bulk, no prefetch: %4.1f ns/object\n",
+               (double)bulk / (BENCH_ROUNDS * BULK_ITEMS));
+#else
+        printf("free, bulk:          %8.1f ns/object\n",
+               (double)bulk / (BENCH_ROUNDS * BULK_ITEMS));
+#endif
+}
+
+/**
+ * Two caches take turns serving bursts of request-scoped objects,
+ * with the odd session-scoped one mixed in that outlives every
+ * burst after it. Without hints the sessions end up spread over
+ * every slab a burst touched, so whatever one cache holds on to
+ * between its bursts adds to the other cache's peak
+ */
+#define LIFETIME_BURSTS 50
+#define LIFETIME_BURST 4000
+#define LIFETIME_EVERY 200
+static void
+bench_lifetime(int hints)
+{
+        static void *shorts[LIFETIME_BURST];
+        static void *longs[LIFETIME_BURSTS * LIFETIME_BURST / LIFETIME_EVERY];
+        struct kmem_cache_stats stats[2];
+        struct kmem_cache *caches[2];
+        struct kmem_cache *cp;
+        unsigned peak = 0;
+        int nlongs = 0;
+
+        caches[0] = kmem_cache_create("bench lifetime a", 64, 0);
+        caches[1] = kmem_cache_create("bench lifetime b", 64, 0);
+        for (int burst = 0; burst < LIFETIME_BURSTS; burst++) {
+                cp = caches[burst % 2];
+                for (int i = 0; i < LIFETIME_BURST; i++) {
+                        if (i % LIFETIME_EVERY == 0) {
+                                longs[nlongs++] = kmem_cache_alloc(cp, KM_SLEEP | (hints ? KM_LONGLIVED : 0));
+                        }
+                        shorts[i] = kmem_cache_alloc(cp, KM_SLEEP | (hints ? KM_SHORTLIVED : 0));
+                }
+
+                kmem_cache_get_stats(caches[0], &stats[0]);
+                kmem_cache_get_stats(caches[1], &stats[1]);
+                if (stats[0].slab_count + stats[1].slab_count > peak) {
+                        peak = stats[0].slab_count + stats[1].slab_count;
+                }
+
+                for (int i = 0; i < LIFETIME_BURST; i++) {
+                        kmem_cache_free(cp, shorts[i]);
+                }
+        }
+
+        kmem_cache_get_stats(caches[0], &stats[0]);
+        printf("%s peak slabs (both caches) %4u, held by one cache between bursts %3u"
+               " (short %u, long %u, default %u)\n",
+               hints ? "hinted:  " : "unhinted:", peak, stats[0].slab_count,
+               stats[0].set_slabs[KM_LIFETIME_SHORT], stats[0].set_slabs[KM_LIFETIME_LONG],
+               stats[0].set_slabs[KM_LIFETIME_DEFAULT]);
+
+        for (int i = 0; i < nlongs; i++) {
+                // Longs came from the caches alternately, one burst at a time
+                kmem_cache_free(caches[(i / (LIFETIME_BURST / LIFETIME_EVERY)) % 2], longs[i]);
+        }
+        kmem_cache_destroy(caches[0]);
+        kmem_cache_destroy(caches[1]);
+}
+
+/**
+ * Time alloc/free pairs on a small cache, best of a few runs
+ * so scheduling noise doesn't drown out fractions of a ns
+ */
+#define HOOK_PAIRS 2000000
+#define HOOK_RUNS 7
+static double
+time_pairs(struct kmem_cache *cp)
+{
+        uint64_t best = UINT64_MAX;
+        uint64_t start;
+        uint64_t elapsed;
+        void *buf;
+
+        for (int run = 0; run < HOOK_RUNS; run++) {
+                start = now_ns();
+                for (int i = 0; i < HOOK_PAIRS; i++) {
+                        buf = kmem_cache_alloc(cp, KM_SLEEP);
+                        __asm__ volatile("" : : "r"(buf) : "memory");
+                        kmem_cache_free(cp, buf);
+                }
+                elapsed = now_ns() - start;
+                if (elapsed < best) best = elapsed;
+        }
+
+        return (double)best / HOOK_PAIRS;
+}
+
+#ifndef KM_NO_HOOKS
+static void
+count_hook(struct kmem_cache *UNUSED(cp), void *UNUSED(buf), void *arg)
+{
+        (*(unsigned long *)arg)++;
+}
+#endif
+
+/**
+ * Compare against slab_bench_nohooks, which is built with the
+ * hook checks compiled out entirely
+ */
+static void
+bench_hooks()
+{
+        struct kmem_cache *cp;
+
+        cp = kmem_cache_create("bench hooks", 64, 0);
+#ifdef KM_NO_HOOKS
+        printf("hooks compiled out:           %6.2f ns/pair\n", time_pairs(cp));
+#else
+        unsigned long calls = 0;
+        struct kmem_hooks hooks = { count_hook, count_hook, &calls };
+        struct kmem_cache *other;
+
+        printf("no hooks installed:           %6.2f ns/pair\n", time_pairs(cp));
+
+        other = kmem_cache_create("bench hooks other", 64, 0);
+        kmem_cache_set_hooks(other, &hooks);
+        printf("hook on some other cache:     %6.2f ns/pair\n", time_pairs(cp));
+        kmem_cache_set_hooks(other, NULL);
+        kmem_cache_destroy(other);
+
+        kmem_cache_set_hooks(cp, &hooks);
+        printf("counting hook on this cache:  %6.2f ns/pair\n", time_pairs(cp));
+        kmem_cache_set_hooks(cp, NULL);
+#endif
+        kmem_cache_destroy(cp);
+}
+
+/**
+ * Uncontended alloc/free pairs, with the cache lock and on a
+ * KM_CACHE_SINGLE_THREAD cache, small and large objects
+ */
+static void
+bench_single(unsigned flags)
+{
+        struct kmem_cache *small;
+        struct kmem_cache *large;
+
+        small = kmem_cache_create_attr("bench single small", &(struct kmem_cache_attr){
+                .size = 64,
+                .flags = flags,
+        });
+        large = kmem_cache_create_attr("bench single large", &(struct kmem_cache_attr){
+                .size = 1024,
+                .flags = flags,
+        });
+        printf("%-14s small %6.2f ns/pair, large %6.2f ns/pair\n",
+               flags ? "single thread:" : "locked:", time_pairs(small), time_pairs(large));
+        kmem_cache_destroy(small);
+        kmem_cache_destroy(large);
+}
+
+/**
+ * What leaving tracing compiled in costs, switched off and on
+ */
+static void
+bench_trace()
+{
+        struct kmem_cache *cp;
+
+        cp = kmem_cache_create("bench trace", 64, 0);
+        printf("tracing off:                  %6.2f ns/pair\n", time_pairs(cp));
+        kmem_trace_enable(1);
+        printf("tracing on:                   %6.2f ns/pair\n", time_pairs(cp));
+        kmem_trace_enable(0);
+        kmem_cache_destroy(cp);
+}
+
+/**
+ * Fill a large object cache with a lot of objects and empty it
+ * again. Compare against slab_bench_order0, built with every
+ * slab kept to one page, and against a cache created knowing
+ * how many objects it'll hold (kmem_cache_attr's nobjs)
+ */
+#define GROWTH_ITEMS 20000
+static void
+bench_growth(int presized)
+{
+        static void *items[GROWTH_ITEMS];
+        struct kmem_cache_stats stats;
+        struct kmem_cache *cp;
+        uint64_t alloc = 0;
+        uint64_t release = 0;
+        uint64_t start;
+
+        cp = kmem_cache_create_attr("bench growth", &(struct kmem_cache_attr){
+                .size = sizeof(struct big_foo),
+                .nobjs = presized ? GROWTH_ITEMS : 0,
+        });
+        for (int round = 0; round < BENCH_ROUNDS / 4; round++) {
+                start = now_ns();
+                for (int i = 0; i < GROWTH_ITEMS; i++) {
+                        items[i] = kmem_cache_alloc(cp, KM_SLEEP);
+                }
+                alloc += now_ns() - start;
+                kmem_cache_get_stats(cp, &stats);
+
+                start = now_ns();
+                for (int i = 0; i < GROWTH_ITEMS; i++) {
+                        kmem_cache_free(cp, items[i]);
+                }
+                kmem_cache_shrink(cp);
+                release += now_ns() - start;
+        }
+        kmem_cache_destroy(cp);
+
+        printf("max order %u%s: %6u slabs, alloc %6.1f ns/object, free %6.1f ns/object\n",
+               stats.max_order, presized ? ", presized" : ",   unsized", stats.slab_count,
+               (double)alloc / (BENCH_ROUNDS / 4 * GROWTH_ITEMS),
+               (double)release / (BENCH_ROUNDS / 4 * GROWTH_ITEMS));
+}
+
+/**
+ * Bursts of small objects from a few threads at once: every
+ * thread allocates CPUSLAB_BURST objects, then frees them all
+ */
+#define CPUSLAB_THREADS 4
+#define CPUSLAB_BURST 256
+#define CPUSLAB_BURSTS 2000
+static void *
+cpuslab_worker(void *arg)
+{
+        struct kmem_cache *cp = arg;
+        void *items[CPUSLAB_BURST];
+
+        for (int burst = 0; burst < CPUSLAB_BURSTS; burst++) {
+                for (int i = 0; i < CPUSLAB_BURST; i++) {
+                        items[i] = kmem_cache_alloc(cp, KM_SLEEP);
+                }
+                for (int i = 0; i < CPUSLAB_BURST; i++) {
+                        kmem_cache_free(cp, items[i]);
+                }
+        }
+        return NULL;
+}
+
+static double
+time_bursts(struct kmem_cache *cp, int nthreads)
+{
+        pthread_t threads[CPUSLAB_THREADS];
+        uint64_t start;
+
+        start = now_ns();
+        for (int i = 0; i < nthreads; i++) {
+                pthread_create(&threads[i], NULL, cpuslab_worker, cp);
+        }
+        for (int i = 0; i < nthreads; i++) {
+                pthread_join(threads[i], NULL);
+        }
+        return (double)(now_ns() - start) / ((uint64_t)nthreads * CPUSLAB_BURSTS * CPUSLAB_BURST);
+}
+
+static void *
+noop_worker(void *UNUSED(arg))
+{
+        return NULL;
+}
+
+/**
+ * The same workloads on a cache behind its lock, and one
+ * with CPU slabs. glibc drops its single-threaded shortcuts
+ * for good once a second thread has existed, so one is run
+ * up front and both caches are timed the way a threaded
+ * program would see them
+ */
+static void
+bench_cpuslab()
+{
+        struct kmem_cache *caches[2];
+        const char *names[2] = { "locked:   ", "CPU slabs:" };
+        pthread_t thread;
+        double pairs;
+        double bursts;
+        double threaded;
+
+        pthread_create(&thread, NULL, noop_worker, NULL);
+        pthread_join(thread, NULL);
+
+        caches[0] = kmem_cache_create("bench locked", 64, 0);
+        caches[1] = kmem_cache_create_cpuslab("bench cpuslab", 64, 0);
+        for (int c = 0; c < 2; c++) {
+                pairs = time_pairs(caches[c]);
+                bursts = time_bursts(caches[c], 1);
+                threaded = time_bursts(caches[c], CPUSLAB_THREADS);
+                printf("%s alloc/free pairs %6.2f ns/pair, bursts %6.2f ns/pair, "
+                       "%d threads %6.2f ns/pair\n",
+                       names[c], pairs, bursts, CPUSLAB_THREADS, threaded);
+                kmem_cache_destroy(caches[c]);
+        }
+}
+
+/**
+ * A few hundred binary search trees sharing one cache, kept at a
+ * steady size: each tree in turn loses a random leaf and gains a
+ * new key, for a while, then they're all walked in order. The
+ * trees were grown side by side and the cache has as much free
+ * space again scattered over its slabs, so a plain allocation
+ * lands wherever the freelist is, while one near the new node's
+ * parent can usually find room on the parent's page. Fewer
+ * pages a tree is fewer TLB entries and page walks to walk it;
+ * each node is still its own cache line either way
+ */
+#define NEAR_TREES 512
+#define NEAR_NODES 1024
+#define NEAR_CHURN (2 * NEAR_NODES)
+#define NEAR_WALKS 5
+
+struct near_node {
+        struct near_node *left;
+        struct near_node *right;
+        uint64_t key;
+        uint64_t payload[5];
+};
+
+static uint64_t
+near_random(uint64_t *seed)
+{
+        *seed ^= *seed << 13;
+        *seed ^= *seed >> 7;
+        *seed ^= *seed << 17;
+        return *seed;
+}
+
+static void
+near_insert(struct kmem_cache *cp, struct near_node **root, uint64_t key, int hints)
+{
+        struct near_node *parent = NULL;
+        struct near_node *node;
+
+        while (*root) {
+                parent = *root;
+                root = key < parent->key ? &parent->left : &parent->right;
+        }
+        node = hints ? kmem_cache_alloc_near(cp, parent, KM_SLEEP)
+                     : kmem_cache_alloc(cp, KM_SLEEP);
+        node->left = node->right = NULL;
+        node->key = key;
+        *root = node;
+}
+
+/* Drop a leaf, found by walking down at random */
+static void
+near_remove_leaf(struct kmem_cache *cp, struct near_node **root, uint64_t *seed)
+{
+        struct near_node *node;
+
+        while ((node = *root)->left || node->right) {
+                if (!node->left || (node->right && near_random(seed) & 1)) {
+                        root = &node->right;
+                } else {
+                        root = &node->left;
+                }
+        }
+        *root = NULL;
+        kmem_cache_free(cp, node);
+}
+
+static uint64_t
+near_walk(struct near_node *node)
+{
+        uint64_t sum = 0;
+
+        while (node) {
+                sum += near_walk(node->left) + node->key;
+                node = node->right;
+        }
+        return sum;
+}
+
+static int
+near_by_address(const void *a, const void *b)
+{
+        uintptr_t x = *(const uintptr_t *)a;
+        uintptr_t y = *(const uintptr_t *)b;
+
+        return (x > y) - (x < y);
+}
+
+/* Distinct pages a tree's nodes are on */
+static unsigned
+near_pages(struct near_node *root)
+{
+        static uintptr_t pages[NEAR_NODES];
+        static struct near_node *stack[NEAR_NODES];
+        unsigned npages = 0;
+        unsigned distinct = 0;
+        int top = 0;
+
+        stack[top++] = root;
+        while (top) {
+                root = stack[--top];
+                pages[npages++] = (uintptr_t)root / 4096;
+                if (root->left) stack[top++] = root->left;
+                if (root->right) stack[top++] = root->right;
+        }
+        qsort(pages, npages, sizeof(pages[0]), near_by_address);
+        for (unsigned i = 0; i < npages; i++) {
+                if (!i || pages[i] != pages[i - 1]) distinct++;
+        }
+        return distinct;
+}
+
+static void
+near_tree_free(struct kmem_cache *cp, struct near_node *node)
+{
+        struct near_node *right;
+
+        while (node) {
+                near_tree_free(cp, node->left);
+                right = node->right;
+                kmem_cache_free(cp, node);
+                node = right;
+        }
+}
+
+static void
+bench_near(int hints)
+{
+        static struct near_node *roots[NEAR_TREES];
+        static void *spare[NEAR_TREES * NEAR_NODES];
+        struct kmem_cache *cp;
+        uint64_t seed = 88172645463325252ull;
+        uint64_t best = UINT64_MAX;
+        uint64_t start;
+        uint64_t sum = 0;
+        uint64_t pages = 0;
+
+        cp = kmem_cache_create("bench near", sizeof(struct near_node), 0);
+        for (int i = 0; i < NEAR_NODES; i++) {
+                for (int t = 0; t < NEAR_TREES; t++) {
+                        near_insert(cp, &roots[t], near_random(&seed), 0);
+                        spare[i * NEAR_TREES + t] = kmem_cache_alloc(cp, KM_SLEEP);
+                }
+        }
+        for (int i = 0; i < NEAR_TREES * NEAR_NODES; i++) {
+                kmem_cache_free(cp, spare[i]);
+        }
+
+        for (int i = 0; i < NEAR_CHURN; i++) {
+                for (int t = 0; t < NEAR_TREES; t++) {
+                        if (roots[t]->left || roots[t]->right) {
+                                near_remove_leaf(cp, &roots[t], &seed);
+                                near_insert(cp, &roots[t], near_random(&seed), hints);
+                        }
+                }
+        }
+
+        for (int walk = 0; walk < NEAR_WALKS; walk++) {
+                start = now_ns();
+                for (int t = 0; t < NEAR_TREES; t++) {
+                        sum += near_walk(roots[t]);
+                }
+                if (now_ns() - start < best) best = now_ns() - start;
+        }
+        for (int t = 0; t < NEAR_TREES; t++) {
+                pages += near_pages(roots[t]);
+        }
+
+        printf("%s walk %6.2f ns/node, %6.1f pages/tree (checksum %lx)\n",
+               hints ? "near parent:" : "plain:      ",
+               (double)best / (NEAR_TREES * NEAR_NODES),
+               (double)pages / NEAR_TREES, sum & 0xff);
+
+        for (int t = 0; t < NEAR_TREES; t++) {
+                near_tree_free(cp, roots[t]);
+                roots[t] = NULL;
+        }
+        kmem_cache_destroy(cp);
+}
+
+/**
+ * Batches of small objects that fill up side by side, like
+ * requests from many clients arriving interleaved, then get
+ * processed one batch at a time, many times over. One at a
+ * time, a batch's objects are spread over as many slabs as it
+ * has objects; as one contiguous run, reserved when the batch
+ * starts, it's laid out the way it's read, for the hardware
+ * prefetcher
+ */
+#define CONTIG_BATCHES 8192
+#define CONTIG_BATCH 32
+#define CONTIG_PASSES 5
+
+struct contig_item {
+        uint64_t value;
+        uint64_t payload[7];
+};
+
+static void
+bench_contig(int contig)
+{
+        static struct contig_item *batches[CONTIG_BATCHES][CONTIG_BATCH];
+        struct kmem_cache *cp;
+        uint64_t best = UINT64_MAX;
+        uint64_t alloc;
+        uint64_t start;
+        uint64_t sum = 0;
+        char *run;
+
+        cp = kmem_cache_create("bench contig", sizeof(struct contig_item), 0);
+        start = now_ns();
+        if (contig) {
+                for (int b = 0; b < CONTIG_BATCHES; b++) {
+                        run = kmem_cache_alloc_contig(cp, CONTIG_BATCH, KM_SLEEP);
+                        for (int i = 0; i < CONTIG_BATCH; i++) {
+                                batches[b][i] = (struct contig_item *)(run + i * cp->object_size);
+                        }
+                }
+        }
+        for (int i = 0; i < CONTIG_BATCH; i++) {
+                for (int b = 0; b < CONTIG_BATCHES; b++) {
+                        if (!contig) batches[b][i] = kmem_cache_alloc(cp, KM_SLEEP);
+                        batches[b][i]->value = i;
+                }
+        }
+        alloc = now_ns() - start;
+
+        for (int pass = 0; pass < CONTIG_PASSES; pass++) {
+                start = now_ns();
+                for (int b = 0; b < CONTIG_BATCHES; b++) {
+                        for (int i = 0; i < CONTIG_BATCH; i++) {
+                                sum += batches[b][i]->value;
+                        }
+                }
+                if (now_ns() - start < best) best = now_ns() - start;
+        }
+
+        printf("%s alloc %6.2f ns/object, process %6.2f ns/object (checksum %lu)\n",
+               contig ? "contiguous runs:" : "one at a time:  ",
+               (double)alloc / (CONTIG_BATCHES * CONTIG_BATCH),
+               (double)best / (CONTIG_BATCHES * CONTIG_BATCH), sum);
+
+        for (int b = 0; b < CONTIG_BATCHES; b++) {
+                if (contig) {
+                        kmem_cache_free_contig(cp, batches[b][0], CONTIG_BATCH);
+                } else {
+                        kmem_cache_free_bulk(cp, CONTIG_BATCH, (void **)batches[b]);
+                }
+        }
+        kmem_cache_destroy(cp);
+}
+
+/**
+ * Fill a large object cache from a page provider, then chase
+ * pointers through the objects in random order. Every step is a
+ * cache miss, and with enough memory a TLB miss too, unless
+ * the slabs sit on huge pages
+ */
+#define PAGES_ITEMS (128 * 1024)
+#define PAGES_STEPS (8 * 1024 * 1024)
+static void
+bench_pages(const struct kmem_page_provider *pp)
+{
+        static void **items[PAGES_ITEMS];
+        struct kmem_cache *cp;
+        uint64_t seed = 88172645463325252ull;
+        uint64_t alloc;
+        uint64_t walk;
+        uint64_t start;
+        void **at;
+        void **swap;
+        size_t j;
+
+        cp = kmem_cache_create_attr("bench pages", &(struct kmem_cache_attr){
+                .size = 512,
+                .provider = pp,
+        });
+        start = now_ns();
+        for (int i = 0; i < PAGES_ITEMS; i++) {
+                items[i] = kmem_cache_alloc(cp, KM_SLEEP);
+                *items[i] = NULL;
+        }
+        alloc = now_ns() - start;
+
+        // One random cycle through every object
+        for (int i = PAGES_ITEMS - 1; i > 0; i--) {
+                j = near_random(&seed) % i;
+                swap = items[i];
+                items[i] = items[j];
+                items[j] = swap;
+        }
+        for (int i = 0; i < PAGES_ITEMS; i++) {
+                *items[i] = items[(i + 1) % PAGES_ITEMS];
+        }
+
+        at = items[0];
+        start = now_ns();
+        for (int i = 0; i < PAGES_STEPS; i++) {
+                at = *at;
+        }
+        walk = now_ns() - start;
+        __asm__ volatile("" : : "r"(at) : "memory");
+
+        kmem_cache_free_bulk(cp, PAGES_ITEMS, (void **)items);
+        kmem_cache_destroy(cp);
+
+        printf("%-7s alloc %6.1f ns/object, random walk %6.2f ns/step\n", pp->name,
+               (double)alloc / PAGES_ITEMS, (double)walk / PAGES_STEPS);
+}
+
+/**
+ * A workload that leaves the 128 byte class with lots of free
+ * objects, then wants 96 byte ones: pages held by the two
+ * classes, and what an allocation costs, with and without
+ * fallback
+ */
+#define FALLBACK_ITEMS 65536
+static void
+bench_fallback(unsigned classes)
+{
+        static void *items[FALLBACK_ITEMS];
+        struct kmem_alloc_fallback_stats before;
+        struct kmem_alloc_fallback_stats after;
+        struct kmem_cache_stats small;
+        struct kmem_cache_stats big;
+        uint64_t seed = 88172645463325252ull;
+        uint64_t start;
+        uint64_t elapsed;
+        void *swap;
+        size_t j;
+
+        kmem_alloc_set_fallback(classes);
+        kmem_alloc_fallback_stats(&before);
+
+        // Free a random three quarters of a lot of 128 byte objects
+        for (int i = 0; i < FALLBACK_ITEMS; i++) {
+                items[i] = kmem_alloc(128, KM_SLEEP);
+        }
+        for (int i = FALLBACK_ITEMS - 1; i > 0; i--) {
+                j = near_random(&seed) % i;
+                swap = items[i];
+                items[i] = items[j];
+                items[j] = swap;
+        }
+        for (int i = FALLBACK_ITEMS / 4; i < FALLBACK_ITEMS; i++) {
+                kmem_free(items[i], 128);
+        }
+
+        start = now_ns();
+        for (int i = FALLBACK_ITEMS / 4; i < FALLBACK_ITEMS; i++) {
+                items[i] = kmem_alloc(96, KM_SLEEP);
+        }
+        elapsed = now_ns() - start;
+
+        kmem_alloc_fallback_stats(&after);
+        kmem_cache_get_stats(kmem_alloc_cache(96), &small);
+        kmem_cache_get_stats(kmem_alloc_cache(128), &big);
+        printf("fallback %u: %5lu pages, %6.1f ns/alloc, %lu borrowed, %lu KB served, %lu pages saved\n",
+               classes, small.pages + big.pages, (double)elapsed / (FALLBACK_ITEMS * 3 / 4),
+               after.borrows - before.borrows, (after.bytes_borrowed - before.bytes_borrowed) / 1024,
+               after.pages_saved - before.pages_saved);
+
+        for (int i = 0; i < FALLBACK_ITEMS; i++) {
+                kmem_free(items[i], i < FALLBACK_ITEMS / 4 ? 128 : 96);
+        }
+        kmem_cache_shrink(kmem_alloc_cache(96));
+        kmem_cache_shrink(kmem_alloc_cache(128));
+        kmem_alloc_set_fallback(0);
+}
+
+int
+main(int argc, char **argv)
+{
+        // Optionally, only run the named benchmark
+        char *only = argc > 1 ? argv[1] : NULL;
+
+        if (!only || !strcmp(only, "bulk")) {
+                printf("\n----------\nBulk Free (large objects)\n----------\n\n");
+                bench_bulk_free();
+        }
+
+        if (!only || !strcmp(only, "lifetime")) {
+                printf("\n----------\nLifetime Hints\n----------\n\n");
+                bench_lifetime(0);
+                bench_lifetime(1);
+        }
+
+        if (!only || !strcmp(only, "hooks")) {
+                printf("\n----------\nHooks\n----------\n\n");
+                bench_hooks();
+        }
+
+        if (!only || !strcmp(only, "growth")) {
+                printf("\n----------\nSlab Growth (large objects)\n----------\n\n");
+                bench_growth(0);
+                bench_growth(1);
+        }
+
+        if (!only || !strcmp(only, "trace")) {
+                printf("\n----------\nTracing\n----------\n\n");
+                bench_trace();
+        }
+
+        if (!only || !strcmp(only, "cpuslab")) {
+                printf("\n----------\nCPU Slabs (small objects)\n----------\n\n");
+                bench_cpuslab();
+        }
+
+        if (!only || !strcmp(only, "near")) {
+                printf("\n----------\nAllocation Hints (tree walks)\n----------\n\n");
+                bench_near(0);
+                bench_near(1);
+        }
+
+        if (!only || !strcmp(only, "contig")) {
+                printf("\n----------\nContiguous Runs (small objects)\n----------\n\n");
+                bench_contig(0);
+                bench_contig(1);
+        }
+
+        if (!only || !strcmp(only, "pages")) {
+                printf("\n----------\nPage Providers (64MB of large objects)\n----------\n\n");
+                bench_pages(&kmem_pages_malloc);
+                bench_pages(&kmem_pages_mmap);
+                bench_pages(&kmem_pages_huge);
+        }
+
+        if (!only || !strcmp(only, "fallback")) {
+                printf("\n----------\nClass Fallback (kmem_alloc)\n----------\n\n");
+                bench_fallback(0);
+                bench_fallback(1);
+                bench_fallback(2);
+        }
+
+        if (!only || !strcmp(only, "single")) {
+                printf("\n----------\nSingle-Thread Caches\n----------\n\n");
+                bench_single(0);
+                bench_single(KM_CACHE_SINGLE_THREAD);
+        }
+}
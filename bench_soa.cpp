@@ -0,0 +1,80 @@
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <vector>
+
+#include "soa.hpp"
+
+/**
+ * Sum one float field over a million objects, each scan the best
+ * of a few: whole objects from a plain cache, read through the
+ * pointers they were handed out as, vs. the field's arrays in a
+ * soa_cache
+ */
+#define SOA_OBJECTS (1 << 20)
+#define SOA_SCANS 7
+
+struct body {
+        float x, y, z;
+        float vx, vy, vz;
+        float mass;
+        uint32_t flags;
+        double spare[4];
+};
+
+using bodies = kmem::soa_cache<body, &body::x, &body::vx, &body::mass>;
+
+static uint64_t
+now_ns()
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int
+main()
+{
+        std::vector<body *> objects;
+        std::vector<bodies::handle> handles;
+        kmem_cache *cp;
+        uint64_t best;
+        uint64_t start;
+        float sum;
+
+        printf("\n----------\nStructure of Arrays (field scans)\n----------\n\n");
+
+        cp = kmem_cache_create((char *)"bench aos", sizeof(body), 0);
+        for (int i = 0; i < SOA_OBJECTS; i++) {
+                objects.push_back(static_cast<body *>(kmem_cache_alloc(cp, KM_SLEEP)));
+                objects.back()->x = i & 0xff;
+        }
+        best = UINT64_MAX;
+        sum = 0;
+        for (int scan = 0; scan < SOA_SCANS; scan++) {
+                start = now_ns();
+                for (body *b : objects) sum += b->x;
+                if (now_ns() - start < best) best = now_ns() - start;
+        }
+        printf("%zu byte objects:  %6.3f ns/object (sum %.0f)\n",
+               sizeof(body), (double)best / SOA_OBJECTS, sum);
+        for (body *b : objects) kmem_cache_free(cp, b);
+        kmem_cache_destroy(cp);
+
+        bodies soa("bench soa");
+        for (int i = 0; i < SOA_OBJECTS; i++) {
+                handles.push_back(soa.alloc());
+                soa.get<&body::x>(handles.back()) = i & 0xff;
+        }
+        best = UINT64_MAX;
+        sum = 0;
+        for (int scan = 0; scan < SOA_SCANS; scan++) {
+                start = now_ns();
+                for (auto span : soa.spans<&body::x>()) {
+                        for (float x : span) sum += x;
+                }
+                if (now_ns() - start < best) best = now_ns() - start;
+        }
+        printf("soa_cache spans:   %6.3f ns/object (sum %.0f)\n", (double)best / SOA_OBJECTS, sum);
+}
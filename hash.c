@@ -1,20 +1,98 @@
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "slab.h"
 #include "hash.h"
 
+static inline size_t
+__hash_nbuckets(struct kmem_hash *hash)
+{
+        return (size_t)1 << (64 - hash->shift);
+}
+
+/**
+ * Fibonacci hashing: the top bits of the address times 2^64/phi
+ * Bufs are at least 8 byte aligned, and large ones a lot more, so
+ * the low bits of the address alone would leave most buckets empty
+ */
+static inline size_t
+__hash_bucket(struct kmem_hash *hash, void *key)
+{
+        return ((uint64_t)(uintptr_t)key * 0x9e3779b97f4a7c15ull) >> hash->shift;
+}
+
+static void
+__hash_free_nodes(struct kmem_hash *hash, struct kmem_hash_node *node)
+{
+        struct kmem_hash_node *temp;
+
+        while (node) {
+                temp = node->retired_next;
+                kmem_cache_free(hash->node_cache, node);
+                node = temp;
+        }
+}
+
+/**
+ * Register a lookup on the current epoch's side of readers[]
+ * The fence pairs with the one in kmem_hash_reclaim: either that
+ * writer sees this reader, or this reader sees every unlink made
+ * before the writer looked
+ * Returns the side, for __hash_read_unlock
+ */
+static inline unsigned
+__hash_read_lock(struct kmem_hash *hash)
+{
+        unsigned side;
+
+        side = atomic_load_explicit(&hash->epoch, memory_order_acquire) & 1;
+        atomic_fetch_add_explicit(&hash->readers[side], 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        return side;
+}
+
+static inline void
+__hash_read_unlock(struct kmem_hash *hash, unsigned side)
+{
+        atomic_fetch_sub_explicit(&hash->readers[side], 1, memory_order_release);
+}
+
 struct kmem_hash *
-kmem_hash_init(struct kmem_cache *hash_cache, struct kmem_cache *node_cache)
+kmem_hash_init(struct kmem_cache *hash_cache, struct kmem_cache *node_cache, size_t nbuckets)
 {
+        unsigned bits;
+        size_t i;
+
         DEBUG_PRINT("Allocating hash from cache %s\n", hash_cache->name);
         struct kmem_hash *hash = kmem_cache_alloc(hash_cache, KM_NOSLEEP);
         if (!hash) {
                 DEBUG_PRINT("Unable to init hash\n");
+                return NULL;
+        }
+
+        for (bits = 0; ((size_t)1 << bits) < KM_NUM_BUCKETS || ((size_t)1 << bits) < nbuckets; bits++);
+        hash->shift = 64 - bits;
+        hash->buckets = hash->inline_buckets;
+        if (__hash_nbuckets(hash) > KM_NUM_BUCKETS) {
+                hash->buckets = malloc(__hash_nbuckets(hash) * sizeof(hash->buckets[0]));
+                if (!hash->buckets) {
+                        DEBUG_PRINT("Unable to allocate %lu buckets\n", __hash_nbuckets(hash));
+                        kmem_cache_free(hash_cache, hash);
+                        return NULL;
+                }
         }
+        DEBUG_PRINT("Hash %p has %lu buckets\n", (void*)hash, __hash_nbuckets(hash));
 
         hash->node_cache = node_cache;
-        memset(hash->buckets, 0, sizeof(struct kmem_hash_node*) * KM_NUM_BUCKETS);
+        hash->retired = NULL;
+        hash->waiting = NULL;
+        atomic_init(&hash->epoch, 0);
+        atomic_init(&hash->readers[0], 0);
+        atomic_init(&hash->readers[1], 0);
+        for (i = 0; i < __hash_nbuckets(hash); i++) {
+                atomic_init(&hash->buckets[i], NULL);
+        }
 
         return hash;
 }
@@ -24,75 +102,184 @@ kmem_hash_free(struct kmem_cache *hash_cache, struct kmem_hash *hash)
 {
         struct kmem_hash_node *node;
         struct kmem_hash_node *temp;
-        int i;
+        size_t i;
 
-        for (i = 0; i < KM_NUM_BUCKETS; i++) {
-                node = hash->buckets[i];
+        // Nobody should be looking anymore, so skip the reader checks
+        for (i = 0; i < __hash_nbuckets(hash); i++) {
+                node = atomic_load_explicit(&hash->buckets[i], memory_order_relaxed);
                 while(node) {
-                        temp = node->next;
+                        temp = atomic_load_explicit(&node->next, memory_order_relaxed);
                         kmem_cache_free(hash->node_cache, node);
                         node = temp;
                 }
         }
 
+        __hash_free_nodes(hash, hash->retired);
+        __hash_free_nodes(hash, hash->waiting);
+
+        if (hash->buckets != hash->inline_buckets) {
+                free(hash->buckets);
+        }
         kmem_cache_free(hash_cache, hash);
 }
 
 void
 kmem_hash_insert(struct kmem_hash *hash, void *key, void *data)
 {
-        unsigned bucket;
+        size_t bucket;
         struct kmem_hash_node *node;
         struct kmem_hash_node *old_head;
 
-        bucket = (uintptr_t)key % KM_NUM_BUCKETS;
+        bucket = __hash_bucket(hash, key);
 
         node = kmem_cache_alloc(hash->node_cache, KM_SLEEP);
         node->bufaddr = key;
         node->value = data;
+        node->retired_next = NULL;
 
-        old_head = hash->buckets[bucket];
-        hash->buckets[bucket] = node;
-        node->next = old_head;
+        // Fill the node in completely before publishing it, so
+        // a concurrent reader never sees a half built node
+        old_head = atomic_load_explicit(&hash->buckets[bucket], memory_order_relaxed);
+        atomic_store_explicit(&node->next, old_head, memory_order_relaxed);
+        atomic_store_explicit(&hash->buckets[bucket], node, memory_order_release);
 }
 
 void *
 kmem_hash_get(struct kmem_hash *hash, void *key)
 {
-        unsigned bucket;
+        size_t bucket;
         struct kmem_hash_node *node;
+        unsigned side;
+        void *value;
+
+        bucket = __hash_bucket(hash, key);
+        value = NULL;
 
-        bucket = (uintptr_t)key % KM_NUM_BUCKETS;
-        node = hash->buckets[bucket];
+        side = __hash_read_lock(hash);
+
+        node = atomic_load_explicit(&hash->buckets[bucket], memory_order_acquire);
         while (node) {
-                if (node->bufaddr == key) return node->value;
-                node = node->next;
+                if (node->bufaddr == key) {
+                        value = node->value;
+                        break;
+                }
+                node = atomic_load_explicit(&node->next, memory_order_acquire);
+        }
+
+        __hash_read_unlock(hash, side);
+        return value;
+}
+
+void *
+kmem_hash_get_local(struct kmem_hash *hash, void *key)
+{
+        struct kmem_hash_node *node;
+
+        node = atomic_load_explicit(&hash->buckets[__hash_bucket(hash, key)], memory_order_relaxed);
+        while (node && node->bufaddr != key) {
+                node = atomic_load_explicit(&node->next, memory_order_relaxed);
+        }
+        return node ? node->value : NULL;
+}
+
+void
+kmem_hash_get_many(struct kmem_hash *hash, void **keys, void **values, size_t n)
+{
+        struct kmem_hash_node *node;
+        unsigned side;
+        size_t pending;
+        size_t i;
+
+        side = __hash_read_lock(hash);
+
+        // values doubles as the cursor for each chain until
+        // that key is resolved
+        for (i = 0; i < n; i++) {
+                node = atomic_load_explicit(&hash->buckets[__hash_bucket(hash, keys[i])],
+                                            memory_order_acquire);
+                __builtin_prefetch(node);
+                values[i] = node;
         }
 
-        return NULL;
+        pending = n;
+        while (pending) {
+                pending = 0;
+                for (i = 0; i < n; i++) {
+                        node = values[i];
+                        if (!node || node->bufaddr == keys[i]) continue;
+
+                        node = atomic_load_explicit(&node->next, memory_order_acquire);
+                        __builtin_prefetch(node);
+                        values[i] = node;
+                        pending++;
+                }
+        }
+
+        // Every cursor now sits on its match, or ran off the end
+        for (i = 0; i < n; i++) {
+                node = values[i];
+                values[i] = node ? node->value : NULL;
+        }
+
+        __hash_read_unlock(hash, side);
 }
 
 void
 kmem_hash_remove(struct kmem_hash *hash, void *bufaddr)
 {
-        uintptr_t bucket;
-        struct kmem_hash_node *last;
+        size_t bucket;
+        _Atomic(struct kmem_hash_node *) *link;
         struct kmem_hash_node *node;
+        struct kmem_hash_node *next;
 
-        bucket = (uintptr_t)bufaddr % KM_NUM_BUCKETS;
-        last = NULL;
-        node = hash->buckets[bucket];
+        bucket = __hash_bucket(hash, bufaddr);
+        link = &hash->buckets[bucket];
+        node = atomic_load_explicit(link, memory_order_relaxed);
         while (node) {
+                next = atomic_load_explicit(&node->next, memory_order_relaxed);
                 if (node->bufaddr == bufaddr) {
-                        if (last) {
-                                last->next = node->next;
-                        } else {
-                                hash->buckets[bucket] = node->next;
-                        }
-                        kmem_cache_free(hash->node_cache, node);
+                        // Readers already on this node can still follow
+                        // its next pointer, so leave that alone
+                        atomic_store_explicit(link, next, memory_order_release);
+                        node->retired_next = hash->retired;
+                        hash->retired = node;
+                        kmem_hash_reclaim(hash);
                         return;
                 }
-                last = node;
-                node = node->next;
+                link = &node->next;
+                node = next;
+        }
+}
+
+/**
+ * Lookups that started in the current epoch can't have seen
+ * anything unlinked before it began, so once the ones from the
+ * epoch before are done, the nodes waiting on them can go.
+ * Then the nodes retired this epoch start waiting, and the epoch
+ * moves on, so new lookups count on the side just checked and the
+ * other side drains. A lookup that read the epoch just before a
+ * flip and counted itself late is still safe: the fence means it
+ * sees every unlink from before the check it missed.
+ * Two rounds, so with no lookups about everything goes at once
+ */
+void
+kmem_hash_reclaim(struct kmem_hash *hash)
+{
+        unsigned epoch;
+        int round;
+
+        for (round = 0; round < 2 && (hash->retired || hash->waiting); round++) {
+                atomic_thread_fence(memory_order_seq_cst);
+                epoch = atomic_load_explicit(&hash->epoch, memory_order_relaxed);
+                if (atomic_load_explicit(&hash->readers[(epoch + 1) & 1], memory_order_acquire)) {
+                        DEBUG_PRINT("Hash %p has readers from epoch %u, deferring reclaim\n",
+                                    (void*)hash, epoch - 1);
+                        return;
+                }
+
+                __hash_free_nodes(hash, hash->waiting);
+                hash->waiting = hash->retired;
+                hash->retired = NULL;
+                atomic_store_explicit(&hash->epoch, epoch + 1, memory_order_release);
         }
 }
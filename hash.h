@@ -1,6 +1,7 @@
 #ifndef PLOPREIATO_SLAB_HASH_H
 #define PLOPREIATO_SLAB_HASH_H
 
+#include <stdatomic.h>
 #include <string.h>
 
 #include "slab.h"
@@ -8,26 +9,57 @@
 /**
  * A super basic hash table implementation
  * This provides the mapping between buf -> bufctl
- * for larger caches. Keep the table simple, with
- * a static number of buckets (for now). We use
- * addresses of the target buf as the key
+ * for larger caches. Keep the table simple: the
+ * number of buckets is fixed when it's made (see
+ * kmem_cache_attr.nobjs), a power of two, and the
+ * addresses of the target bufs are the keys,
+ * multiplied out so aligned bufs still spread
+ *
+ * Lookups are lock-free and may run concurrently with
+ * inserts and removes. Writers must still be serialized
+ * against each other (the owning cache's lock does that).
+ * Removed nodes are unlinked right away but only returned
+ * to the node cache once no reader can still be walking
+ * over them, RCU style. Readers count themselves on the
+ * side of readers[] the current epoch picks, so writers
+ * only ever wait for the lookups that started before the
+ * last epoch flip, and those drain even under a steady
+ * stream of new ones.
  */
 
 #define KM_NUM_BUCKETS 32
 
 struct kmem_hash_node {
-        void *bufaddr;               /* Address of the membuf */
-        void *value;                 /* Address of the bufctl or slab */
-        struct kmem_hash_node *next; /* Next item in the list */
+        void *bufaddr;                          /* Address of the membuf */
+        void *value;                            /* Address of the bufctl or slab */
+        _Atomic(struct kmem_hash_node *) next;  /* Next item in the list */
+        struct kmem_hash_node *retired_next;    /* Next node waiting to be
+                                                 * reclaimed. Separate from
+                                                 * next, since readers may
+                                                 * still follow that one
+                                                 */
 };
 
 struct kmem_hash {
-        struct kmem_hash_node *buckets[KM_NUM_BUCKETS];
+        _Atomic(struct kmem_hash_node *) *buckets; /* inline, unless there are more */
+        unsigned shift;                 /* 64 - log2(number of buckets) */
+        _Atomic(struct kmem_hash_node *) inline_buckets[KM_NUM_BUCKETS];
         struct kmem_cache *node_cache;
+        atomic_uint epoch;              /* Bumped by writers, see kmem_hash_reclaim */
+        atomic_uint readers[2];         /* Lookups in flight, by epoch & 1 */
+        struct kmem_hash_node *retired; /* Unlinked this epoch */
+        struct kmem_hash_node *waiting; /* Unlinked last epoch, freed once the
+                                         * lookups from before it are done
+                                         */
 };
 
+/**
+ * Make a table with room for about nbuckets entries before
+ * chains get long. Rounded up to a power of two, and never
+ * fewer than KM_NUM_BUCKETS
+ */
 struct kmem_hash *
-kmem_hash_init(struct kmem_cache *hash_cache, struct kmem_cache *node_cache);
+kmem_hash_init(struct kmem_cache *hash_cache, struct kmem_cache *node_cache, size_t nbuckets);
 
 void
 kmem_hash_free(struct kmem_cache *hash_cache, struct kmem_hash *hash);
@@ -35,6 +67,7 @@ kmem_hash_free(struct kmem_cache *hash_cache, struct kmem_hash *hash);
 /**
  * Insert a bufctl into the hash table
  * ASSUMES it is not already present
+ * ASSUMES the caller serializes writers
  */
 void
 kmem_hash_insert(struct kmem_hash *hash, void *bufaddr, void *data);
@@ -42,14 +75,43 @@ kmem_hash_insert(struct kmem_hash *hash, void *bufaddr, void *data);
 /**
  * Get a bufctl from a given membuf address
  * Returns NULL if not found
+ * Takes no locks, so it's fine to call while
+ * another thread inserts or removes
  */
 void *
 kmem_hash_get(struct kmem_hash *hash, void *bufaddr);
 
+/**
+ * kmem_hash_get without the reader count, for tables only one
+ * thread ever touches (KM_CACHE_SINGLE_THREAD caches)
+ */
+void *
+kmem_hash_get_local(struct kmem_hash *hash, void *bufaddr);
+
+/**
+ * Look up n membuf addresses at once, storing the matching
+ * bufctls (or NULL) in values. Every bucket head is loaded and
+ * prefetched up front, then the chains are walked a step at a
+ * time round-robin, so the cache misses overlap instead of
+ * each one waiting on the last
+ */
+void
+kmem_hash_get_many(struct kmem_hash *hash, void **keys, void **values, size_t n);
+
 /**
  * Remove the bufctl for the given address from the table
+ * ASSUMES the caller serializes writers
  */
 void
 kmem_hash_remove(struct kmem_hash *hash, void *bufaddr);
 
+/**
+ * Free whatever removed nodes no lookup can still reach
+ * Removes already do this, it's for callers that want the
+ * memory back without removing anything (cache shrinks)
+ * ASSUMES the caller serializes writers
+ */
+void
+kmem_hash_reclaim(struct kmem_hash *hash);
+
 #endif
@@ -0,0 +1,220 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "slab.h"
+#include "kmem_alloc.h"
+#include "trace.h"
+
+#ifdef KM_SIZES_HEADER
+#include KM_SIZES_HEADER
+#else
+#include "kmem_sizes.h"
+#endif
+
+#define KM_ALLOC_NAME_LEN 32
+
+static const size_t size_classes[] = { KM_SIZE_CLASSES };
+#define KM_NR_CLASSES (sizeof(size_classes) / sizeof(size_classes[0]))
+#define KM_MAX_CLASS (size_classes[KM_NR_CLASSES - 1])
+
+static struct kmem_cache *class_caches[KM_NR_CLASSES];
+static char class_names[KM_NR_CLASSES][KM_ALLOC_NAME_LEN];
+
+/* (size + 7) / 8 -> index of the class it rounds up to */
+static unsigned char *class_index;
+static pthread_once_t class_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Class fallback: how many larger classes an empty class may
+ * borrow from, and whether it's ever been on, after which frees
+ * have to check where each buf really came from. fallback_used
+ * is set before fallback_classes is published (release/acquire
+ * on both), so a thread freeing a borrowed buf always sees it
+ */
+static atomic_uint fallback_classes;
+static atomic_int fallback_used;
+static atomic_ulong fallback_borrows;
+static atomic_ulong fallback_grows;
+static atomic_size_t fallback_borrowed;
+static atomic_ulong class_borrows[KM_NR_CLASSES];   /* By the borrowing class */
+
+static void
+__classes_init()
+{
+        size_t i;
+        size_t c;
+
+        // Class indexes have to fit the lookup table
+        _Static_assert(KM_NR_CLASSES <= 256, "too many size classes");
+
+        class_index = malloc(KM_MAX_CLASS / 8 + 1);
+        if (!class_index) {
+                fprintf(stderr, "kmem_alloc: unable to allocate size class table\n");
+                abort();
+        }
+        for (i = 0, c = 0; i <= KM_MAX_CLASS / 8; i++) {
+                while (size_classes[c] < i * 8) c++;
+                class_index[i] = c;
+        }
+
+        for (c = 0; c < KM_NR_CLASSES; c++) {
+                snprintf(class_names[c], KM_ALLOC_NAME_LEN, "kmem_alloc-%lu", size_classes[c]);
+                class_caches[c] = kmem_cache_create(class_names[c], size_classes[c], 0);
+        }
+        DEBUG_PRINT("kmem_alloc has %lu size classes, up to %lu bytes\n", KM_NR_CLASSES, KM_MAX_CLASS);
+}
+
+static inline struct kmem_cache *
+__class_cache(size_t size)
+{
+        return class_caches[class_index[(size + 7) / 8]];
+}
+
+/**
+ * Allocate from class c without growing it if one of the next
+ * n classes has a free object. Only classes with the same slab
+ * layout are borrowed from, so kmem_cache_owns can sort out
+ * which one a buf goes back to
+ */
+static void *
+__class_alloc_fallback(size_t c, unsigned n, int flags)
+{
+        struct kmem_cache *cp = class_caches[c];
+        void *buf;
+        size_t d;
+
+        buf = kmem_cache_alloc(cp, flags | KM_NOGROW);
+        if (buf) return buf;
+
+        for (d = c + 1; d <= c + n && d < KM_NR_CLASSES; d++) {
+                if (class_caches[d]->ops != cp->ops) break;
+                buf = kmem_cache_alloc(class_caches[d], flags | KM_NOGROW);
+                if (buf) {
+                        DEBUG_PRINT("kmem_alloc-%lu borrowed from kmem_alloc-%lu\n",
+                                    size_classes[c], size_classes[d]);
+                        atomic_fetch_add_explicit(&fallback_borrows, 1, memory_order_relaxed);
+                        atomic_fetch_add_explicit(&fallback_borrowed, size_classes[c], memory_order_relaxed);
+                        atomic_fetch_add_explicit(&class_borrows[c], 1, memory_order_relaxed);
+                        return buf;
+                }
+        }
+
+        atomic_fetch_add_explicit(&fallback_grows, 1, memory_order_relaxed);
+        return kmem_cache_alloc(cp, flags);
+}
+
+/**
+ * The class cache a buf from class c really belongs to
+ */
+static struct kmem_cache *
+__class_owner(size_t c, void *buf)
+{
+        size_t d;
+
+        for (d = c; d <= c + KM_ALLOC_MAX_FALLBACK && d < KM_NR_CLASSES; d++) {
+                if (class_caches[d]->ops != class_caches[c]->ops) break;
+                if (kmem_cache_owns(class_caches[d], buf)) return class_caches[d];
+        }
+        DEBUG_PRINT("kmem_free: %p isn't from kmem_alloc-%lu or its fallbacks\n", buf, size_classes[c]);
+        return class_caches[c];
+}
+
+void *
+kmem_alloc(size_t size, int flags)
+{
+        struct kmem_cache *cp;
+        unsigned n;
+        size_t c;
+        void *buf;
+
+        pthread_once(&class_once, __classes_init);
+
+        if (__builtin_expect(size > KM_MAX_CLASS, 0)) {
+                buf = malloc(size);
+                KM_TRACE(KM_TRACE_KMEM_ALLOC, NULL, buf, (void*)(uintptr_t)size);
+                return buf;
+        }
+
+        c = class_index[(size + 7) / 8];
+        n = atomic_load_explicit(&fallback_classes, memory_order_acquire);
+        cp = class_caches[c];
+        buf = n ? __class_alloc_fallback(c, n, flags) : kmem_cache_alloc(cp, flags);
+        KM_TRACE(KM_TRACE_KMEM_ALLOC, cp, buf, (void*)(uintptr_t)size);
+        return buf;
+}
+
+void
+kmem_free(void *buf, size_t size)
+{
+        size_t c;
+
+        if (!buf) return;
+
+        if (__builtin_expect(size > KM_MAX_CLASS, 0)) {
+                free(buf);
+                return;
+        }
+        c = class_index[(size + 7) / 8];
+        if (__builtin_expect(atomic_load_explicit(&fallback_used, memory_order_acquire), 0)) {
+                kmem_cache_free(__class_owner(c, buf), buf);
+                return;
+        }
+        kmem_cache_free(class_caches[c], buf);
+}
+
+size_t
+kmem_alloc_class(size_t size)
+{
+        pthread_once(&class_once, __classes_init);
+
+        if (size > KM_MAX_CLASS) return 0;
+        return size_classes[class_index[(size + 7) / 8]];
+}
+
+struct kmem_cache *
+kmem_alloc_cache(size_t size)
+{
+        pthread_once(&class_once, __classes_init);
+
+        if (size > KM_MAX_CLASS) return NULL;
+        return __class_cache(size);
+}
+
+int
+kmem_alloc_set_fallback(unsigned classes)
+{
+        if (classes > KM_ALLOC_MAX_FALLBACK) return -1;
+
+        if (classes) atomic_store_explicit(&fallback_used, 1, memory_order_release);
+        atomic_store_explicit(&fallback_classes, classes, memory_order_release);
+        return 0;
+}
+
+void
+kmem_alloc_fallback_stats(struct kmem_alloc_fallback_stats *stats)
+{
+        size_t pagesize = sysconf(_SC_PAGESIZE);
+        unsigned long borrows;
+        size_t per_page;
+        size_t c;
+
+        // Bufs don't straddle pages, so a class needs a page per
+        // pagesize / size of them (slab headers aside, so it's a
+        // slight underestimate), or pages apiece past a page
+        stats->pages_saved = 0;
+        for (c = 0; c < KM_NR_CLASSES; c++) {
+                borrows = atomic_load_explicit(&class_borrows[c], memory_order_relaxed);
+                per_page = pagesize / size_classes[c];
+                stats->pages_saved += per_page
+                        ? borrows / per_page
+                        : borrows * ((size_classes[c] + pagesize - 1) / pagesize);
+        }
+        stats->classes = atomic_load_explicit(&fallback_classes, memory_order_relaxed);
+        stats->borrows = atomic_load_explicit(&fallback_borrows, memory_order_relaxed);
+        stats->grows = atomic_load_explicit(&fallback_grows, memory_order_relaxed);
+        stats->bytes_borrowed = atomic_load_explicit(&fallback_borrowed, memory_order_relaxed);
+}
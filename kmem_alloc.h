@@ -0,0 +1,112 @@
+#ifndef PLOPREIATO_SLAB_KMEM_ALLOC_H
+#define PLOPREIATO_SLAB_KMEM_ALLOC_H
+
+#include <stddef.h>
+
+#include "slab.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * General purpose allocation, for when there's no one type to
+ * make a cache for. Requests are rounded up to a size class
+ * (see kmem_sizes.h), each class backed by its own cache, and
+ * anything bigger than the largest class goes to malloc.
+ *
+ * Frees are sized, like kmem_vcache_free: pass the size the
+ * buf was allocated with.
+ */
+
+/**
+ * Allocate size bytes, flags as for kmem_cache_alloc
+ */
+void *
+kmem_alloc(
+        size_t size,
+        int flags
+);
+
+/**
+ * Free a buf from kmem_alloc(size, ...)
+ */
+void
+kmem_free(
+        void *buf,
+        size_t size
+);
+
+/**
+ * The size class a request for size bytes gets, so callers can
+ * use the slack. 0 if it's too big for any class
+ */
+size_t
+kmem_alloc_class(
+        size_t size
+);
+
+/**
+ * The cache behind a size class, for stats, hooks and accounts.
+ * NULL if it's too big for any class
+ */
+struct kmem_cache *
+kmem_alloc_cache(
+        size_t size
+);
+
+/**
+ * Class fallback
+ * With it on, a class with no free objects borrows one from the
+ * next one or two larger classes, if they have free objects,
+ * before it grows a slab of its own. A 96 byte request can then
+ * take a spare 128 byte object instead of a fresh page. Only
+ * classes with the same slab layout lend to each other (the
+ * stock small/large split is at 512 bytes).
+ *
+ * Frees stay sized, with the size asked for: once fallback has
+ * been on, kmem_free checks which class each buf came from, which
+ * costs a slab header read on small classes and a hash lookup on
+ * large ones. That check stays on even if fallback is turned off
+ * again, since borrowed objects may still be out.
+ */
+#define KM_ALLOC_MAX_FALLBACK 2
+
+struct kmem_alloc_fallback_stats {
+        unsigned classes;           /* As set by kmem_alloc_set_fallback */
+        unsigned long borrows;      /* Allocations served by a larger class */
+        unsigned long grows;        /* Nothing to borrow, so the class grew */
+        size_t bytes_borrowed;      /* Bytes served by borrowing (the
+                                     * borrowing class's size each time),
+                                     * since start, frees don't take it
+                                     * back down
+                                     */
+        size_t pages_saved;         /* Pages the borrowing classes would
+                                     * have grown to hold those objects
+                                     * themselves, rounded down per class
+                                     */
+};
+
+/**
+ * Let empty classes borrow from up to classes larger ones,
+ * 0 (the default) to turn fallback off
+ * Returns 0 on success, -1 past KM_ALLOC_MAX_FALLBACK
+ */
+int
+kmem_alloc_set_fallback(
+        unsigned classes
+);
+
+/**
+ * Snapshot the fallback counters, summed over every class
+ */
+void
+kmem_alloc_fallback_stats(
+        struct kmem_alloc_fallback_stats *stats
+);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef PLOPREIATO_SLAB_KMEM_SHM_H
+#define PLOPREIATO_SLAB_KMEM_SHM_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/**
+ * Layout of the shared memory segment the allocator publishes
+ * per-cache counters into (see kmem_stats_publish), and that
+ * kmemtop maps read-only
+ *
+ * Each slot is a seqlock: the writer (always holding that cache's
+ * lock) bumps seq to odd, updates the counters and bumps it back to
+ * even. Readers retry until they see the same even seq on both
+ * sides of their copy.
+ */
+
+#define KM_SHM_MAGIC 0x6b6d656d /* "kmem" */
+#define KM_SHM_VERSION 1
+#define KM_SHM_MAX_CACHES 128
+#define KM_SHM_NAME_LEN 32
+
+struct kmem_shm_cache {
+        atomic_uint seq;                /* Odd while an update is in progress */
+        atomic_uint active;             /* 0 once the cache is destroyed */
+        _Atomic uint64_t id;            /* Changes whenever the slot is reused */
+        char name[KM_SHM_NAME_LEN];
+        _Atomic uint64_t object_size;
+        _Atomic uint64_t objects;       /* Allocated right now */
+        _Atomic uint64_t slabs;
+        _Atomic uint64_t allocs;        /* Totals since the cache was created */
+        _Atomic uint64_t frees;
+};
+
+struct kmem_shm_header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t max_caches;
+        uint32_t pid;
+        struct kmem_shm_cache caches[KM_SHM_MAX_CACHES];
+};
+
+#endif
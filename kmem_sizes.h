@@ -0,0 +1,13 @@
+#ifndef PLOPREIATO_SLAB_KMEM_SIZES_H
+#define PLOPREIATO_SLAB_KMEM_SIZES_H
+
+/**
+ * Size classes for kmem_alloc, smallest first, each a multiple of 8
+ * This is the stock ladder: powers of 2 with a step halfway between
+ * each. kmemtune writes a replacement tuned to a recorded trace;
+ * build with -DKM_SIZES_HEADER='"that.h"' to use it
+ */
+#define KM_SIZE_CLASSES \
+        8, 16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096
+
+#endif
@@ -0,0 +1,137 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "kmem_shm.h"
+
+/**
+ * kmemtop, a slabtop for processes using this allocator
+ * Maps the segment published with kmem_stats_publish read-only and
+ * prints every cache's counters, plus rates since the last refresh
+ *
+ * Usage: kmemtop [-n count] [-d seconds] shm_name
+ */
+
+struct snapshot {
+        uint64_t id;
+        char name[KM_SHM_NAME_LEN];
+        uint64_t object_size;
+        uint64_t objects;
+        uint64_t slabs;
+        uint64_t allocs;
+        uint64_t frees;
+};
+
+/**
+ * Copy a slot out, retrying while the writer is mid update
+ * Returns 0 if the slot is in use, -1 if it's empty
+ */
+static int
+read_slot(struct kmem_shm_cache *slot, struct snapshot *snap)
+{
+        unsigned seq;
+        int active;
+
+        do {
+                while ((seq = atomic_load_explicit(&slot->seq, memory_order_acquire)) & 1);
+
+                active = atomic_load_explicit(&slot->active, memory_order_relaxed);
+                snap->id = atomic_load_explicit(&slot->id, memory_order_relaxed);
+                memcpy(snap->name, slot->name, KM_SHM_NAME_LEN);
+                snap->object_size = atomic_load_explicit(&slot->object_size, memory_order_relaxed);
+                snap->objects = atomic_load_explicit(&slot->objects, memory_order_relaxed);
+                snap->slabs = atomic_load_explicit(&slot->slabs, memory_order_relaxed);
+                snap->allocs = atomic_load_explicit(&slot->allocs, memory_order_relaxed);
+                snap->frees = atomic_load_explicit(&slot->frees, memory_order_relaxed);
+
+                atomic_thread_fence(memory_order_acquire);
+        } while (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq);
+
+        snap->name[KM_SHM_NAME_LEN - 1] = '\0';
+        return active ? 0 : -1;
+}
+
+static void
+usage(char *prog)
+{
+        fprintf(stderr, "usage: %s [-n count] [-d seconds] shm_name\n", prog);
+        exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+        static struct snapshot prev[KM_SHM_MAX_CACHES];
+        struct kmem_shm_header *shm;
+        struct snapshot snap;
+        int count = -1;
+        int delay = 1;
+        int opt;
+        int fd;
+
+        while ((opt = getopt(argc, argv, "n:d:")) != -1) {
+                switch (opt) {
+                case 'n':
+                        count = atoi(optarg);
+                        break;
+                case 'd':
+                        delay = atoi(optarg);
+                        if (delay < 1) delay = 1;
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+        if (optind != argc - 1) usage(argv[0]);
+
+        fd = shm_open(argv[optind], O_RDONLY, 0);
+        if (fd < 0) {
+                perror(argv[optind]);
+                return 1;
+        }
+        shm = mmap(NULL, sizeof(struct kmem_shm_header), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (shm == MAP_FAILED) {
+                perror("mmap");
+                return 1;
+        }
+        if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != KM_SHM_MAGIC
+            || shm->version != KM_SHM_VERSION) {
+                fprintf(stderr, "%s: not a kmem stats segment (or an old one)\n", argv[optind]);
+                return 1;
+        }
+
+        for (int round = 0; count < 0 || round < count; round++) {
+                if (round) sleep(delay);
+
+                printf("\npid %u\n", shm->pid);
+                printf("%-32s %8s %10s %8s %10s %10s %8s\n",
+                       "CACHE", "SIZE", "OBJECTS", "SLABS", "ALLOC/s", "FREE/s", "GROWTH");
+                for (int i = 0; i < KM_SHM_MAX_CACHES; i++) {
+                        if (read_slot(&shm->caches[i], &snap)) {
+                                prev[i].id = 0;
+                                continue;
+                        }
+
+                        // A new cache in an old slot has nothing to compare against
+                        if (prev[i].id != snap.id) {
+                                prev[i] = snap;
+                        }
+                        printf("%-32s %8lu %10lu %8lu %10.0f %10.0f %+8ld\n",
+                               snap.name, snap.object_size, snap.objects, snap.slabs,
+                               (double)(snap.allocs - prev[i].allocs) / delay,
+                               (double)(snap.frees - prev[i].frees) / delay,
+                               (long)(snap.slabs - prev[i].slabs));
+                        prev[i] = snap;
+                }
+                fflush(stdout);
+        }
+
+        munmap(shm, sizeof(struct kmem_shm_header));
+        return 0;
+}
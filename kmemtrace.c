@@ -0,0 +1,126 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+/**
+ * kmemtrace, decodes a kmem_trace_dump file
+ * Every thread's events are merged into one timeline, in
+ * microseconds since the oldest event in the dump
+ *
+ * Usage: kmemtrace dump_file [cache_name]
+ */
+
+struct event {
+        uint32_t tid;
+        struct kmem_trace_event ev;
+};
+
+static const char *types[] = {
+        [KM_TRACE_ALLOC] = "alloc",
+        [KM_TRACE_FREE] = "free",
+        [KM_TRACE_GROW] = "grow",
+        [KM_TRACE_REAP] = "reap",
+        [KM_TRACE_CREATE] = "create",
+        [KM_TRACE_DESTROY] = "destroy",
+        [KM_TRACE_KMEM_ALLOC] = "kmalloc",
+};
+
+static struct kmem_trace_file_name *names;
+static uint32_t nnames;
+
+static const char *
+cache_name(uint64_t cache)
+{
+        for (uint32_t i = 0; i < nnames; i++) {
+                if (names[i].cache == cache) return names[i].name;
+        }
+        return "?";
+}
+
+static int
+by_time(const void *a, const void *b)
+{
+        const struct event *x = a;
+        const struct event *y = b;
+
+        return (x->ev.ts > y->ev.ts) - (x->ev.ts < y->ev.ts);
+}
+
+int
+main(int argc, char **argv)
+{
+        struct kmem_trace_file_header header;
+        struct kmem_trace_file_ring rh;
+        struct event *events = NULL;
+        size_t nevents = 0;
+        const char *only;
+        const char *name;
+        FILE *f;
+
+        if (argc < 2 || argc > 3) {
+                fprintf(stderr, "usage: %s dump_file [cache_name]\n", argv[0]);
+                return 1;
+        }
+        only = argc == 3 ? argv[2] : NULL;
+
+        f = fopen(argv[1], "rb");
+        if (!f) {
+                perror(argv[1]);
+                return 1;
+        }
+        if (fread(&header, sizeof(header), 1, f) != 1
+            || header.magic != KM_TRACE_MAGIC || header.version != KM_TRACE_VERSION) {
+                fprintf(stderr, "%s: not a kmem trace dump (or an old one)\n", argv[1]);
+                return 1;
+        }
+
+        nnames = header.nnames;
+        names = calloc(nnames ? nnames : 1, sizeof(struct kmem_trace_file_name));
+        if (fread(names, sizeof(struct kmem_trace_file_name), nnames, f) != nnames) {
+                fprintf(stderr, "%s: truncated\n", argv[1]);
+                return 1;
+        }
+
+        for (uint32_t r = 0; r < header.nrings; r++) {
+                if (fread(&rh, sizeof(rh), 1, f) != 1) {
+                        fprintf(stderr, "%s: truncated\n", argv[1]);
+                        return 1;
+                }
+                events = realloc(events, (nevents + rh.count) * sizeof(struct event));
+                for (uint32_t i = 0; i < rh.count; i++, nevents++) {
+                        events[nevents].tid = rh.tid;
+                        if (fread(&events[nevents].ev, sizeof(struct kmem_trace_event), 1, f) != 1) {
+                                fprintf(stderr, "%s: truncated\n", argv[1]);
+                                return 1;
+                        }
+                }
+        }
+        fclose(f);
+
+        qsort(events, nevents, sizeof(struct event), by_time);
+
+        printf("%12s %8s %-8s %-24s %18s %18s\n", "USEC", "TID", "EVENT", "CACHE", "OBJECT", "SLAB");
+        for (size_t i = 0; i < nevents; i++) {
+                struct kmem_trace_event *ev = &events[i].ev;
+
+                name = cache_name(ev->cache);
+                if (only && strcmp(name, only)) continue;
+                printf("%12.3f %8u %-8s %-24s %#18lx ",
+                       (ev->ts - events[0].ev.ts) / 1000.0, events[i].tid,
+                       ev->type < sizeof(types) / sizeof(types[0]) && types[ev->type]
+                               ? types[ev->type] : "?",
+                       name, ev->obj);
+                if (ev->type == KM_TRACE_KMEM_ALLOC) {
+                        printf("%13lu bytes\n", ev->slab);
+                } else {
+                        printf("%#18lx\n", ev->slab);
+                }
+        }
+
+        free(events);
+        free(names);
+        return 0;
+}
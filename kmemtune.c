@@ -0,0 +1,246 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "kmem_sizes.h"
+
+/**
+ * kmemtune, picks kmem_alloc size classes for a recorded workload
+ *
+ * Reads the kmem_alloc requests out of a kmem_trace_dump file (or
+ * a text file of sizes, one per line, optionally followed by a
+ * count), then finds the set of at most -k classes that wastes the
+ * fewest bytes to rounding over those requests, and writes it out
+ * as a drop-in replacement for kmem_sizes.h.
+ *
+ * Usage: kmemtune [-k classes] [-m max_size] [-o header] trace
+ *
+ * Classes are multiples of 8 and the best set only ever uses sizes
+ * that were asked for (rounded up to 8), so it's an exact dynamic
+ * program over those: O(classes * sizes^2). Requests over -m are
+ * left out, kmem_alloc sends anything past the top class to malloc.
+ */
+
+#define TUNE_ALIGN 8
+
+static size_t stock[] = { KM_SIZE_CLASSES };
+
+/* Distinct request sizes, ascending, and how often each was asked for */
+static size_t *sizes;
+static double *counts;
+static size_t nsizes;
+
+/* Requests, by size rounded up to TUNE_ALIGN, while reading */
+static double *histogram;
+static size_t max_size = 4096;
+static double skipped;
+
+static void
+record(size_t size, double count)
+{
+        if (size > max_size) {
+                skipped += count;
+                return;
+        }
+        histogram[(size + TUNE_ALIGN - 1) / TUNE_ALIGN] += count;
+}
+
+/**
+ * Read a trace dump's kmem_alloc events
+ * Returns 0 on success, -1 if it isn't a dump
+ */
+static int
+read_dump(FILE *f)
+{
+        struct kmem_trace_file_header header;
+        struct kmem_trace_file_name name;
+        struct kmem_trace_file_ring ring;
+        struct kmem_trace_event ev;
+
+        if (fread(&header, sizeof(header), 1, f) != 1
+            || header.magic != KM_TRACE_MAGIC || header.version != KM_TRACE_VERSION) {
+                return -1;
+        }
+        for (uint32_t i = 0; i < header.nnames; i++) {
+                if (fread(&name, sizeof(name), 1, f) != 1) return 0;
+        }
+        for (uint32_t r = 0; r < header.nrings; r++) {
+                if (fread(&ring, sizeof(ring), 1, f) != 1) return 0;
+                for (uint32_t i = 0; i < ring.count; i++) {
+                        if (fread(&ev, sizeof(ev), 1, f) != 1) return 0;
+                        if (ev.type == KM_TRACE_KMEM_ALLOC) record(ev.slab, 1);
+                }
+        }
+        return 0;
+}
+
+static void
+read_text(FILE *f)
+{
+        unsigned long size;
+        double count;
+        char line[128];
+
+        while (fgets(line, sizeof(line), f)) {
+                count = 1;
+                if (sscanf(line, "%lu %lf", &size, &count) >= 1) record(size, count);
+        }
+}
+
+/* Bytes wasted rounding requests sizes[j..i] up to sizes[i] */
+static double
+waste(const double *n, const double *bytes, size_t j, size_t i)
+{
+        return sizes[i] * (n[i + 1] - n[j]) - (bytes[i + 1] - bytes[j]);
+}
+
+/* What the stock ladder wastes on the same requests */
+static double
+stock_waste()
+{
+        double total = 0;
+        size_t c = 0;
+
+        for (size_t i = 0; i < nsizes; i++) {
+                while (c < sizeof(stock) / sizeof(stock[0]) && stock[c] < sizes[i]) c++;
+                if (c == sizeof(stock) / sizeof(stock[0])) break;
+                total += counts[i] * (stock[c] - sizes[i]);
+        }
+        return total;
+}
+
+static void
+usage(char *prog)
+{
+        fprintf(stderr, "usage: %s [-k classes] [-m max_size] [-o header] trace\n", prog);
+        exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+        size_t nclasses = sizeof(stock) / sizeof(stock[0]);
+        const char *out_path = NULL;
+        double *n;              /* Prefix sums of counts */
+        double *bytes;          /* Prefix sums of counts * sizes */
+        double *cost;           /* cost[k * nsizes + i]: best for sizes[0..i] in k + 1 classes */
+        size_t *from;           /* Where the last class of that best starts */
+        size_t *classes;
+        double requests;
+        FILE *f;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "k:m:o:")) != -1) {
+                switch (opt) {
+                case 'k':
+                        nclasses = strtoul(optarg, NULL, 10);
+                        break;
+                case 'm':
+                        max_size = strtoul(optarg, NULL, 10);
+                        break;
+                case 'o':
+                        out_path = optarg;
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+        if (optind != argc - 1 || !nclasses || nclasses > 256 || !max_size) usage(argv[0]);
+
+        histogram = calloc(max_size / TUNE_ALIGN + 2, sizeof(double));
+        f = fopen(argv[optind], "rb");
+        if (!f) {
+                perror(argv[optind]);
+                return 1;
+        }
+        if (read_dump(f)) {
+                rewind(f);
+                read_text(f);
+        }
+        fclose(f);
+
+        // Sizes 0 and 1..8 all round to the first slot, which is class 8
+        histogram[1] += histogram[0];
+        sizes = calloc(max_size / TUNE_ALIGN + 1, sizeof(size_t));
+        counts = calloc(max_size / TUNE_ALIGN + 1, sizeof(double));
+        requests = 0;
+        for (size_t i = 1; i <= (max_size + TUNE_ALIGN - 1) / TUNE_ALIGN; i++) {
+                if (!histogram[i]) continue;
+                sizes[nsizes] = i * TUNE_ALIGN;
+                counts[nsizes] = histogram[i];
+                requests += histogram[i];
+                nsizes++;
+        }
+        if (!nsizes) {
+                fprintf(stderr, "%s: no kmem_alloc requests to tune for\n", argv[optind]);
+                return 1;
+        }
+        if (nclasses > nsizes) nclasses = nsizes;
+
+        n = calloc(nsizes + 1, sizeof(double));
+        bytes = calloc(nsizes + 1, sizeof(double));
+        for (size_t i = 0; i < nsizes; i++) {
+                n[i + 1] = n[i] + counts[i];
+                bytes[i + 1] = bytes[i] + counts[i] * sizes[i];
+        }
+
+        cost = malloc(nclasses * nsizes * sizeof(double));
+        from = malloc(nclasses * nsizes * sizeof(size_t));
+        for (size_t i = 0; i < nsizes; i++) {
+                cost[i] = waste(n, bytes, 0, i);
+                from[i] = 0;
+        }
+        for (size_t k = 1; k < nclasses; k++) {
+                for (size_t i = 0; i < nsizes; i++) {
+                        double *best = &cost[k * nsizes + i];
+
+                        // Fewer sizes than classes: the extra class is free
+                        *best = cost[(k - 1) * nsizes + i];
+                        from[k * nsizes + i] = i + 1;
+                        for (size_t j = 1; j <= i; j++) {
+                                double c = cost[(k - 1) * nsizes + j - 1] + waste(n, bytes, j, i);
+                                if (c < *best) {
+                                        *best = c;
+                                        from[k * nsizes + i] = j;
+                                }
+                        }
+                }
+        }
+
+        // Walk the choices back from the top class
+        classes = malloc(nclasses * sizeof(size_t));
+        size_t nchosen = 0;
+        for (size_t k = nclasses, i = nsizes; k-- > 0 && i > 0; ) {
+                size_t j = from[k * nsizes + i - 1];
+                if (j <= i - 1) {
+                        classes[nchosen++] = sizes[i - 1];
+                        i = j;
+                }
+        }
+
+        f = out_path ? fopen(out_path, "w") : stdout;
+        if (!f) {
+                perror(out_path);
+                return 1;
+        }
+        fprintf(f, "#ifndef PLOPREIATO_SLAB_KMEM_SIZES_H\n#define PLOPREIATO_SLAB_KMEM_SIZES_H\n\n");
+        fprintf(f, "/**\n * Size classes for kmem_alloc, written by kmemtune from %s\n", argv[optind]);
+        fprintf(f, " * %.0f requests up to %lu bytes (%.0f bigger left to malloc)\n",
+                requests, max_size, skipped);
+        fprintf(f, " * Rounding wastes %.1f bytes a request, the stock ladder %.1f\n */\n",
+                cost[(nclasses - 1) * nsizes + nsizes - 1] / requests, stock_waste() / requests);
+        fprintf(f, "#define KM_SIZE_CLASSES \\\n        ");
+        for (size_t c = nchosen; c-- > 0; ) {
+                fprintf(f, "%lu%s", classes[c], c ? ", " : "\n");
+        }
+        fprintf(f, "\n#endif\n");
+        if (out_path) fclose(f);
+
+        fprintf(stderr, "%lu classes, %.1f bytes wasted a request (stock ladder: %.1f)\n",
+                nchosen, cost[(nclasses - 1) * nsizes + nsizes - 1] / requests,
+                stock_waste() / requests);
+        return 0;
+}
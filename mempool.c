@@ -0,0 +1,173 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "slab.h"
+#include "mempool.h"
+
+/**
+ * Every pool, so a fork can take all their locks. Only touched
+ * on init and destroy
+ */
+static struct kmem_mempool *pools = NULL;
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int
+kmem_mempool_init(struct kmem_mempool *pool, char *name, struct kmem_cache *cp, size_t min_nr)
+{
+        size_t i;
+
+        pool->name = name;
+        pool->cp = cp;
+        pool->min_nr = min_nr;
+        atomic_init(&pool->curr_nr, 0);
+        atomic_init(&pool->reserve_allocs, 0);
+        atomic_init(&pool->failcnt, 0);
+        pool->elements = malloc((min_nr ? min_nr : 1) * sizeof(void *));
+        if (!pool->elements) return -1;
+
+        for (i = 0; i < min_nr; i++) {
+                pool->elements[i] = kmem_cache_alloc(cp, KM_SLEEP);
+                if (!pool->elements[i]) {
+                        // Only a signal-safe cache's reserve runs out
+                        DEBUG_PRINT("Mempool %s only got %lu of %lu objects\n", name, i, min_nr);
+                        while (i--) kmem_cache_free(cp, pool->elements[i]);
+                        free(pool->elements);
+                        return -1;
+                }
+        }
+        atomic_store_explicit(&pool->curr_nr, min_nr, memory_order_relaxed);
+        pthread_mutex_init(&pool->lock, NULL);
+
+        pthread_mutex_lock(&pools_lock);
+        pool->last = NULL;
+        pool->next = pools;
+        if (pools) pools->last = pool;
+        pools = pool;
+        pthread_mutex_unlock(&pools_lock);
+
+        DEBUG_PRINT("Mempool %s reserves %lu objects of cache %s\n", name, min_nr, cp->name);
+        return 0;
+}
+
+void *
+kmem_mempool_alloc(struct kmem_mempool *pool, int flags)
+{
+        void *buf;
+        size_t n;
+
+        buf = kmem_cache_alloc(pool->cp, flags | KM_NOSLEEP);
+        if (buf) return buf;
+
+        pthread_mutex_lock(&pool->lock);
+        n = atomic_load_explicit(&pool->curr_nr, memory_order_relaxed);
+        if (n) {
+                buf = pool->elements[--n];
+                atomic_store_explicit(&pool->curr_nr, n, memory_order_relaxed);
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        if (buf) {
+                DEBUG_PRINT("Mempool %s took from its reserve, %lu left\n", pool->name, n);
+                atomic_fetch_add_explicit(&pool->reserve_allocs, 1, memory_order_relaxed);
+                return buf;
+        }
+        if (flags & KM_NOSLEEP) {
+                atomic_fetch_add_explicit(&pool->failcnt, 1, memory_order_relaxed);
+                return NULL;
+        }
+        return kmem_cache_alloc(pool->cp, flags);
+}
+
+void
+kmem_mempool_free(struct kmem_mempool *pool, void *buf)
+{
+        size_t n;
+
+        // Almost always full, so don't take the lock to find that out
+        if (atomic_load_explicit(&pool->curr_nr, memory_order_relaxed) < pool->min_nr) {
+                pthread_mutex_lock(&pool->lock);
+                n = atomic_load_explicit(&pool->curr_nr, memory_order_relaxed);
+                if (n < pool->min_nr) {
+                        pool->elements[n] = buf;
+                        atomic_store_explicit(&pool->curr_nr, n + 1, memory_order_relaxed);
+                        pthread_mutex_unlock(&pool->lock);
+                        return;
+                }
+                pthread_mutex_unlock(&pool->lock);
+        }
+        kmem_cache_free(pool->cp, buf);
+}
+
+void
+kmem_mempool_get_stats(struct kmem_mempool *pool, struct kmem_mempool_stats *stats)
+{
+        stats->name = pool->name;
+        stats->min_nr = pool->min_nr;
+        stats->curr_nr = atomic_load_explicit(&pool->curr_nr, memory_order_relaxed);
+        stats->reserve_allocs = atomic_load_explicit(&pool->reserve_allocs, memory_order_relaxed);
+        stats->failcnt = atomic_load_explicit(&pool->failcnt, memory_order_relaxed);
+}
+
+void
+kmem_mempool_destroy(struct kmem_mempool *pool)
+{
+        size_t n;
+
+        pthread_mutex_lock(&pools_lock);
+        if (pool->last) {
+                pool->last->next = pool->next;
+        } else {
+                pools = pool->next;
+        }
+        if (pool->next) {
+                pool->next->last = pool->last;
+        }
+        pthread_mutex_unlock(&pools_lock);
+
+        n = atomic_load_explicit(&pool->curr_nr, memory_order_relaxed);
+        while (n) {
+                kmem_cache_free(pool->cp, pool->elements[--n]);
+        }
+        atomic_store_explicit(&pool->curr_nr, 0, memory_order_relaxed);
+        free(pool->elements);
+        pool->elements = NULL;
+        pthread_mutex_destroy(&pool->lock);
+}
+
+/**
+ * Pool locks are never held across a call into a cache, so they
+ * can be taken after every cache's
+ */
+void
+__kmem_mempool_fork_prepare()
+{
+        struct kmem_mempool *pool;
+
+        pthread_mutex_lock(&pools_lock);
+        for (pool = pools; pool; pool = pool->next) {
+                pthread_mutex_lock(&pool->lock);
+        }
+}
+
+void
+__kmem_mempool_fork_parent()
+{
+        struct kmem_mempool *pool;
+
+        for (pool = pools; pool; pool = pool->next) {
+                pthread_mutex_unlock(&pool->lock);
+        }
+        pthread_mutex_unlock(&pools_lock);
+}
+
+void
+__kmem_mempool_fork_child()
+{
+        struct kmem_mempool *pool;
+
+        pthread_mutex_init(&pools_lock, NULL);
+        for (pool = pools; pool; pool = pool->next) {
+                pthread_mutex_init(&pool->lock, NULL);
+        }
+}
@@ -0,0 +1,123 @@
+#ifndef PLOPREIATO_SLAB_MEMPOOL_H
+#define PLOPREIATO_SLAB_MEMPOOL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "slab.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Emergency reserves
+ * A mempool keeps min_nr objects from a cache set aside, for the
+ * allocations that can't be allowed to fail (error handling,
+ * writeback, shutdown) even when the cache's account is over its
+ * limit or there's no memory for a new slab.
+ *
+ * Allocations go to the cache first, without sleeping, and only
+ * take from the reserve when the cache says no. Frees top the
+ * reserve back up before anything goes back to the cache, so
+ * objects borrowed in an emergency come back to the pool.
+ *
+ * Objects in the reserve are still allocated as far as the cache
+ * (and its account) is concerned, so they count in its stats, and
+ * are handed out constructed, like any other object.
+ */
+
+struct kmem_mempool {
+        char *name;
+        struct kmem_cache *cp;
+        size_t min_nr;                  /* Objects the reserve is topped up to */
+        atomic_size_t curr_nr;          /* Objects in the reserve now */
+        void **elements;                /* The reserve, a stack of min_nr */
+        pthread_mutex_t lock;           /* For the reserve */
+        atomic_ulong reserve_allocs;    /* Allocations the cache refused,
+                                         * served from the reserve
+                                         */
+        atomic_ulong failcnt;           /* KM_NOSLEEP allocations refused
+                                         * with the reserve empty too
+                                         */
+        struct kmem_mempool *next;      /* On the pools list */
+        struct kmem_mempool *last;
+};
+
+struct kmem_mempool_stats {
+        char *name;
+        size_t min_nr;
+        size_t curr_nr;
+        unsigned long reserve_allocs;
+        unsigned long failcnt;
+};
+
+/**
+ * Set up a pool on cp, and fill its reserve with min_nr objects
+ * The objects are allocated KM_SLEEP, so they may take the cache's
+ * account over its limit
+ * Returns 0 on success, -1 if the reserve couldn't be allocated
+ */
+int
+kmem_mempool_init(
+        struct kmem_mempool *pool,
+        char *name,
+        struct kmem_cache *cp,
+        size_t min_nr
+);
+
+/**
+ * Allocate an object, from the cache if it can, else the reserve
+ * With the reserve empty too, KM_NOSLEEP returns NULL, and KM_SLEEP
+ * falls back to kmem_cache_alloc(KM_SLEEP), which goes over the
+ * account's limit and waits for memory if it has to
+ * Lifetime hints are passed through to the cache
+ */
+void *
+kmem_mempool_alloc(
+        struct kmem_mempool *pool,
+        int flags
+);
+
+/**
+ * Free an object from kmem_mempool_alloc, into the reserve if it's
+ * short, else back to the cache
+ */
+void
+kmem_mempool_free(
+        struct kmem_mempool *pool,
+        void *buf
+);
+
+/**
+ * Snapshot a pool's numbers
+ */
+void
+kmem_mempool_get_stats(
+        struct kmem_mempool *pool,
+        struct kmem_mempool_stats *stats
+);
+
+/**
+ * Give the reserve back to the cache
+ * The cache itself is left alone, objects the pool handed out
+ * can still be freed to it with kmem_cache_free
+ */
+void
+kmem_mempool_destroy(
+        struct kmem_mempool *pool
+);
+
+/**
+ * Fork handling, called from slab.c's pthread_atfork handlers
+ */
+void __kmem_mempool_fork_prepare(void);
+void __kmem_mempool_fork_parent(void);
+void __kmem_mempool_fork_child(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
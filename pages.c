@@ -0,0 +1,217 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "slab.h"
+#include "pages.h"
+
+static void *
+__malloc_alloc(size_t size, void *UNUSED(arg))
+{
+        void *pages;
+
+        if (posix_memalign(&pages, sysconf(_SC_PAGESIZE), size)) return NULL;
+        return pages;
+}
+
+static void
+__malloc_free(void *pages, size_t UNUSED(size), void *UNUSED(arg))
+{
+        free(pages);
+}
+
+const struct kmem_page_provider kmem_pages_malloc = {
+        .name = "malloc",
+        .alloc_pages = __malloc_alloc,
+        .free_pages = __malloc_free,
+        .decommit = NULL,
+        .arg = NULL,
+};
+
+static void *
+__mmap_alloc(size_t size, void *UNUSED(arg))
+{
+        void *pages;
+
+        pages = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return pages == MAP_FAILED ? NULL : pages;
+}
+
+static void
+__mmap_free(void *pages, size_t size, void *UNUSED(arg))
+{
+        munmap(pages, size);
+}
+
+static void
+__mmap_decommit(void *pages, size_t size, void *UNUSED(arg))
+{
+        madvise(pages, size, MADV_DONTNEED);
+}
+
+const struct kmem_page_provider kmem_pages_mmap = {
+        .name = "mmap",
+        .alloc_pages = __mmap_alloc,
+        .free_pages = __mmap_free,
+        .decommit = __mmap_decommit,
+        .arg = NULL,
+};
+
+/**
+ * Huge pages are carved front to back into slabs, and freed
+ * slabs wait on a list per size (linked through their first
+ * word) for the next slab that size. Anything bigger than
+ * KM_HUGE_MAX gets a mapping of its own
+ */
+#define KM_HUGE_PAGE (2ul << 20)
+#define KM_HUGE_MAX (KM_HUGE_PAGE / 4)
+#define KM_HUGE_SIZES 32
+
+static pthread_mutex_t huge_lock = PTHREAD_MUTEX_INITIALIZER;
+static void *huge_free[KM_HUGE_SIZES];  /* By log2 of the size */
+static char *huge_next;                 /* Rest of the current huge page */
+static char *huge_end;
+static unsigned long huge_pages;        /* Mapped so far */
+
+static unsigned
+__huge_index(size_t size)
+{
+        return 63 - __builtin_clzl(size);
+}
+
+/**
+ * Map another huge page: hugetlbfs if the system has them
+ * reserved, else a 2MB aligned range the kernel is asked to
+ * back with a transparent huge page
+ */
+static char *
+__huge_map()
+{
+        char *map;
+        uintptr_t aligned;
+
+        map = mmap(NULL, KM_HUGE_PAGE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (map != MAP_FAILED) return map;
+
+        map = mmap(NULL, 2 * KM_HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED) return NULL;
+
+        // Trim it down to the aligned 2MB in the middle
+        aligned = ((uintptr_t)map + KM_HUGE_PAGE - 1) & ~(KM_HUGE_PAGE - 1);
+        if (aligned != (uintptr_t)map) munmap(map, aligned - (uintptr_t)map);
+        munmap((char *)aligned + KM_HUGE_PAGE, (uintptr_t)map + KM_HUGE_PAGE - aligned);
+        madvise((void *)aligned, KM_HUGE_PAGE, MADV_HUGEPAGE);
+        return (char *)aligned;
+}
+
+/**
+ * Slabs of different orders come out of the same huge page, so
+ * what's left of it needn't hold the next one: a 32KB slab after
+ * a 4KB one doesn't fit the last 28KB. Rather than waste that,
+ * put it on the free lists in power of 2 pieces, largest first
+ * (it's always a whole number of system pages)
+ * ASSUMED: the caller holds huge_lock
+ */
+static void
+__huge_spill()
+{
+        size_t piece;
+
+        while (huge_next && huge_next < huge_end) {
+                piece = 1ul << __huge_index(huge_end - huge_next);
+                *(void **)huge_next = huge_free[__huge_index(piece)];
+                huge_free[__huge_index(piece)] = huge_next;
+                huge_next += piece;
+        }
+}
+
+static void *
+__huge_alloc(size_t size, void *arg)
+{
+        unsigned i;
+        void *pages;
+
+        if (size > KM_HUGE_MAX) return __mmap_alloc(size, arg);
+
+        i = __huge_index(size);
+        pthread_mutex_lock(&huge_lock);
+        pages = huge_free[i];
+        if (pages) {
+                huge_free[i] = *(void **)pages;
+        } else {
+                if (huge_next + size > huge_end) {
+                        __huge_spill();
+                        huge_next = __huge_map();
+                        huge_end = huge_next ? huge_next + KM_HUGE_PAGE : NULL;
+                        huge_pages += huge_next != NULL;
+                        DEBUG_PRINT("Mapped huge page %lu at %p\n", huge_pages, (void*)huge_next);
+                }
+                pages = huge_next;
+                if (pages) huge_next += size;
+        }
+        pthread_mutex_unlock(&huge_lock);
+
+        return pages;
+}
+
+static void
+__huge_free(void *pages, size_t size, void *arg)
+{
+        unsigned i;
+
+        if (size > KM_HUGE_MAX) {
+                __mmap_free(pages, size, arg);
+                return;
+        }
+
+        i = __huge_index(size);
+        pthread_mutex_lock(&huge_lock);
+        *(void **)pages = huge_free[i];
+        huge_free[i] = pages;
+        pthread_mutex_unlock(&huge_lock);
+}
+
+const struct kmem_page_provider kmem_pages_huge = {
+        .name = "huge",
+        .alloc_pages = __huge_alloc,
+        .free_pages = __huge_free,
+        .decommit = NULL,
+        .arg = NULL,
+};
+
+static _Atomic(const struct kmem_page_provider *) provider = &kmem_pages_malloc;
+
+void
+kmem_set_page_provider(const struct kmem_page_provider *pp)
+{
+        atomic_store_explicit(&provider, pp ? pp : &kmem_pages_malloc, memory_order_release);
+}
+
+const struct kmem_page_provider *
+kmem_get_page_provider()
+{
+        return atomic_load_explicit(&provider, memory_order_acquire);
+}
+
+void
+__kmem_pages_fork_prepare()
+{
+        pthread_mutex_lock(&huge_lock);
+}
+
+void
+__kmem_pages_fork_parent()
+{
+        pthread_mutex_unlock(&huge_lock);
+}
+
+void
+__kmem_pages_fork_child()
+{
+        pthread_mutex_init(&huge_lock, NULL);
+}
@@ -0,0 +1,80 @@
+#ifndef PLOPREIATO_SLAB_PAGES_H
+#define PLOPREIATO_SLAB_PAGES_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Where slabs get their memory
+ * Every slab is (pagesize << order) bytes from its cache's page
+ * provider, and goes back to it when the slab is reaped. Set one
+ * for every cache created from then on with kmem_set_page_provider,
+ * or for a single cache with kmem_cache_attr.provider, to feed
+ * slabs from hugetlbfs, a preallocated arena, mlock'd memory or a
+ * shared memory file.
+ *
+ * alloc_pages has to return system page aligned memory (small
+ * object slabs find their header from a buf's page), or NULL.
+ * free_pages gets back exactly what alloc_pages handed out. A
+ * provider that never takes memory back, like a bump allocated
+ * arena, leaves free_pages NULL: reaped slabs are then handed to
+ * decommit, if there is one, so at least their physical memory
+ * goes, and are otherwise just forgotten.
+ *
+ * The callbacks run under the cache lock of whichever cache is
+ * growing or shrinking, so different caches call them at once.
+ * They mustn't allocate from the slab allocator. A provider has
+ * to outlive every cache using it.
+ */
+struct kmem_page_provider {
+        const char *name;
+        void *(*alloc_pages)(size_t size, void *arg);
+        void (*free_pages)(void *pages, size_t size, void *arg);
+        void (*decommit)(void *pages, size_t size, void *arg);
+        void *arg;
+};
+
+/* posix_memalign and free, the default */
+extern const struct kmem_page_provider kmem_pages_malloc;
+
+/* A mapping per slab, unmapped when it's reaped */
+extern const struct kmem_page_provider kmem_pages_mmap;
+
+/**
+ * Slabs carved out of 2MB huge pages, from hugetlbfs if any are
+ * reserved (vm.nr_hugepages), else transparent huge pages. Freed
+ * slabs are kept for reuse by size, and the huge pages themselves
+ * are never given back
+ */
+extern const struct kmem_page_provider kmem_pages_huge;
+
+/**
+ * Set the provider caches created from now on use, NULL for
+ * kmem_pages_malloc. Caches that exist already keep theirs
+ */
+void
+kmem_set_page_provider(
+        const struct kmem_page_provider *pp
+);
+
+/**
+ * The provider new caches get
+ */
+const struct kmem_page_provider *
+kmem_get_page_provider(void);
+
+/**
+ * Fork handling, called from slab.c's pthread_atfork handlers
+ */
+void __kmem_pages_fork_prepare(void);
+void __kmem_pages_fork_parent(void);
+void __kmem_pages_fork_child(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,259 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "slab.h"
+#include "pressure.h"
+
+/**
+ * Find this process' cgroup v2 directory
+ * /proc/self/cgroup has a "0::/some/path" line for v2
+ * Leaves dir empty if there isn't one
+ */
+static void
+__pressure_find_cgroup(char *dir, size_t len)
+{
+        char line[PATH_MAX];
+        FILE *f;
+
+        dir[0] = '\0';
+        f = fopen("/proc/self/cgroup", "r");
+        if (!f) return;
+
+        while (fgets(line, sizeof(line), f)) {
+                if (strncmp(line, "0::", 3)) continue;
+                line[strcspn(line, "\n")] = '\0';
+                if (snprintf(dir, len, "%s%s", KM_PRESSURE_CGROUP_ROOT, line + 3) >= (int)len) {
+                        // Too long to be any use
+                        dir[0] = '\0';
+                }
+                break;
+        }
+        fclose(f);
+}
+
+/**
+ * Read a cgroup memory file, "max" means no limit
+ * Returns 0 on success, -1 if the file can't be read
+ */
+static int
+__pressure_read_bytes(const char *dir, const char *file, size_t *bytes)
+{
+        char path[PATH_MAX + 32];
+        char buf[32];
+        unsigned long long value;
+        FILE *f;
+        int ret;
+
+        snprintf(path, sizeof(path), "%s/%s", dir, file);
+        f = fopen(path, "r");
+        if (!f) return -1;
+
+        ret = -1;
+        if (fgets(buf, sizeof(buf), f)) {
+                if (!strncmp(buf, "max", 3)) {
+                        *bytes = SIZE_MAX;
+                        ret = 0;
+                } else if (sscanf(buf, "%llu", &value) == 1) {
+                        *bytes = value;
+                        ret = 0;
+                }
+        }
+        fclose(f);
+        return ret;
+}
+
+/**
+ * Pull "some avg10=X" out of a PSI file
+ * Returns 0 on success, -1 if it can't be read
+ */
+static int
+__pressure_read_psi(const char *path, double *avg10)
+{
+        char line[256];
+        FILE *f;
+        int ret;
+
+        f = fopen(path, "r");
+        if (!f) return -1;
+
+        ret = -1;
+        while (fgets(line, sizeof(line), f)) {
+                if (sscanf(line, "some avg10=%lf", avg10) == 1) {
+                        ret = 0;
+                        break;
+                }
+        }
+        fclose(f);
+        return ret;
+}
+
+int
+kmem_pressure_init(struct kmem_pressure *mp, const char *psi_path, const char *cgroup_dir)
+{
+        memset(mp, 0, sizeof(struct kmem_pressure));
+        mp->avg10_limit = KM_PRESSURE_AVG10;
+        mp->high_ratio = KM_PRESSURE_HIGH_RATIO;
+        mp->interval_ms = KM_PRESSURE_INTERVAL_MS;
+        mp->high = SIZE_MAX;
+        mp->psi_fd = -1;
+        mp->wake_pipe[0] = -1;
+        mp->wake_pipe[1] = -1;
+
+        if (!psi_path) {
+                psi_path = KM_PRESSURE_PSI_PATH;
+                mp->use_trigger = 1;
+        }
+        if (strlen(psi_path) >= sizeof(mp->psi_path)) return -1;
+        strcpy(mp->psi_path, psi_path);
+
+        if (!cgroup_dir) {
+                __pressure_find_cgroup(mp->cgroup_dir, sizeof(mp->cgroup_dir));
+        } else {
+                if (strlen(cgroup_dir) >= sizeof(mp->cgroup_dir)) return -1;
+                strcpy(mp->cgroup_dir, cgroup_dir);
+        }
+
+        DEBUG_PRINT("Pressure monitor on psi '%s', cgroup '%s'\n", mp->psi_path, mp->cgroup_dir);
+        return 0;
+}
+
+size_t
+kmem_pressure_check(struct kmem_pressure *mp)
+{
+        size_t target;
+        size_t watermark;
+        size_t released;
+
+        target = 0;
+
+        // The cgroup tells us how far over we are...
+        if (mp->cgroup_dir[0]
+            && !__pressure_read_bytes(mp->cgroup_dir, "memory.current", &mp->current)
+            && !__pressure_read_bytes(mp->cgroup_dir, "memory.high", &mp->high)
+            && mp->high != SIZE_MAX) {
+                watermark = (size_t)(mp->high * mp->high_ratio);
+                if (mp->current > watermark) {
+                        target = mp->current - watermark;
+                        DEBUG_PRINT("cgroup at %lu of %lu bytes, want %lu back\n", mp->current, mp->high, target);
+                }
+        }
+
+        // ...while PSI only says we're stalling, so give back all we can
+        if (mp->psi_path[0]
+            && !__pressure_read_psi(mp->psi_path, &mp->avg10)
+            && mp->avg10 > mp->avg10_limit) {
+                DEBUG_PRINT("Memory stalled %.2f%% of the last 10s\n", mp->avg10);
+                target = SIZE_MAX;
+        }
+
+        if (!target) return 0;
+
+        released = kmem_shrink_all(target);
+        mp->released += released;
+        return released;
+}
+
+/**
+ * Ask the kernel to wake us (POLLPRI) when stalls pass the trigger
+ * Needs write access to the PSI file, so this may well fail in
+ * a container. Then we just fall back to polling on a timer
+ */
+static void
+__pressure_register_trigger(struct kmem_pressure *mp)
+{
+        int fd;
+
+        fd = open(mp->psi_path, O_RDWR | O_NONBLOCK);
+        if (fd < 0) return;
+
+        if (write(fd, KM_PRESSURE_TRIGGER, strlen(KM_PRESSURE_TRIGGER) + 1) < 0) {
+                DEBUG_PRINT("Unable to register PSI trigger: %s\n", strerror(errno));
+                close(fd);
+                return;
+        }
+        mp->psi_fd = fd;
+}
+
+static void *
+__pressure_thread(void *arg)
+{
+        struct kmem_pressure *mp = arg;
+        struct pollfd fds[2];
+        nfds_t nfds;
+        char c;
+
+        fds[0].fd = mp->wake_pipe[0];
+        fds[0].events = POLLIN;
+        nfds = 1;
+        if (mp->psi_fd >= 0) {
+                fds[1].fd = mp->psi_fd;
+                fds[1].events = POLLPRI;
+                nfds = 2;
+        }
+
+        while (__atomic_load_n(&mp->running, __ATOMIC_ACQUIRE)) {
+                if (poll(fds, nfds, mp->interval_ms) > 0) {
+                        if (fds[0].revents & POLLIN) {
+                                // Woken up by kmem_pressure_stop
+                                if (read(mp->wake_pipe[0], &c, 1) < 0) break;
+                                continue;
+                        }
+                        if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) break;
+                        if (nfds == 2 && (fds[1].revents & (POLLERR | POLLNVAL))) {
+                                // The trigger went bad (its cgroup was removed, say) and
+                                // would come straight back from every poll, so drop it
+                                // and go back to the timer
+                                DEBUG_PRINT("PSI trigger failed, polling every %u ms\n", mp->interval_ms);
+                                if (!(fds[1].revents & POLLNVAL)) close(mp->psi_fd);
+                                __atomic_store_n(&mp->psi_fd, -1, __ATOMIC_RELEASE);
+                                nfds = 1;
+                                continue;
+                        }
+                }
+                kmem_pressure_check(mp);
+        }
+
+        return NULL;
+}
+
+int
+kmem_pressure_start(struct kmem_pressure *mp)
+{
+        if (pipe(mp->wake_pipe)) return -1;
+        if (mp->use_trigger) {
+                __pressure_register_trigger(mp);
+        }
+
+        mp->pid = getpid();
+        __atomic_store_n(&mp->running, 1, __ATOMIC_RELEASE);
+        if (pthread_create(&mp->thread, NULL, __pressure_thread, mp)) {
+                mp->running = 0;
+                kmem_pressure_stop(mp);
+                return -1;
+        }
+        return 0;
+}
+
+void
+kmem_pressure_stop(struct kmem_pressure *mp)
+{
+        // A forked child has our copy of the pipe, but no thread to stop
+        if (__atomic_exchange_n(&mp->running, 0, __ATOMIC_ACQ_REL) && mp->pid == getpid()) {
+                if (write(mp->wake_pipe[1], "x", 1) < 0) {
+                        DEBUG_PRINT("Unable to wake pressure thread\n");
+                }
+                pthread_join(mp->thread, NULL);
+        }
+
+        if (mp->psi_fd >= 0) close(mp->psi_fd);
+        if (mp->wake_pipe[0] >= 0) close(mp->wake_pipe[0]);
+        if (mp->wake_pipe[1] >= 0) close(mp->wake_pipe[1]);
+        mp->psi_fd = -1;
+        mp->wake_pipe[0] = -1;
+        mp->wake_pipe[1] = -1;
+}
@@ -0,0 +1,104 @@
+#ifndef PLOPREIATO_SLAB_PRESSURE_H
+#define PLOPREIATO_SLAB_PRESSURE_H
+
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * An optional memory pressure monitor
+ * Watches the kernel's PSI numbers (/proc/pressure/memory) and
+ * the cgroup v2 memory.current / memory.high files, and shrinks
+ * the allocator's caches when either says memory is getting tight,
+ * so empty slabs don't count against us when the OOM killer looks.
+ *
+ * Paths are configurable, so a fake directory with hand written
+ * files works just as well as the real /proc and /sys
+ */
+
+#define KM_PRESSURE_PSI_PATH "/proc/pressure/memory"
+#define KM_PRESSURE_CGROUP_ROOT "/sys/fs/cgroup"
+
+/* Default thresholds, see struct kmem_pressure */
+#define KM_PRESSURE_AVG10 10.0
+#define KM_PRESSURE_HIGH_RATIO 0.9
+#define KM_PRESSURE_INTERVAL_MS 1000
+
+/* PSI trigger we ask the kernel for: 150ms of stall in any 1s window */
+#define KM_PRESSURE_TRIGGER "some 150000 1000000"
+
+struct kmem_pressure {
+        char psi_path[PATH_MAX];     /* Empty to ignore PSI */
+        char cgroup_dir[PATH_MAX];   /* Empty to ignore the cgroup */
+        double avg10_limit;          /* Shrink everything once "some avg10"
+                                      * (percent of time stalled) passes this
+                                      */
+        double high_ratio;           /* Shrink back under high_ratio * memory.high
+                                      * once memory.current passes it
+                                      */
+        unsigned interval_ms;        /* How often the thread re-reads the files */
+        int use_trigger;             /* Register a PSI trigger, so the thread
+                                      * wakes as soon as the kernel notices
+                                      */
+
+        /* Values seen by the last check */
+        double avg10;
+        size_t current;
+        size_t high;                 /* SIZE_MAX when memory.high is "max" */
+        size_t released;             /* Total bytes given back so far */
+
+        /* Background thread state */
+        pthread_t thread;
+        pid_t pid;                   /* Process the thread runs in, a fork
+                                      * child doesn't get it
+                                      */
+        int running;
+        int psi_fd;
+        int wake_pipe[2];
+};
+
+/**
+ * Set up a monitor
+ * NULL paths mean the real system ones: the PSI file above and
+ * this process' own cgroup (from /proc/self/cgroup). Only the real
+ * PSI file gets a trigger registered on it
+ * Returns 0 on success, -1 if the given paths are too long
+ */
+int
+kmem_pressure_init(
+        struct kmem_pressure *mp,
+        const char *psi_path,
+        const char *cgroup_dir
+);
+
+/**
+ * Read the pressure files once and shrink caches if needed
+ * Returns the number of bytes released
+ */
+size_t
+kmem_pressure_check(
+        struct kmem_pressure *mp
+);
+
+/**
+ * Start a thread that keeps calling kmem_pressure_check,
+ * every interval_ms or whenever the PSI trigger fires
+ * Returns 0 on success, -1 on error
+ */
+int
+kmem_pressure_start(
+        struct kmem_pressure *mp
+);
+
+/**
+ * Stop the monitor thread and wait for it to exit
+ * A forked child has no monitor thread, so there this only
+ * closes its copies of the fds, ready for another start
+ */
+void
+kmem_pressure_stop(
+        struct kmem_pressure *mp
+);
+
+#endif
@@ -1,25 +1,160 @@
+#define _GNU_SOURCE
 #include <assert.h>
+#include <sched.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "slab.h"
 #include "hash.h"
+#include "account.h"
+#include "pages.h"
+#include "mempool.h"
 #include "slab_internal.c"
 
+static struct kmem_cache *
+__cache_create(char *name, const struct kmem_cache_attr *attr);
+static int
+__cache_sigpool_init(struct kmem_cache *cp, size_t nobjs);
+static int
+__cache_cpuslab_init(struct kmem_cache *cp);
+
+/**
+ * The caches the allocator itself allocates from, in the order their
+ * locks are taken. Any cache's lock can be held while taking these,
+ * but never the other way around
+ */
+#define KM_INTERNAL_CACHES \
+        { bufctl_cache, slab_cache, hash_node_cache, hash_cache, money_cache }
+#define KM_NR_INTERNAL_CACHES 5
+
+static int
+__cache_internal(struct kmem_cache *cp)
+{
+        struct kmem_cache *internal[KM_NR_INTERNAL_CACHES] = KM_INTERNAL_CACHES;
+
+        for (int i = 0; i < KM_NR_INTERNAL_CACHES; i++) {
+                if (cp == internal[i]) return 1;
+        }
+        return 0;
+}
+
+/**
+ * pthread_atfork handlers
+ * Before a fork, take every lock the allocator has, in lock order,
+ * so nothing is halfway through a slab list when the child gets its
+ * copy. The slabs themselves are just memory, so the child starts
+ * out with all of the parent's (shared copy-on-write until touched)
+ */
+static void
+__fork_prepare()
+{
+        struct kmem_cache *internal[KM_NR_INTERNAL_CACHES] = KM_INTERNAL_CACHES;
+        struct kmem_cache *cp;
+
+        pthread_mutex_lock(&cache_chain_lock);
+        for (cp = cache_chain; cp; cp = cp->next) {
+                if (!__cache_internal(cp)) pthread_mutex_lock(&cp->lock);
+        }
+        for (int i = 0; i < KM_NR_INTERNAL_CACHES; i++) {
+                pthread_mutex_lock(&internal[i]->lock);
+        }
+        __kmem_trace_fork_prepare();
+        __kmem_account_fork_prepare();
+        __kmem_pages_fork_prepare();
+        __kmem_mempool_fork_prepare();
+}
+
+static void
+__fork_parent()
+{
+        struct kmem_cache *internal[KM_NR_INTERNAL_CACHES] = KM_INTERNAL_CACHES;
+        struct kmem_cache *cp;
+
+        __kmem_mempool_fork_parent();
+        __kmem_pages_fork_parent();
+        __kmem_account_fork_parent();
+        __kmem_trace_fork_parent();
+        for (int i = KM_NR_INTERNAL_CACHES - 1; i >= 0; i--) {
+                pthread_mutex_unlock(&internal[i]->lock);
+        }
+        for (cp = cache_chain; cp; cp = cp->next) {
+                if (!__cache_internal(cp)) pthread_mutex_unlock(&cp->lock);
+        }
+        pthread_mutex_unlock(&cache_chain_lock);
+}
+
+/**
+ * In the child, only the forking thread is left, so rather than
+ * unlock we start every lock over, and clear out whatever the
+ * missing threads were in the middle of
+ */
+static void
+__fork_child()
+{
+        struct kmem_cache *internal[KM_NR_INTERNAL_CACHES] = KM_INTERNAL_CACHES;
+        struct kmem_cache *cp;
+
+        pthread_mutex_init(&cache_chain_lock, NULL);
+        for (int i = 0; i < KM_NR_INTERNAL_CACHES; i++) {
+                pthread_mutex_init(&internal[i]->lock, NULL);
+                if (internal[i]->hash) {
+                        atomic_store(&internal[i]->hash->readers[0], 0);
+                        atomic_store(&internal[i]->hash->readers[1], 0);
+                }
+        }
+        for (cp = cache_chain; cp; cp = cp->next) {
+                if (!__cache_internal(cp)) pthread_mutex_init(&cp->lock, NULL);
+
+                // Hash lookups that were in flight will never finish,
+                // and would hold off reclaiming retired nodes for good
+                if (cp->hash) {
+                        atomic_store(&cp->hash->readers[0], 0);
+                        atomic_store(&cp->hash->readers[1], 0);
+                }
+
+                // Same for CPU slab pops, and the slabs they retire
+                for (unsigned i = 0; i < cp->ncpu_slabs; i++) {
+                        atomic_store(&cp->cpu_slabs[i].readers, 0);
+                }
+
+                // The published slots are the parent's
+                cp->shm_slot = NULL;
+        }
+        if (shm_stats) {
+                munmap(shm_stats, sizeof(struct kmem_shm_header));
+                shm_stats = NULL;
+        }
+
+        __kmem_trace_fork_child();
+        __kmem_account_fork_child();
+        __kmem_pages_fork_child();
+        __kmem_mempool_fork_child();
+}
+
 /**
  * Bootstrapping function, create all the internal caches we'll need
  * Includes a fun, hacky variable to tell kmem_cache_create to not init
  * the hash tables at create time, because that wouldn't create recursion
  * (bad), since those caches won't be initialized until this function
  * completes
+ * Runs exactly once, under _init_once
  */
 static uint8_t _create_hash_on_create = 1;
+static pthread_once_t _init_once = PTHREAD_ONCE_INIT;
 static void
 __init_global_caches()
 {
         void *firstpage;
 
+        system_pagesize = sysconf(_SC_PAGESIZE);
+        system_pageshift = __builtin_ctzl(system_pagesize);
+        DEBUG_PRINT("System page size is %lu bytes\n", system_pagesize);
+
         /* First, we solve the bootstrapping problem
          * Malloc a page and manually set up a "small object" cache
          * This basically a special cased/more generic kmem_cache_grow
@@ -30,33 +165,59 @@ __init_global_caches()
         money_cache = firstpage;
         money_cache->name = "cash_money_cache";
         money_cache->object_size = sizeof(struct kmem_cache);
-        money_cache->slabs = NULL;
-        money_cache->freelist = NULL;
-        money_cache->type = KM_SMALL_CACHE;
+        __cache_init_sets(money_cache);
+        money_cache->ops = &__small_slab_ops;
         money_cache->hash = NULL;
+        money_cache->account = NULL;
+        money_cache->allocs = 0;
+        money_cache->frees = 0;
+        money_cache->shm_slot = NULL;
+        money_cache->flags = 0;
+        money_cache->sigpool = NULL;
+        money_cache->cpu_slabs = NULL;
+        money_cache->ncpu_slabs = 0;
+        money_cache->retired = NULL;
+        money_cache->min_order = 0;
+        money_cache->max_order = 0;
+        money_cache->pages = 0;
+        money_cache->ctor = NULL;
+        money_cache->dtor = NULL;
+        money_cache->lifetime = KM_LIFETIME_DEFAULT;
+        money_cache->keep_slabs = 1;
+        money_cache->owned = 0;
+        money_cache->provider = &kmem_pages_malloc;
+        atomic_init(&money_cache->hooks, NULL);
+        pthread_mutex_init(&money_cache->lock, NULL);
+        kmem_trace_name(money_cache, money_cache->name);
 
         __slab_init_small(money_cache, money_cache, 1);
 
-        hash_node_cache = kmem_cache_create("hash_node_cache",
-                                            sizeof(struct kmem_hash_node),
-                                            0 /* No align */);
-        hash_cache = kmem_cache_create("hash_cache",
-                                       sizeof(struct kmem_hash),
-                                       0 /* No align */);
-        slab_cache = kmem_cache_create("kmem_slab cache",
-                                       sizeof(struct kmem_slab),
-                                       0 /* No align */);
-        bufctl_cache = kmem_cache_create("kmem_bufctl cache",
-                                         sizeof(struct kmem_bufctl),
-                                         0 /* No align */);
+        hash_node_cache = __cache_create("hash_node_cache", &(struct kmem_cache_attr){
+                .size = sizeof(struct kmem_hash_node),
+                .provider = &kmem_pages_malloc,
+        });
+        hash_cache = __cache_create("hash_cache", &(struct kmem_cache_attr){
+                .size = sizeof(struct kmem_hash),
+                .provider = &kmem_pages_malloc,
+        });
+        slab_cache = __cache_create("kmem_slab cache", &(struct kmem_cache_attr){
+                .size = sizeof(struct kmem_slab),
+                .provider = &kmem_pages_malloc,
+        });
+        bufctl_cache = __cache_create("kmem_bufctl cache", &(struct kmem_cache_attr){
+                .size = sizeof(struct kmem_bufctl),
+                .provider = &kmem_pages_malloc,
+        });
         _create_hash_on_create = 1;
 
         // Now, init the hash tables for these caches
-        money_cache->hash = kmem_hash_init(hash_cache, hash_node_cache);
-        hash_node_cache->hash = kmem_hash_init(hash_cache, hash_node_cache);
-        hash_cache->hash = kmem_hash_init(hash_cache, hash_node_cache);
-        slab_cache->hash = kmem_hash_init(hash_cache, hash_node_cache);
-        bufctl_cache->hash =kmem_hash_init(hash_cache, hash_node_cache);
+        money_cache->hash = kmem_hash_init(hash_cache, hash_node_cache, 0);
+        hash_node_cache->hash = kmem_hash_init(hash_cache, hash_node_cache, 0);
+        hash_cache->hash = kmem_hash_init(hash_cache, hash_node_cache, 0);
+        slab_cache->hash = kmem_hash_init(hash_cache, hash_node_cache, 0);
+        bufctl_cache->hash = kmem_hash_init(hash_cache, hash_node_cache, 0);
+
+        pthread_atfork(__fork_prepare, __fork_parent, __fork_child);
 }
 
 /**
@@ -66,9 +227,54 @@ __init_global_caches()
  */
 struct kmem_cache *
 kmem_cache_create(char *name, size_t size, size_t align)
+{
+        return kmem_cache_create_attr(name, &(struct kmem_cache_attr){
+                .size = size,
+                .align = align,
+        });
+}
+
+struct kmem_cache *
+kmem_cache_create_attr(char *name, const struct kmem_cache_attr *attr)
+{
+        if (!attr->size || (attr->align & (attr->align - 1))) return NULL;
+        if (attr->slab_pages & (attr->slab_pages - 1)) return NULL;
+        if (attr->lifetime >= KM_NR_LIFETIMES) return NULL;
+        switch (attr->flags) {
+        case 0:
+                break;
+        case KM_CACHE_SIGSAFE:
+                if (!attr->nobjs || attr->nobjs >= KM_SIGPOOL_NONE) return NULL;
+                break;
+        case KM_CACHE_CPUSLAB:
+                // CPU slabs are small slabs of default lifetime objects
+                if (attr->ctor || attr->dtor || attr->lifetime != KM_LIFETIME_DEFAULT) return NULL;
+                break;
+        case KM_CACHE_SINGLE_THREAD:
+                break;
+        default:
+                return NULL;
+        }
+
+        pthread_once(&_init_once, __init_global_caches);
+        return __cache_create(name, attr);
+}
+
+/**
+ * Does the actual work for kmem_cache_create
+ * Split out so bootstrapping can create the internal
+ * caches without going back through _init_once
+ */
+static struct kmem_cache *
+__cache_create(char *name, const struct kmem_cache_attr *attr)
 {
         struct kmem_cache *cp;
-        size_t align_diff;
+        struct kmem_slab *slab;
+        size_t capacity;
+        size_t size = attr->size;
+        size_t align = attr->align;
+        // A sigsafe cache's nobjs is its reserve, the slabs go unused
+        size_t nobjs = attr->flags & KM_CACHE_SIGSAFE ? 0 : attr->nobjs;
 
         DEBUG_PRINT("Creating new slab: %s. Object size %lu, aligned at %lu\n", name, size, align);
 
@@ -76,48 +282,226 @@ kmem_cache_create(char *name, size_t size, size_t align)
         assert(size > 0);
         assert(align == 0 || !(align & (align - 1)));
 
-
-        // TODO this should support multi-page slabs for large objects
-        if (!system_pagesize) {
-                system_pagesize = sysconf(_SC_PAGESIZE);
-                DEBUG_PRINT("System page size is %lu bytes\n", system_pagesize);
-        }
-        if (!money_cache) {
-                __init_global_caches();
-        }
-
         cp = kmem_cache_alloc(money_cache, KM_SLEEP);
         if (!cp) return NULL;
 
         // Initialize the new cache
         cp->name = name;
-        cp->slabs = NULL;
-        cp->freelist = NULL;
+        __cache_init_sets(cp);
+        cp->account = NULL;
+        cp->allocs = 0;
+        cp->frees = 0;
+        cp->shm_slot = NULL;
+        // Set before the cache is on the chain, so kmem_shrink_all
+        // never sees a single thread cache as an ordinary one
+        cp->flags = attr->flags & KM_CACHE_SINGLE_THREAD;
+        cp->sigpool = NULL;
+        cp->cpu_slabs = NULL;
+        cp->ncpu_slabs = 0;
+        cp->retired = NULL;
+        cp->pages = 0;
+        cp->ctor = attr->ctor;
+        cp->dtor = attr->dtor;
+        cp->lifetime = attr->lifetime;
+        cp->keep_slabs = attr->keep_slabs ? attr->keep_slabs : 1;
+        cp->owned = 0;
+        cp->provider = attr->provider ? attr->provider : kmem_get_page_provider();
+        atomic_init(&cp->hooks, NULL);
+        pthread_mutex_init(&cp->lock, NULL);
+
+        // Round up to the alignment, bufs are laid out back to back
+        // from the start of a page
+        cp->object_size = align ? (size + align - 1) & ~(align - 1) : size;
 
-        // Alignment "magic"
-        align_diff = align /* Be safe, mod by 0 is bad */
-                ? size % align
-                : 0;
-        cp->object_size = size + align_diff;
+        // Constructed bufs can't have freelist links written into them
+        cp->ops = cp->object_size < (system_pagesize / 8) && !cp->ctor && !cp->dtor
+                ? &__small_slab_ops
+                : &__large_slab_ops;
+        DEBUG_PRINT("Slab layout is: %s\n", cp->ops->name);
 
-        cp->type = cp->object_size < (system_pagesize / 8)
-                ? KM_SMALL_CACHE
-                : KM_REGULAR_CACHE;
-        DEBUG_PRINT("Cache type is: %d\n", cp->type);
+        // Large slabs need room for at least two bufs
+        cp->min_order = 0;
+        if (cp->ops->multi_page) {
+                while ((system_pagesize << cp->min_order) / cp->object_size < 2) {
+                        cp->min_order++;
+                }
+        }
+        cp->max_order = cp->min_order;
+        if (cp->ops->multi_page) {
+                unsigned max_order = KM_SLAB_MAX_ORDER;
+
+                if (attr->slab_pages) {
+                        for (max_order = 0; (1u << max_order) < attr->slab_pages; max_order++);
+                }
+                if (max_order > cp->max_order) cp->max_order = max_order;
+
+                // Start big enough that nobjs fit in about KM_SLAB_ORDER_STEP slabs
+                while (cp->min_order < cp->max_order
+                       && (system_pagesize << cp->min_order) / cp->object_size * KM_SLAB_ORDER_STEP < nobjs) {
+                        cp->min_order++;
+                }
+        }
 
         if (_create_hash_on_create) {
-                cp->hash = kmem_hash_init(hash_cache, hash_node_cache);
+                cp->hash = kmem_hash_init(hash_cache, hash_node_cache,
+                                          cp->ops->hashed ? nobjs : 0);
                 DEBUG_PRINT("Adding hash %p to cache %s\n", (void*)cp->hash, name);
         }
 
-        // Add the first slab, so we're ready to go at first allocation
-        if (!__cache_grow(cp, KM_SLEEP)) {
-        DEBUG_PRINT("Failed adding initial slab to cache %s\n", name);
+        // Add the first slab, so we're ready to go at first allocation,
+        // and then as many more as it takes to hold nobjs. Everything
+        // in a sigsafe cache comes out of the reserve, so it gets none
+        capacity = 0;
+        if (!(attr->flags & KM_CACHE_SIGSAFE)) do {
+                slab = __cache_grow(cp, &cp->sets[cp->lifetime], KM_SLEEP);
+                if (!slab) {
+                        DEBUG_PRINT("Failed adding initial slab to cache %s\n", name);
+                        break;
+                }
+                capacity += slab->size;
+        } while (capacity < nobjs);
+
+        // The reserve or CPU slabs (and their flags) go in before the
+        // cache is on the chain, so shrinking and publishing never see
+        // it half made. A sigsafe cache never touches its CPU slabs
+        if ((attr->flags & KM_CACHE_SIGSAFE)
+            ? __cache_sigpool_init(cp, attr->nobjs)
+            : (attr->flags & KM_CACHE_CPUSLAB) && cp->ops == &__small_slab_ops
+              && __cache_cpuslab_init(cp)) {
+                __cache_reap(cp, 1, 0);
+                kmem_hash_free(hash_cache, cp->hash);
+                pthread_mutex_destroy(&cp->lock);
+                kmem_cache_free(money_cache, cp);
+                return NULL;
         }
 
+        // Hook it onto the cache chain
+        pthread_mutex_lock(&cache_chain_lock);
+        cp->last = NULL;
+        cp->next = cache_chain;
+        if (cache_chain) {
+                cache_chain->last = cp;
+        }
+        cache_chain = cp;
+        kmem_trace_name(cp, cp->name);
+        KM_TRACE(KM_TRACE_CREATE, cp, NULL, NULL);
+        if (shm_stats) {
+                pthread_mutex_lock(&cp->lock);
+                __shm_attach(cp);
+                pthread_mutex_unlock(&cp->lock);
+        }
+        pthread_mutex_unlock(&cache_chain_lock);
+
         return cp;
 }
 
+/**
+ * Set up the reserve for a KM_CACHE_SIGSAFE cache
+ * Called from __cache_create, before the cache is on the chain
+ * Returns 0, or -1 if there's no memory for it
+ */
+static int
+__cache_sigpool_init(struct kmem_cache *cp, size_t nobjs)
+{
+        struct kmem_sigpool *sp;
+        size_t i;
+
+        sp = malloc(sizeof(struct kmem_sigpool) + nobjs * sizeof(sp->next[0]));
+        if (!sp) return -1;
+        if (posix_memalign(&sp->base, system_pagesize, nobjs * cp->object_size)) {
+                free(sp);
+                return -1;
+        }
+
+        sp->nobjs = nobjs;
+        for (i = 0; i < nobjs; i++) {
+                atomic_init(&sp->next[i], i + 1 < nobjs ? i + 1 : KM_SIGPOOL_NONE);
+                if (cp->ctor) cp->ctor((void*)((uintptr_t)sp->base + i * cp->object_size), cp->object_size);
+        }
+        atomic_init(&sp->head, 0);
+
+        cp->sigpool = sp;
+        cp->flags |= KM_CACHE_SIGSAFE;
+
+        DEBUG_PRINT("Cache %s reserves %lu objects for signal handlers\n", cp->name, nobjs);
+        return 0;
+}
+
+struct kmem_cache *
+kmem_cache_create_sigsafe(char *name, size_t size, size_t align, size_t nobjs)
+{
+        return kmem_cache_create_attr(name, &(struct kmem_cache_attr){
+                .size = size,
+                .align = align,
+                .nobjs = nobjs,
+                .flags = KM_CACHE_SIGSAFE,
+        });
+}
+
+/**
+ * Give a small object cache its CPU slabs
+ * Called from __cache_create, before the cache is on the chain
+ * A cache the CPU slab word can't describe stays on the locked path
+ * Returns 0, or -1 if there's no memory for them
+ */
+static int
+__cache_cpuslab_init(struct kmem_cache *cp)
+{
+        struct kmem_slab *first = cp->sets[cp->lifetime].freelist;
+        long ncpus;
+        unsigned i;
+
+        if (system_pagesize / cp->object_size >= KM_CPU_NONE || (first && !KM_CPU_FITS(first->start))) {
+                DEBUG_PRINT("Cache %s won't fit in a CPU slab word, staying locked\n", cp->name);
+                return 0;
+        }
+
+        ncpus = sysconf(_SC_NPROCESSORS_CONF);
+        cp->ncpu_slabs = ncpus > 0 ? ncpus : 1;
+        if (posix_memalign((void**)&cp->cpu_slabs, sizeof(struct kmem_cpu_slab),
+                           cp->ncpu_slabs * sizeof(struct kmem_cpu_slab))) {
+                cp->cpu_slabs = NULL;
+                cp->ncpu_slabs = 0;
+                return -1;
+        }
+        for (i = 0; i < cp->ncpu_slabs; i++) {
+                atomic_init(&cp->cpu_slabs[i].freelist, KM_CPU_WORD(0, KM_CPU_NONE, 0));
+                atomic_init(&cp->cpu_slabs[i].readers, 0);
+        }
+        cp->flags |= KM_CACHE_CPUSLAB;
+
+        DEBUG_PRINT("Cache %s has %u CPU slabs\n", cp->name, cp->ncpu_slabs);
+        return 0;
+}
+
+struct kmem_cache *
+kmem_cache_create_cpuslab(char *name, size_t size, size_t align)
+{
+        return kmem_cache_create_attr(name, &(struct kmem_cache_attr){
+                .size = size,
+                .align = align,
+                .flags = KM_CACHE_CPUSLAB,
+        });
+}
+
+/**
+ * Allocate from this CPU's slab, refilling it as needed
+ * Returns NULL if there's no memory (KM_NOSLEEP only)
+ */
+static inline void *
+__cache_alloc_cpu(struct kmem_cache *cp, int flags)
+{
+        struct kmem_cpu_slab *cs;
+        void *data;
+
+        cs = __cpu_slab(cp);
+        while (!(data = __cpu_slab_pop(cp, cs))) {
+                if (__cpu_slab_refill(cp, cs, flags)) return NULL;
+        }
+        KM_TRACE(KM_TRACE_ALLOC, cp, data, __slab_of_small(data));
+        return data;
+}
+
 /**
  * Allocate an item from the given cache
  * flags is one of KM_SLEEP or KM_NOSLEEP,
@@ -128,30 +512,64 @@ kmem_cache_create(char *name, size_t size, size_t align)
 void *
 kmem_cache_alloc(struct kmem_cache *cp, int flags)
 {
+        struct kmem_slab_set *set;
         struct kmem_slab *slab;
         void *data;
 
+        if (__builtin_expect(cp->flags & KM_CACHE_SIGSAFE, 0)) {
+                return __sigpool_alloc(cp);
+        }
+
         DEBUG_PRINT("Allocating new item from cache %s\n", cp->name);
 
+        if (cp->account && kmem_account_charge(cp->account, cp->object_size, flags)) {
+                DEBUG_PRINT("Cache %s is over its account's limit\n", cp->name);
+                return NULL;
+        }
+
+        if ((cp->flags & KM_CACHE_CPUSLAB) && !(flags & (KM_SHORTLIVED | KM_LONGLIVED))) {
+                data = __cache_alloc_cpu(cp, flags);
+                if (!data) {
+                        DEBUG_PRINT("Unable to refill CPU slab for cache %s\n", cp->name);
+                        if (cp->account) {
+                                kmem_account_uncharge(cp->account, cp->object_size);
+                        }
+                        return NULL;
+                }
+                if (__hooks_installed()) {
+                        __run_alloc_hooks(cp, data);
+                }
+                return data;
+        }
+
+        __cache_lock(cp);
+
         // Get the first slab with free bufs
         // This is the first item in the freelist, except for when that
         // is the HEAD of the list (e.g. the only slab is full)
-        slab = cp->freelist;
+        set = __cache_set(cp, flags);
+        slab = set->freelist;
         while (!slab || slab->refcount >= slab->size) {
                 // No slabs are available, get a new one
+                if (flags & KM_NOGROW) {
+                        slab = NULL;
+                        break;
+                }
                 DEBUG_PRINT("Growing the cache...\n");
-                slab = __cache_grow(cp, flags);
-                if (!slab && flags == KM_NOSLEEP) break;
+                slab = __cache_grow(cp, set, flags & KM_NOSLEEP);
+                if (!slab && (flags & KM_NOSLEEP)) break;
         }
 
         if (!slab) {
                 DEBUG_PRINT("Unable to allocate new slab for cache %s\n", cp->name);
+                __cache_unlock(cp);
+                if (cp->account) {
+                        kmem_account_uncharge(cp->account, cp->object_size);
+                }
                 return NULL;
         }
 
-        data = cp->type == KM_REGULAR_CACHE
-                ? __cache_alloc_large(cp, slab)
-                : __cache_alloc_small(cp, slab);
+        data = __slab_alloc(cp, slab);
 
         if (slab->size == slab->refcount) {
                 // Slab is full, move it off the cache's freelist
@@ -159,29 +577,552 @@ kmem_cache_alloc(struct kmem_cache *cp, int flags)
                 __slab_complete(cp, slab);
         }
 
+        cp->allocs++;
+        __cache_publish_unlock(cp);
+
+        if (__hooks_installed()) {
+                __run_alloc_hooks(cp, data);
+        }
+        return data;
+}
+
+/**
+ * Allocate from the slab hint came from, if it has room
+ * The slab is found from the buf the same way free finds it,
+ * so this costs a hash lookup on large object caches
+ */
+void *
+kmem_cache_alloc_near(struct kmem_cache *cp, void *hint, int flags)
+{
+        struct kmem_slab *slab;
+        void *handle;
+        void *data;
+
+        if (!hint || (cp->flags & KM_CACHE_SIGSAFE)) {
+                return kmem_cache_alloc(cp, flags);
+        }
+
+        slab = cp->ops->owner(cp, hint, &handle);
+        if (!slab) {
+                DEBUG_PRINT("Hint %p isn't from cache %s\n", hint, cp->name);
+                return kmem_cache_alloc(cp, flags);
+        }
+
+        __cache_lock(cp);
+        if (slab->set != __cache_set(cp, flags) || slab->refcount >= slab->size) {
+                // Full, or the lifetime hint wants another set: allocate as usual
+                __cache_unlock(cp);
+                return kmem_cache_alloc(cp, flags);
+        }
+
+        if (cp->account && kmem_account_charge(cp->account, cp->object_size, flags)) {
+                DEBUG_PRINT("Cache %s is over its account's limit\n", cp->name);
+                __cache_unlock(cp);
+                return NULL;
+        }
+
+        data = __slab_alloc(cp, slab);
+        __slab_resort(cp, slab);
+
+        cp->allocs++;
+        __cache_publish_unlock(cp);
+
+        if (__hooks_installed()) {
+                __run_alloc_hooks(cp, data);
+        }
+        return data;
+}
+
+/**
+ * Partial slabs aren't searched for gaps: a run either carries
+ * on where the last one left off in the freelist head slab, or
+ * starts an empty one
+ */
+void *
+kmem_cache_alloc_contig(struct kmem_cache *cp, size_t n, int flags)
+{
+        struct kmem_slab_set *set;
+        struct kmem_slab *slab;
+        void *data;
+
+        if (!n || (cp->flags & KM_CACHE_SIGSAFE) || !cp->ops->take_run) return NULL;
+
+        DEBUG_PRINT("Allocating a run of %lu from cache %s\n", n, cp->name);
+
+        if (cp->account && kmem_account_charge(cp->account, n * cp->object_size, flags)) {
+                DEBUG_PRINT("Cache %s is over its account's limit\n", cp->name);
+                return NULL;
+        }
+
+        __cache_lock(cp);
+
+        set = __cache_set(cp, flags);
+        slab = set->freelist;
+        data = NULL;
+        if (slab && !slab->frozen && slab->size - slab->refcount >= n) {
+                data = __slab_take_run(cp, slab, n, 0);
+        }
+
+        if (!data) {
+                // Empty slabs sit at the tail, so that's the one to check,
+                // if it's big enough (it may be from a smaller order)
+                slab = set->slabs ? set->slabs->last : NULL;
+                if (!slab || slab->refcount || slab->frozen || slab->size < n) {
+                        slab = __cache_grow(cp, set, flags & KM_NOSLEEP);
+                }
+                if (!slab || n > slab->size) {
+                        DEBUG_PRINT("No room for a run of %lu in cache %s\n", n, cp->name);
+                        __cache_unlock(cp);
+                        if (cp->account) {
+                                kmem_account_uncharge(cp->account, n * cp->object_size);
+                        }
+                        return NULL;
+                }
+                data = __slab_take_run(cp, slab, n, 1);
+        }
+
+        if (slab->refcount == slab->size) {
+                __slab_resort(cp, slab);
+        } else {
+                __cache_partial_slab(cp, slab);
+        }
+
+        cp->allocs += n;
+        __cache_publish_unlock(cp);
+
+        if (__hooks_installed()) {
+                for (size_t i = 0; i < n; i++) {
+                        __run_alloc_hooks(cp, (void*)((uintptr_t)data + i * cp->object_size));
+                }
+        }
         return data;
 }
 
 /**
  * Return an element to the cache
+ * The buf's slab is looked up before taking the cache lock
+ * (for large objects, the buf -> bufctl hash lookup), so frees
+ * only serialize on the (short) slab list update
  */
 void
 kmem_cache_free(struct kmem_cache *cp, void *buf)
 {
-        if (cp->type == KM_SMALL_CACHE) {
-                __cache_free_small(cp, buf);
+        struct kmem_slab *slab;
+        void *handle;
+
+        if (__builtin_expect(cp->flags & KM_CACHE_SIGSAFE, 0)) {
+                __sigpool_free(cp, buf);
+                return;
+        }
+
+        if (__hooks_installed()) {
+                __run_free_hooks(cp, buf);
+        }
+
+        if ((cp->flags & KM_CACHE_CPUSLAB) && __cpu_slab_push(cp, __cpu_slab(cp), buf)) {
+                KM_TRACE(KM_TRACE_FREE, cp, buf, __slab_of_small(buf));
         } else {
-                __cache_free_large(cp, buf);
+                slab = cp->ops == &__small_slab_ops
+                        ? __small_slab_owner(cp, buf, &handle)
+                        : cp->ops->owner(cp, buf, &handle);
+                if (!slab) {
+                        DEBUG_PRINT("Unable to find the slab of item %p\n", buf);
+                        return;
+                }
+
+                __cache_lock(cp);
+                __cache_free(cp, slab, buf, handle);
+                __cache_publish_unlock(cp);
+        }
+
+        if (cp->account) {
+                kmem_account_uncharge(cp->account, cp->object_size);
+        }
+}
+
+/**
+ * Layouts that find the slab from the page can't tell a stray
+ * buf from one of ours, but every slab is on one of its own
+ * cache's sets
+ */
+int
+kmem_cache_owns(struct kmem_cache *cp, void *buf)
+{
+        struct kmem_slab *slab;
+        void *handle;
+
+        if (cp->flags & KM_CACHE_SIGSAFE) {
+                return (uintptr_t)buf >= (uintptr_t)cp->sigpool->base &&
+                       (uintptr_t)buf < (uintptr_t)cp->sigpool->base + cp->sigpool->nobjs * cp->object_size;
+        }
+        slab = cp->ops->owner(cp, buf, &handle);
+        return slab && slab->set >= cp->sets && slab->set < cp->sets + KM_NR_LIFETIMES;
+}
+
+/**
+ * Return n elements to the cache at once
+ * Slabs are looked up KM_BULK_BATCH at a time, with the layout's
+ * owner_many if it has one (for large caches, one
+ * kmem_hash_get_many call, so those misses overlap)
+ * Building with KM_BULK_PREFETCH=0 looks each one up on its own,
+ * still under one lock a batch, so the bench can tell the two apart
+ */
+#define KM_BULK_BATCH 16
+#ifndef KM_BULK_PREFETCH
+#define KM_BULK_PREFETCH 1
+#endif
+void
+kmem_cache_free_bulk(struct kmem_cache *cp, size_t n, void **bufs)
+{
+        struct kmem_slab *slabs[KM_BULK_BATCH];
+        void *handles[KM_BULK_BATCH];
+        size_t batch;
+        size_t freed;
+        size_t i;
+
+        if (__builtin_expect(cp->flags & KM_CACHE_SIGSAFE, 0)) {
+                for (i = 0; i < n; i++) {
+                        __sigpool_free(cp, bufs[i]);
+                }
+                return;
+        }
+
+        if (__hooks_installed()) {
+                for (i = 0; i < n; i++) {
+                        __run_free_hooks(cp, bufs[i]);
+                }
+        }
+
+        freed = 0;
+        while (n) {
+                batch = n < KM_BULK_BATCH ? n : KM_BULK_BATCH;
+                if (KM_BULK_PREFETCH && cp->ops->owner_many) {
+                        cp->ops->owner_many(cp, batch, bufs, slabs, handles);
+                } else {
+                        for (i = 0; i < batch; i++) {
+                                slabs[i] = cp->ops->owner(cp, bufs[i], &handles[i]);
+                        }
+                }
+
+                __cache_lock(cp);
+                for (i = 0; i < batch; i++) {
+                        if (!slabs[i]) {
+                                DEBUG_PRINT("Unable to find the slab of item %p\n", bufs[i]);
+                                continue;
+                        }
+                        __cache_free(cp, slabs[i], bufs[i], handles[i]);
+                        freed++;
+                }
+                __cache_publish_unlock(cp);
+
+                bufs += batch;
+                n -= batch;
+        }
+
+        if (cp->account) {
+                kmem_account_uncharge(cp->account, freed * cp->object_size);
+        }
+}
+
+void
+kmem_cache_free_contig(struct kmem_cache *cp, void *buf, size_t n)
+{
+        void *bufs[KM_BULK_BATCH];
+        size_t batch;
+        size_t i;
+
+        while (n) {
+                batch = n < KM_BULK_BATCH ? n : KM_BULK_BATCH;
+                for (i = 0; i < batch; i++) {
+                        bufs[i] = (void*)((uintptr_t)buf + i * cp->object_size);
+                }
+                kmem_cache_free_bulk(cp, batch, bufs);
+
+                buf = (void*)((uintptr_t)buf + batch * cp->object_size);
+                n -= batch;
         }
 }
 
+/**
+ * Swap in new hooks, keeping hooks_installed in step
+ */
+static void
+__set_hooks(_Atomic(const struct kmem_hooks *) *slot, const struct kmem_hooks *hooks)
+{
+        const struct kmem_hooks *old;
+
+        old = atomic_exchange_explicit(slot, hooks, memory_order_acq_rel);
+        if (hooks && !old) {
+                atomic_fetch_add_explicit(&hooks_installed, 1, memory_order_relaxed);
+        } else if (!hooks && old) {
+                atomic_fetch_sub_explicit(&hooks_installed, 1, memory_order_relaxed);
+        }
+}
+
+/**
+ * Install hooks for every cache
+ */
+void
+kmem_set_hooks(const struct kmem_hooks *hooks)
+{
+        __set_hooks(&global_hooks, hooks);
+}
+
+/**
+ * Install hooks for one cache
+ */
+void
+kmem_cache_set_hooks(struct kmem_cache *cp, const struct kmem_hooks *hooks)
+{
+        __set_hooks(&cp->hooks, hooks);
+}
+
+/**
+ * Fill in stats for the given cache
+ * Walks the slabs to count objects, so it's not free
+ */
+void
+kmem_cache_get_stats(struct kmem_cache *cp, struct kmem_cache_stats *stats)
+{
+        struct kmem_slab_set *set;
+        struct kmem_slab *slab;
+        int i;
+
+        memset(stats, 0, sizeof(struct kmem_cache_stats));
+        stats->name = cp->name;
+        stats->object_size = cp->object_size;
+
+        pthread_mutex_lock(&cp->lock);
+        if (cp->cpu_slabs) {
+                // Bufs sitting on CPU slabs look allocated until they're back
+                __cpu_slabs_drain(cp);
+        }
+        stats->slab_count = cp->slab_count;
+        stats->peak_slabs = cp->peak_slabs;
+        stats->pages = cp->pages;
+        stats->slab_order = __cache_order(cp);
+        stats->min_order = cp->min_order;
+        stats->max_order = cp->max_order;
+        stats->allocs = __atomic_load_n(&cp->allocs, __ATOMIC_RELAXED);
+        stats->frees = __atomic_load_n(&cp->frees, __ATOMIC_RELAXED);
+        if (cp->sigpool) {
+                // Reserve objects aren't on any slab
+                stats->objects = stats->allocs - stats->frees;
+        }
+        for (i = 0; i < KM_NR_LIFETIMES; i++) {
+                set = &cp->sets[i];
+                stats->set_slabs[i] = set->slab_count;
+                if (!set->slabs) continue;
+
+                slab = set->slabs;
+                do {
+                        stats->objects += slab->refcount;
+                        slab = slab->next;
+                } while (slab != set->slabs);
+        }
+        pthread_mutex_unlock(&cp->lock);
+}
+
+/**
+ * Create the shared segment and hand every cache a slot
+ */
+int
+kmem_stats_publish(const char *shm_name)
+{
+        struct kmem_cache *cp;
+        int fd;
+
+        pthread_once(&_init_once, __init_global_caches);
+        if (strlen(shm_name) >= sizeof(shm_stats_name)) return -1;
+
+        pthread_mutex_lock(&cache_chain_lock);
+        if (shm_stats) {
+                pthread_mutex_unlock(&cache_chain_lock);
+                return -1;
+        }
+
+        fd = shm_open(shm_name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+        if (fd < 0) {
+                pthread_mutex_unlock(&cache_chain_lock);
+                return -1;
+        }
+        if (ftruncate(fd, sizeof(struct kmem_shm_header))) {
+                close(fd);
+                shm_unlink(shm_name);
+                pthread_mutex_unlock(&cache_chain_lock);
+                return -1;
+        }
+        shm_stats = mmap(NULL, sizeof(struct kmem_shm_header),
+                         PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (shm_stats == MAP_FAILED) {
+                shm_stats = NULL;
+                shm_unlink(shm_name);
+                pthread_mutex_unlock(&cache_chain_lock);
+                return -1;
+        }
+
+        // Fresh from ftruncate, so everything is already zeroed
+        strcpy(shm_stats_name, shm_name);
+        shm_stats->version = KM_SHM_VERSION;
+        shm_stats->max_caches = KM_SHM_MAX_CACHES;
+        shm_stats->pid = getpid();
+
+        for (cp = cache_chain; cp; cp = cp->next) {
+                pthread_mutex_lock(&cp->lock);
+                __shm_attach(cp);
+                pthread_mutex_unlock(&cp->lock);
+        }
+
+        // Readers check the magic last, so it goes in last
+        __atomic_store_n(&shm_stats->magic, KM_SHM_MAGIC, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&cache_chain_lock);
+
+        DEBUG_PRINT("Publishing cache stats to %s\n", shm_name);
+        return 0;
+}
+
+/**
+ * Detach every cache and remove the segment
+ */
+void
+kmem_stats_unpublish()
+{
+        struct kmem_cache *cp;
+
+        pthread_mutex_lock(&cache_chain_lock);
+        if (!shm_stats) {
+                pthread_mutex_unlock(&cache_chain_lock);
+                return;
+        }
+
+        for (cp = cache_chain; cp; cp = cp->next) {
+                pthread_mutex_lock(&cp->lock);
+                __shm_detach(cp);
+                pthread_mutex_unlock(&cp->lock);
+        }
+
+        munmap(shm_stats, sizeof(struct kmem_shm_header));
+        shm_unlink(shm_stats_name);
+        shm_stats = NULL;
+        pthread_mutex_unlock(&cache_chain_lock);
+}
+
+/**
+ * Give every empty slab in the cache back to the system
+ * CPU slabs are drained first, then it's a full reap that
+ * doesn't hold on to a last slab
+ */
+size_t
+kmem_cache_shrink(struct kmem_cache *cp)
+{
+        size_t freed;
+
+        pthread_mutex_lock(&cp->lock);
+        if (cp->cpu_slabs) {
+                __cpu_slabs_drain(cp);
+        }
+        freed = __cache_reap(cp, 0, 0);
+        if (cp->cpu_slabs) {
+                __cpu_slabs_reclaim(cp, 0);
+        }
+        if (cp->hash) {
+                kmem_hash_reclaim(cp->hash);
+        }
+        __cache_publish(cp);
+        pthread_mutex_unlock(&cp->lock);
+
+        DEBUG_PRINT("Shrinking cache %s released %lu bytes\n", cp->name, freed);
+        return freed;
+}
+
+/**
+ * Shrink caches until target_bytes have been released
+ * Each pass looks for the cache with the most reclaimable
+ * memory and shrinks it. There are only ever a handful of
+ * caches, so a linear scan per pass is fine
+ * Single thread caches are skipped, only their owner may touch them
+ */
+size_t
+kmem_shrink_all(size_t target_bytes)
+{
+        struct kmem_cache *cp;
+        struct kmem_cache *victim;
+        size_t reclaimable;
+        size_t most;
+        size_t freed;
+
+        freed = 0;
+        pthread_mutex_lock(&cache_chain_lock);
+        while (freed < target_bytes) {
+                victim = NULL;
+                most = 0;
+                for (cp = cache_chain; cp; cp = cp->next) {
+                        if (cp->flags & KM_CACHE_SINGLE_THREAD) continue;
+
+                        pthread_mutex_lock(&cp->lock);
+                        reclaimable = __cache_reclaimable(cp);
+                        pthread_mutex_unlock(&cp->lock);
+                        if (reclaimable > most) {
+                                most = reclaimable;
+                                victim = cp;
+                        }
+                }
+                if (!victim) break;
+
+                freed += kmem_cache_shrink(victim);
+        }
+        pthread_mutex_unlock(&cache_chain_lock);
+
+        DEBUG_PRINT("Global shrink released %lu of %lu bytes\n", freed, target_bytes);
+        return freed;
+}
+
 /**
  * Destroy the given cache
+ * ASSUMES nobody else is still using it
  */
 void
 kmem_cache_destroy(struct kmem_cache *cp)
 {
+        pthread_mutex_lock(&cache_chain_lock);
+        if (cp->last) {
+                cp->last->next = cp->next;
+        } else {
+                cache_chain = cp->next;
+        }
+        if (cp->next) {
+                cp->next->last = cp->last;
+        }
+        // Off the chain, unpublish can't see it, so let go of the slot now
+        pthread_mutex_lock(&cp->lock);
+        __shm_detach(cp);
+        pthread_mutex_unlock(&cp->lock);
+        pthread_mutex_unlock(&cache_chain_lock);
+
+        kmem_cache_set_hooks(cp, NULL);
+        KM_TRACE(KM_TRACE_DESTROY, cp, NULL, NULL);
+
+        pthread_mutex_lock(&cp->lock);
+        if (cp->cpu_slabs) {
+                __cpu_slabs_drain(cp);
+        }
+        __cache_reap(cp, 1, 0);
+        if (cp->cpu_slabs) {
+                __cpu_slabs_reclaim(cp, 1);
+        }
+        pthread_mutex_unlock(&cp->lock);
+        pthread_mutex_destroy(&cp->lock);
+
+        // Reaping drops hash entries, so the table has to outlive it
         kmem_hash_free(hash_cache, cp->hash);
-        cp->freelist = NULL;
-        __cache_reap(cp, 1);
+
+        if (cp->sigpool) {
+                for (size_t i = 0; cp->dtor && i < cp->sigpool->nobjs; i++) {
+                        cp->dtor((void*)((uintptr_t)cp->sigpool->base + i * cp->object_size), cp->object_size);
+                }
+                free(cp->sigpool->base);
+                free(cp->sigpool);
+        }
+        free(cp->cpu_slabs);
 }
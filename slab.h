@@ -1,15 +1,22 @@
 #ifndef PLOPREIATO_SLAB_H
 #define PLOPREIATO_SLAB_H
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stddef.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /* Keep gcc happy */
 #define UNUSED(x) UNUSED_ ## x __attribute__((unused))
 
 #if DEBUG
 #define DEBUG_PRINT(...) fprintf(stderr, __VA_ARGS__)
 #else
-#define DEBUG_PRINT(...) do {} while (0)
+/* Never runs, but keeps the arguments "used" and format checked */
+#define DEBUG_PRINT(...) do { if (0) fprintf(stderr, __VA_ARGS__); } while (0)
 #endif
 
 /**
@@ -18,13 +25,67 @@
  *
  * The basic idea is to keep caches of pre-initialized
  * objects that the allocator can quickly give out.
+ *
+ * fork() is safe from any thread, whatever the others are doing:
+ * the allocator is quiesced around it, and the child gets every
+ * cache with its slabs as they were, so a prefork server can warm
+ * caches once in the parent and share the pages until written.
+ * Per-thread state (account stocks, trace rings) from threads the
+ * child didn't get is given back, and published stats stay with
+ * the parent (the child can publish its own)
  */
 
 #define KM_SLEEP 0
 #define KM_NOSLEEP 1
 
-#define KM_REGULAR_CACHE 0
-#define KM_SMALL_CACHE 1
+/**
+ * Lifetime hints, or'd into the allocation flags
+ * Objects with different hints come from different slabs, so
+ * one long lived object can't pin a slab full of short lived
+ * ones that would otherwise be reaped
+ */
+#define KM_SHORTLIVED 2
+#define KM_LONGLIVED 4
+
+/**
+ * Only allocate from slabs the cache already has, and return NULL
+ * rather than grow it, so a caller with somewhere else to look
+ * can try there first (see kmem_alloc's class fallback)
+ */
+#define KM_NOGROW 8
+
+#define KM_LIFETIME_DEFAULT 0
+#define KM_LIFETIME_SHORT 1
+#define KM_LIFETIME_LONG 2
+#define KM_NR_LIFETIMES 3
+
+/**
+ * Slab sizes for large object caches grow with the cache: a slab
+ * is (pagesize << order) bytes, and the order goes up by one each
+ * time the slab count doubles past KM_SLAB_ORDER_STEP, up to
+ * KM_SLAB_MAX_ORDER. So small caches stay at a page a slab, and
+ * big ones pay for growing, listing and reaping far fewer slabs.
+ * Objects too big for two to fit a page start at a higher order.
+ * Small object caches find a buf's slab from its page, so they
+ * always stay at order 0
+ */
+#ifndef KM_SLAB_MAX_ORDER
+#define KM_SLAB_MAX_ORDER 3
+#endif
+#define KM_SLAB_ORDER_STEP 8
+
+/**
+ * Cache flags, kept in kmem_cache.flags
+ * KM_CACHE_SIGSAFE: served from a fixed reserve with lock-free
+ * operations only (see kmem_cache_create_sigsafe)
+ * KM_CACHE_CPUSLAB: each CPU allocates from its own active slab
+ * without the cache lock (see kmem_cache_create_cpuslab)
+ * KM_CACHE_SINGLE_THREAD: only ever used from one thread, so
+ * allocation and free skip the cache lock (see kmem_cache_attr)
+ */
+#define KM_CACHE_SIGSAFE 0x1
+#define KM_CACHE_CPUSLAB 0x2
+#define KM_CACHE_SINGLE_THREAD 0x4
 
 union buf_ish {
         struct kmem_bufctl *bufctl;
@@ -49,6 +110,25 @@ struct kmem_slab {
         size_t size;            /* Number of bufs total on slab */
         size_t refcount;        /* How many bufs are in use */
         void *start;            /* Address of the allocated memory for this slab */
+        struct kmem_slab_set *set; /* Which of the cache's lists we're on */
+        unsigned order;         /* Slab is (pagesize << order) bytes */
+        unsigned frozen;        /* Active in this many CPU slabs, which
+                                 * keeps it from being reaped
+                                 */
+};
+
+/**
+ * One list of slabs in a cache
+ * Each lifetime hint gets its own set
+ */
+struct kmem_slab_set {
+        struct kmem_slab *slabs;    /* Circular, doubly linked list of slabs
+                                     * Sorted as empty (all allocated), then
+                                     * partial slabs, (some allocated), and
+                                     * complete (all free, refcount = 0)
+                                     */
+        struct kmem_slab *freelist; /* Pointer to first nonempty slab */
+        unsigned slab_count;        /* Number of slabs in this set */
 };
 
 /**
@@ -60,28 +140,186 @@ struct kmem_bufctl {
         void *buf;                /* This is a pointer to the real data */
 };
 
+/**
+ * How a cache lays out its slabs, picked when it's created
+ * A layout only knows where a slab's bufs are and how the free
+ * ones are linked. The list keeping, refcounts, tracing and
+ * construction around it are the same for every layout, so a
+ * new one plugs in with a table of these. Everything but owner
+ * is called under the cache lock
+ */
+struct kmem_cache;
+struct kmem_slab_ops {
+        const char *name;
+        unsigned multi_page;    /* Slabs can span pages, so the cache
+                                 * grows them (see KM_SLAB_MAX_ORDER)
+                                 */
+        unsigned hashed;        /* Bufs are found through cp->hash, so
+                                 * it's sized for kmem_cache_attr.nobjs
+                                 */
+
+        /* Set up a slab on the (pagesize << order) bytes at page */
+        struct kmem_slab *(*init)(struct kmem_cache *cp, void *page, unsigned order, int flags);
+
+        /* Take a free buf off a slab that has one */
+        void *(*alloc)(struct kmem_cache *cp, struct kmem_slab *slab);
+
+        /* The slab buf came from, and the handle free wants for it,
+         * or NULL if it isn't from cp
+         */
+        struct kmem_slab *(*owner)(struct kmem_cache *cp, void *buf, void **handle);
+
+        /* owner for n bufs at once (slabs[i] NULL for strays), so the
+         * lookups can overlap. NULL to call owner on each
+         */
+        void (*owner_many)(struct kmem_cache *cp, size_t n, void **bufs,
+                           struct kmem_slab **slabs, void **handles);
+
+        /* Put a buf back on its slab's freelist */
+        void (*free)(struct kmem_cache *cp, struct kmem_slab *slab, void *handle);
+
+        /* Give back a slab's metadata, before its memory goes. May be NULL */
+        void (*reap)(struct kmem_cache *cp, struct kmem_slab *slab);
+
+        /* For kmem_cache_alloc_contig, NULL if runs aren't supported:
+         * take_run takes n back to back bufs off the head of a slab's
+         * freelist (or returns NULL), carve takes the first n of an
+         * empty slab and links the rest after them in address order
+         */
+        void *(*take_run)(struct kmem_cache *cp, struct kmem_slab *slab, size_t n);
+        void *(*carve)(struct kmem_cache *cp, struct kmem_slab *slab, size_t n);
+};
+
+/**
+ * Hooks called on every allocation and free
+ * alloc runs after the object is handed out, free runs
+ * just before it goes back, both outside any cache lock
+ * Either one may be NULL
+ */
+typedef void (*kmem_hook_fn)(struct kmem_cache *cp, void *buf, void *arg);
+struct kmem_hooks {
+        kmem_hook_fn alloc;
+        kmem_hook_fn free;
+        void *arg;
+};
+
 /**
  * The basic container for an object cache
  */
 struct kmem_cache {
         char *name;                 /* Used for debug purposes */
         unsigned slab_count;        /* Number of slabs in this cache */
+        unsigned peak_slabs;        /* Most slabs it has ever held at once */
         size_t object_size;         /* The size of one object in the cache
                                      * including alignment
                                      */
-        struct kmem_slab *slabs;    /* Circular, doubly linked list of slabs
-                                     * Sorted as empty (all allocated), then
-                                     * partial slabs, (some allocated), and
-                                     * complete (all free, refcount = 0)
-                                     */
-        struct kmem_slab *freelist; /* Pointer to first nonempty slab */
-        unsigned char type;     /* Either KM_REGULAR_CACHE or
-                                 * KM_SMALL_CACHE, depending if the small
-                                 * object optimizations are in play
-                                 */
+        struct kmem_slab_set sets[KM_NR_LIFETIMES]; /* Slabs, by lifetime hint */
+        const struct kmem_slab_ops *ops; /* Slab layout: bufs on the page for
+                                          * small objects, bufctls for the
+                                          * rest (see slab_internal.c)
+                                          */
         struct kmem_hash *hash; /* Hash table for mapping buf -> bufctl */
+        pthread_mutex_t lock;   /* Protects the slab lists and their
+                                 * freelists. Lookups in hash don't
+                                 * need it (see hash.h)
+                                 */
+        struct kmem_cache *next;        /* Cache chain, so every cache */
+        struct kmem_cache *last;        /* can be found for shrinking */
+        struct kmem_account *account;   /* Who gets charged for allocations,
+                                         * NULL if nobody (see account.h)
+                                         */
+        _Atomic(const struct kmem_hooks *) hooks; /* This cache's hooks, or NULL */
+        size_t allocs;                  /* Allocations since creation */
+        size_t frees;                   /* Frees since creation */
+        struct kmem_shm_cache *shm_slot; /* Where our counters are published,
+                                          * if they are (see kmem_shm.h)
+                                          */
+        unsigned flags;                 /* KM_CACHE_* */
+        unsigned min_order;             /* Slab orders this cache grows */
+        unsigned max_order;             /* between, see KM_SLAB_MAX_ORDER */
+        size_t pages;                   /* Held by all of its slabs */
+        struct kmem_sigpool *sigpool;   /* The reserve, for KM_CACHE_SIGSAFE */
+        struct kmem_cpu_slab *cpu_slabs; /* One per CPU, for KM_CACHE_CPUSLAB */
+        unsigned ncpu_slabs;
+        struct kmem_slab *retired;      /* Reaped slabs a CPU slab pop might
+                                         * still be reading, freed once
+                                         * none can be
+                                         */
+        void (*ctor)(void *, size_t);   /* From kmem_cache_attr, or NULL */
+        void (*dtor)(void *, size_t);
+        unsigned lifetime;              /* Set for allocations without a hint */
+        unsigned keep_slabs;            /* Slabs a set keeps when frees empty them */
+        pthread_t owner;                /* For KM_CACHE_SINGLE_THREAD, the thread */
+        unsigned owned;                 /* using it, checked in debug builds */
+        const struct kmem_page_provider *provider; /* Where slabs come from */
+};
+
+/**
+ * Everything a cache can be set up with, for kmem_cache_create_attr
+ * Zero is the default for every field but size, so designated
+ * initializers only need to name what they change
+ *
+ * nobjs is how many objects the cache expects to hold at once.
+ * Slabs for that many are made up front, large object caches start
+ * at a slab size that holds them in about KM_SLAB_ORDER_STEP slabs,
+ * and their hash gets a bucket apiece. For KM_CACHE_SIGSAFE it's the
+ * size of the reserve.
+ *
+ * ctor runs on every buf when its slab is made and dtor when the
+ * slab is given back (Bonwick's object caching), so bufs come out
+ * of the cache constructed and go back in that state. Either one
+ * keeps freelist links out of the bufs, so the cache uses bufctls
+ * whatever its object size. Both run under the cache lock, and
+ * mustn't use the cache they belong to.
+ *
+ * A KM_CACHE_SINGLE_THREAD cache belongs to the first thread that
+ * allocates from it, and only that thread may use it, stats and
+ * shrinking included (debug builds check). In exchange its
+ * allocations and frees take no lock and its bufctl lookups no
+ * atomics. kmem_shrink_all, and so memory pressure, leave it be.
+ */
+struct kmem_page_provider;
+struct kmem_cache_attr {
+        size_t size;                    /* Object size, required */
+        size_t align;                   /* 0, or a power of 2 */
+        size_t nobjs;                   /* Expected objects (see above) */
+        void (*ctor)(void *buf, size_t size);
+        void (*dtor)(void *buf, size_t size);
+        unsigned slab_pages;            /* Most pages a large object slab
+                                         * grows to, a power of 2. The
+                                         * default is 1 << KM_SLAB_MAX_ORDER
+                                         */
+        unsigned lifetime;              /* KM_LIFETIME_*, the set allocations
+                                         * without a hint come from
+                                         */
+        unsigned keep_slabs;            /* Slabs each set holds on to when
+                                         * frees empty them, 1 by default.
+                                         * kmem_cache_shrink and memory
+                                         * pressure still take them all
+                                         */
+        unsigned flags;                 /* How it's locked: 0 for the cache
+                                         * lock, or KM_CACHE_SIGSAFE,
+                                         * KM_CACHE_CPUSLAB or
+                                         * KM_CACHE_SINGLE_THREAD
+                                         */
+        const struct kmem_page_provider *provider; /* Where slabs come from,
+                                                    * NULL for the global
+                                                    * one (see pages.h)
+                                                    */
 };
 
+/**
+ * Create a cache set up by attr (see struct kmem_cache_attr)
+ * The other kmem_cache_create* calls are shorthands for this one
+ * Returns NULL on error, including combinations that can't work:
+ * KM_CACHE_CPUSLAB with a ctor, dtor or lifetime, or
+ * KM_CACHE_SIGSAFE without nobjs
+ */
+struct kmem_cache *
+kmem_cache_create_attr(
+        char *name,
+        const struct kmem_cache_attr *attr
+);
 
 /**
  * Create a new cache for objects of a given size
@@ -91,16 +329,69 @@ kmem_cache_create(
         char *name,
         size_t size,
         size_t align
-        // TODO: not implementing constructors/destructors here
-        //void (*constructor)(void *, size_t),
-        //void (*destructor)(void *, size_t)
+);
+
+/**
+ * A snapshot of a cache's numbers
+ */
+struct kmem_cache_stats {
+        char *name;
+        size_t object_size;
+        size_t objects;             /* Objects currently allocated */
+        size_t allocs;              /* Allocations since creation */
+        size_t frees;               /* Frees since creation */
+        unsigned slab_count;
+        unsigned peak_slabs;
+        unsigned set_slabs[KM_NR_LIFETIMES]; /* Slabs held per lifetime hint */
+        size_t pages;               /* Held by all slabs */
+        unsigned slab_order;        /* Order the next new slab will have */
+        unsigned min_order;
+        unsigned max_order;
+};
+
+/**
+ * Create a cache that's safe to use from a signal handler
+ * nobjs objects are set aside up front, and alloc and free
+ * only ever pop and push them with atomics: no locks, no
+ * libc. Once they're all out, alloc returns NULL whatever
+ * the flags. Accounting, hooks, tracing and published stats
+ * all skip these caches, since none of them are signal-safe
+ * Returns NULL on error
+ */
+struct kmem_cache *
+kmem_cache_create_sigsafe(
+        char *name,
+        size_t size,
+        size_t align,
+        size_t nobjs
+);
+
+/**
+ * Create a cache where each CPU has an active slab of its own
+ * Allocations pop that slab's free list with a compare and swap
+ * and only take the cache lock to swap in a new slab once it's
+ * used up. Frees onto the CPU's active slab are lock-free too,
+ * the rest go back through the lock
+ * Only small object caches (under 1/8 of a page) get CPU slabs,
+ * and only for allocations without a lifetime hint, anything
+ * else works like kmem_cache_create. While objects sit on a CPU
+ * slab they count as allocated in allocs and frees (not in
+ * kmem_cache_get_stats' objects, which drains the CPU slabs first)
+ * Returns NULL on error
+ */
+struct kmem_cache *
+kmem_cache_create_cpuslab(
+        char *name,
+        size_t size,
+        size_t align
 );
 
 /**
  * Allocate an item from the given cache
  * flags is one of KM_SLEEP or KM_NOSLEEP,
  * depending if we should block until memory
- * is available to allocate
+ * is available to allocate, optionally or'd
+ * with a lifetime hint and KM_NOGROW
  */
 void *
 kmem_cache_alloc(
@@ -108,8 +399,53 @@ kmem_cache_alloc(
         int flags
 );
 
+/**
+ * Allocate an item on the same slab as hint, so objects used
+ * together (a tree node and its children, say) share cache
+ * lines and pages. hint must be an object from cp that's still
+ * allocated. If its slab is full, or the lifetime hint in flags
+ * picks a different set, this is just kmem_cache_alloc
+ */
+void *
+kmem_cache_alloc_near(
+        struct kmem_cache *cp,
+        void *hint,
+        int flags
+);
+
+/**
+ * Allocate n objects laid out back to back in one slab, so a
+ * batch processed in order streams through memory. Returns the
+ * first; object i is at (char *)first + i * cp->object_size.
+ * The run carries on from the head of the freelist if that slab
+ * has n back to back free objects there, else it starts an empty
+ * slab (one the cache has, or a new one), so n can be at most one
+ * slab's worth of objects; NULL if it's more than that, or the
+ * cache couldn't grow
+ */
+void *
+kmem_cache_alloc_contig(
+        struct kmem_cache *cp,
+        size_t n,
+        int flags
+);
+
+/**
+ * Whether buf is one of cp's objects
+ * Small object caches find the slab from buf's page, so buf has
+ * to be from a cache with the same layout (cp->ops) as cp, or
+ * what that finds isn't a slab header at all
+ */
+int
+kmem_cache_owns(
+        struct kmem_cache *cp,
+        void *buf
+);
+
 /**
  * Return an element to the cache
+ * Safe to call concurrently with other allocations
+ * and frees on the same cache
  */
 void
 kmem_cache_free(
@@ -117,6 +453,101 @@ kmem_cache_free(
         void *buf
 );
 
+/**
+ * Return n elements to the cache at once
+ * For large objects the bufctl lookups are batched and
+ * prefetched, and the cache lock is taken once per batch
+ */
+void
+kmem_cache_free_bulk(
+        struct kmem_cache *cp,
+        size_t n,
+        void **bufs
+);
+
+/**
+ * Return a run from kmem_cache_alloc_contig, or any n objects
+ * from it starting at buf
+ */
+void
+kmem_cache_free_contig(
+        struct kmem_cache *cp,
+        void *buf,
+        size_t n
+);
+
+/**
+ * Install hooks for every cache (NULL to remove them)
+ * The struct is used in place, so it must stay around
+ * until it's replaced. With no hooks installed anywhere,
+ * the fast paths only pay for one never-taken branch
+ */
+void
+kmem_set_hooks(
+        const struct kmem_hooks *hooks
+);
+
+/**
+ * Install hooks for one cache (NULL to remove them)
+ * These run before the global ones
+ */
+void
+kmem_cache_set_hooks(
+        struct kmem_cache *cp,
+        const struct kmem_hooks *hooks
+);
+
+/**
+ * Fill in stats for the given cache
+ */
+void
+kmem_cache_get_stats(
+        struct kmem_cache *cp,
+        struct kmem_cache_stats *stats
+);
+
+/**
+ * Publish every cache's counters into the named POSIX
+ * shared memory segment (e.g. "/kmem.1234"), for kmemtop
+ * Caches created later are added automatically
+ * Returns 0 on success, -1 on error (including when
+ * already publishing)
+ */
+int
+kmem_stats_publish(
+        const char *shm_name
+);
+
+/**
+ * Stop publishing and remove the segment
+ */
+void
+kmem_stats_unpublish(void);
+
+/**
+ * Give the cache's memory back now, rather than waiting
+ * for the reap on free. Every empty slab is released,
+ * including the last one (it's regrown on demand), and
+ * CPU slabs hand back what they hold first
+ * Returns the number of bytes released
+ */
+size_t
+kmem_cache_shrink(
+        struct kmem_cache *cp
+);
+
+/**
+ * Shrink caches, the ones holding the most reclaimable
+ * memory first, until at least target_bytes have been
+ * released or nothing is left to reclaim
+ * Meant for memory pressure handlers
+ * Returns the number of bytes released
+ */
+size_t
+kmem_shrink_all(
+        size_t target_bytes
+);
+
 /**
  * Destroy the given cache
  */
@@ -125,4 +556,8 @@ kmem_cache_destroy(
         struct kmem_cache *cp
 );
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
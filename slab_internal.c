@@ -4,9 +4,12 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdatomic.h>
 
 #include "slab.h"
 #include "hash.h"
+#include "kmem_shm.h"
+#include "trace.h"
 
 /**
  * These are caches we allocate to store 'kmem_bufctl' and 'kmem_slab'
@@ -22,59 +25,152 @@ static struct kmem_cache *slab_cache = NULL;
 static struct kmem_cache *hash_cache = NULL;
 static struct kmem_cache *hash_node_cache = NULL;
 
-/* Size of a page on the system */
+/**
+ * Every cache other than money_cache, so memory pressure
+ * handling can find them. Lock order is cache_chain_lock,
+ * then any cache's lock
+ */
+static struct kmem_cache *cache_chain = NULL;
+static pthread_mutex_t cache_chain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Alloc/free hooks
+ * hooks_installed counts the global hooks plus every cache
+ * with hooks, so the fast paths can skip all of this with a
+ * single load and a branch the predictor never sees taken.
+ * Building with KM_NO_HOOKS drops even that
+ */
+static const struct kmem_hooks *_Atomic global_hooks = NULL;
+static atomic_int hooks_installed = 0;
+
+#ifdef KM_NO_HOOKS
+#define __hooks_installed() 0
+#else
+#define __hooks_installed() \
+        __builtin_expect(atomic_load_explicit(&hooks_installed, memory_order_relaxed), 0)
+#endif
+
+/**
+ * The shared memory segment counters get published to,
+ * NULL unless kmem_stats_publish was called
+ * Protected by cache_chain_lock
+ */
+static struct kmem_shm_header *shm_stats = NULL;
+static char shm_stats_name[KM_SHM_NAME_LEN * 8];
+static uint64_t shm_next_id = 1;
+
+/* Size of a page on the system, and its log2 */
 static size_t system_pagesize = 0;
+static unsigned system_pageshift = 0;
 
 /**
- * Add a new slab into the slab linkedlist and to the freelist
- * Since the new slab is complete (refcount == 0), we want to add it
- * to the end of the list
+ * Each slab set's list is circular and kept sorted as full slabs,
+ * then partial ones, then empty ones at the tail, so
+ * set->freelist (the first slab with space) splits it in two
+ * and the reaper only has to look at the tail
+ * The set a slab belongs to is slab->set
+ */
+
+/**
+ * Unlink a slab from the list, fixing up the head pointer
  */
 static inline void
-__cache_add_slab(struct kmem_cache *cp, struct kmem_slab *slab)
+__slab_unlink(struct kmem_slab_set *set, struct kmem_slab *slab)
 {
-        struct kmem_slab *head;
-        struct kmem_slab *tail;
+        if (slab->next == slab) {
+                set->slabs = NULL;
+                return;
+        }
 
-        if (!cp->slabs) {
-                // There are no slabs in the cache currently,
-                // add the new one at the beginning and update freelist
-                DEBUG_PRINT("Adding new (first) slab to top of list\n");
-                cp->slabs = slab;
-                cp->freelist = slab;
+        slab->last->next = slab->next;
+        slab->next->last = slab->last;
+        if (set->slabs == slab) {
+                set->slabs = slab->next;
+        }
+}
 
-                // Since the list is circular & doubly linked...
+/**
+ * Link a slab into the list, in front of pos
+ * If pos was the head of the list, the slab becomes the new head
+ */
+static inline void
+__slab_link_before(struct kmem_slab_set *set, struct kmem_slab *slab, struct kmem_slab *pos)
+{
+        slab->next = pos;
+        slab->last = pos->last;
+        pos->last->next = slab;
+        pos->last = slab;
+        if (set->slabs == pos) {
+                set->slabs = slab;
+        }
+}
+
+/**
+ * Link a slab in at the tail of the list
+ */
+static inline void
+__slab_link_tail(struct kmem_slab_set *set, struct kmem_slab *slab)
+{
+        if (!set->slabs) {
+                set->slabs = slab;
                 slab->next = slab;
                 slab->last = slab;
-        } else {
-                // Add the new slab to the end of the list & pointer shit
-                DEBUG_PRINT("Adding new slab %p to tail\n", (void*)slab);
-                head = cp->slabs;
-                tail = head->last;
-                tail->next = slab;
-                slab->last = tail;
-                slab->next = head;
-                head->last = slab;
+                return;
         }
 
-        DEBUG_PRINT("Cache %s got new slab %p, next: %p, last: %p\n", cp->name, (void*)slab, (void*)slab->next, (void*)slab->last);
+        __slab_link_before(set, slab, set->slabs);
+        set->slabs = slab->next;
+}
 
-        // Update the freelist pointer
-        head = cp->freelist;
-        while (head->size == head->refcount) {
-                head = head->last;
-        }
-        if (head != cp->freelist) {
-                DEBUG_PRINT("Setting %s freelist to %p\n", cp->name, (void*)head);
-                cp->freelist = head;
+/**
+ * Add a new slab into the slab linkedlist and to the freelist
+ * Since the new slab is complete (refcount == 0), we want to add it
+ * to the end of the list
+ */
+static inline void
+__cache_add_slab(struct kmem_cache *cp, struct kmem_slab *slab)
+{
+        struct kmem_slab_set *set = slab->set;
+
+        __slab_link_tail(set, slab);
+        if (!set->freelist) {
+                DEBUG_PRINT("Setting %s freelist to %p\n", cp->name, (void*)slab);
+                set->freelist = slab;
         }
-        DEBUG_PRINT("Slab freelist is now %p\n", (void*)cp->freelist);
-        DEBUG_PRINT("Freelist size %lu, total %lu\n", cp->freelist->refcount, cp->freelist->size);
 
+        DEBUG_PRINT("Cache %s got new slab %p, next: %p, last: %p\n", cp->name, (void*)slab, (void*)slab->next, (void*)slab->last);
+
+        set->slab_count++;
         cp->slab_count++;
+        cp->pages += 1ul << slab->order;
+        if (cp->slab_count > cp->peak_slabs) {
+                cp->peak_slabs = cp->slab_count;
+        }
         DEBUG_PRINT("Cache %s now has %u slabs\n", cp->name, cp->slab_count);
 }
 
+/**
+ * Called on a slab that was full and just had a buf freed
+ * It goes right in front of the freelist (after all the full
+ * slabs) and becomes the new freelist head
+ */
+static inline void
+__cache_partial_slab(struct kmem_cache *cp, struct kmem_slab *slab)
+{
+        struct kmem_slab_set *set = slab->set;
+
+        DEBUG_PRINT("Slab %p of cache %s has space again\n", (void*)slab, cp->name);
+        if (set->freelist == slab) return;
+
+        __slab_unlink(set, slab);
+        if (set->freelist) {
+                __slab_link_before(set, slab, set->freelist);
+        } else {
+                __slab_link_tail(set, slab);
+        }
+        set->freelist = slab;
+}
+
 /**
  * Moves a slab to the tail of the list
  * These slabs should be empty (e.g. refcount 0)
@@ -82,33 +178,22 @@ __cache_add_slab(struct kmem_cache *cp, struct kmem_slab *slab)
 static inline void
 __cache_empty_slab(struct kmem_cache *cp, struct kmem_slab *slab)
 {
-        DEBUG_PRINT("Moving slab %p to HEAD of freelist of cache %s\n", (void*)(slab->last), cp->name);
-        if (cp->freelist == slab) {
-                // If this slab was first on the freelist...
-                // However, don't update the freelist pointer if it would
-                // go to a slab without space
-                cp->freelist = slab->next->refcount < slab->next->size
-                        ? slab->next
-                        : NULL;
-                DEBUG_PRINT("Updating freelist pointer to %p\n", (void*)cp->freelist);
-        }
-        if (cp->slabs == slab) {
-                // If there's only one slab, it's already at the end
+        struct kmem_slab_set *set = slab->set;
+
+        DEBUG_PRINT("Moving slab %p to tail of cache %s\n", (void*)slab, cp->name);
+        if (set->slabs->last == slab) {
+                // Already there
                 return;
         }
 
-        slab->last->next = slab->next;
-        slab->next->last = slab->last;
-
-        slab->last = cp->slabs->last;
-        cp->slabs->last->next = slab;
-
-        slab->next = cp->slabs;
-        slab->last = cp->slabs->last;
-
-        cp->slabs = slab;
+        if (set->freelist == slab) {
+                // Everything after this slab has space
+                set->freelist = slab->next;
+                DEBUG_PRINT("Updating freelist pointer to %p\n", (void*)set->freelist);
+        }
 
-        DEBUG_PRINT("Slab %p is now the HEAD of cache %s\n", (void*)(cp->slabs->last), cp->name);
+        __slab_unlink(set, slab);
+        __slab_link_tail(set, slab);
 }
 
 /**
@@ -117,25 +202,24 @@ __cache_empty_slab(struct kmem_cache *cp, struct kmem_slab *slab)
 static inline void
 __cache_remove_slab(struct kmem_cache *cp, struct kmem_slab *slab)
 {
+        struct kmem_slab_set *set = slab->set;
+
         DEBUG_PRINT("Removing slab %p from cache %s freelist\n", (void*)slab, cp->name);
+        set->slab_count--;
         cp->slab_count--;
-        if (cp->slabs == slab->next && cp->slabs == slab->last) {
-                cp->slabs = NULL;
-                cp->freelist = NULL;
-        }
-
-        slab->last->next = slab->next;
-        slab->next->last = slab->last;
-
-        if (cp->slabs == slab) {
-                cp->slabs = slab->next;
-        }
+        cp->pages -= 1ul << slab->order;
 
-        if (cp->freelist == slab) {
-                cp->freelist = slab->next->refcount < slab->next->size
+        if (set->freelist == slab) {
+                // Wrapping around to the head means nothing else has space
+                set->freelist = slab->next != set->slabs
                         ? slab->next
                         : NULL;
         }
+
+        __slab_unlink(set, slab);
+        if (!set->slabs) {
+                set->freelist = NULL;
+        }
 }
 
 /**
@@ -181,11 +265,29 @@ __slab_init_small(struct kmem_cache *cp, void *page, size_t offset)
                 *((void**)i) = (void*)((uintptr_t)i + cp->object_size);
         }
 
+        // End the list at the last buf we hand out, so it's
+        // NULL terminated from here on (CPU slabs take it whole)
+        *(void**)((uintptr_t)slab->firstbuf.buf + (slab->size - 1) * cp->object_size) = NULL;
+
         return slab;
 }
 
-static inline struct kmem_slab *
-__slab_init_large(struct kmem_cache *cp, void *page, int flags)
+/**
+ * Small slabs are a page, so order is always 0
+ */
+static struct kmem_slab *
+__small_slab_init(struct kmem_cache *cp, void *page, unsigned UNUSED(order), int UNUSED(flags))
+{
+        return __slab_init_small(cp, page, 0 /* No offset */);
+}
+
+/**
+ * Initialize a newly allocated slab for objects 1/8th of a page
+ * and up. The slab header and a bufctl per buf come from their
+ * own caches, and the hash maps each buf back to its bufctl
+ */
+static struct kmem_slab *
+__large_slab_init(struct kmem_cache *cp, void *page, unsigned order, int flags)
 {
         struct kmem_slab *slab;
         struct kmem_bufctl *bufctl;
@@ -198,9 +300,10 @@ __slab_init_large(struct kmem_cache *cp, void *page, int flags)
         slab = kmem_cache_alloc(slab_cache, flags);
         memset(slab, 0, sizeof(struct kmem_slab));
 
-        slab->size = system_pagesize / cp->object_size;
-        DEBUG_PRINT("One page (%lu bytes) can hold %lu x %lu byte bufs\n",
-               system_pagesize, slab->size, cp->object_size);
+        slab->order = order;
+        slab->size = (system_pagesize << order) / cp->object_size;
+        DEBUG_PRINT("%lu pages can hold %lu x %lu byte bufs\n",
+               1ul << order, slab->size, cp->object_size);
 
         // Allocate bufctls that point to our new data
         // Do the first and last separately to minimize in-loop branching
@@ -234,25 +337,309 @@ __slab_init_large(struct kmem_cache *cp, void *page, int flags)
 }
 
 /**
- * Add a new slab to the given cache
+ * Slow paths for the hooks, kept out of line so the
+ * fast paths stay small
+ */
+static __attribute__((noinline, cold)) void
+__run_alloc_hooks(struct kmem_cache *cp, void *buf)
+{
+        const struct kmem_hooks *hooks;
+
+        hooks = atomic_load_explicit(&cp->hooks, memory_order_acquire);
+        if (hooks && hooks->alloc) hooks->alloc(cp, buf, hooks->arg);
+
+        hooks = atomic_load_explicit(&global_hooks, memory_order_acquire);
+        if (hooks && hooks->alloc) hooks->alloc(cp, buf, hooks->arg);
+}
+
+static __attribute__((noinline, cold)) void
+__run_free_hooks(struct kmem_cache *cp, void *buf)
+{
+        const struct kmem_hooks *hooks;
+
+        hooks = atomic_load_explicit(&cp->hooks, memory_order_acquire);
+        if (hooks && hooks->free) hooks->free(cp, buf, hooks->arg);
+
+        hooks = atomic_load_explicit(&global_hooks, memory_order_acquire);
+        if (hooks && hooks->free) hooks->free(cp, buf, hooks->arg);
+}
+
+/**
+ * The async-signal-safe reserve (KM_CACHE_SIGSAFE)
+ * One block of nobjs objects, set aside at create time, with the
+ * free ones on a lock-free stack of indices. The head packs a tag
+ * in with the index, so a pop that races with another pop and push
+ * of the same index (ABA) fails its CAS instead of corrupting the
+ * stack
+ */
+#define KM_SIGPOOL_NONE UINT32_MAX
+
+struct kmem_sigpool {
+        void *base;                     /* nobjs objects, back to back */
+        size_t nobjs;
+        _Atomic uint64_t head;          /* tag << 32 | first free index */
+        _Atomic uint32_t next[];        /* Next free after each index */
+};
+
+static inline void *
+__sigpool_alloc(struct kmem_cache *cp)
+{
+        struct kmem_sigpool *sp = cp->sigpool;
+        uint64_t head;
+        uint64_t new;
+        uint32_t i;
+
+        head = atomic_load_explicit(&sp->head, memory_order_acquire);
+        do {
+                i = (uint32_t)head;
+                if (i == KM_SIGPOOL_NONE) return NULL;
+                new = (((head >> 32) + 1) << 32)
+                        | atomic_load_explicit(&sp->next[i], memory_order_relaxed);
+        } while (!atomic_compare_exchange_weak_explicit(&sp->head, &head, new,
+                                                        memory_order_acquire,
+                                                        memory_order_acquire));
+
+        __atomic_fetch_add(&cp->allocs, 1, __ATOMIC_RELAXED);
+        return (void*)((uintptr_t)sp->base + i * cp->object_size);
+}
+
+static inline void
+__sigpool_free(struct kmem_cache *cp, void *buf)
+{
+        struct kmem_sigpool *sp = cp->sigpool;
+        uint64_t head;
+        uint32_t i;
+
+        i = ((uintptr_t)buf - (uintptr_t)sp->base) / cp->object_size;
+        assert(i < sp->nobjs);
+
+        head = atomic_load_explicit(&sp->head, memory_order_relaxed);
+        do {
+                atomic_store_explicit(&sp->next[i], (uint32_t)head, memory_order_relaxed);
+        } while (!atomic_compare_exchange_weak_explicit(&sp->head, &head,
+                                                        (((head >> 32) + 1) << 32) | i,
+                                                        memory_order_release,
+                                                        memory_order_relaxed));
+
+        __atomic_fetch_add(&cp->frees, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * CPU slabs (KM_CACHE_CPUSLAB)
+ * Each CPU's active slab is a lock-free stack of that slab's free
+ * bufs, linked through the bufs like any small slab's. The whole
+ * state is one word: the page number (KM_CPU_PAGE_BITS of it), the
+ * index of the first free buf (KM_CPU_NONE once it's used up) and
+ * a tag, bumped on every change, so a pop racing a pop and push of
+ * the same buf (ABA) fails its CAS. A CPU slab's slab counts every
+ * buf on it as allocated, so only the CPU slab ever hands them out.
+ * Caches whose pages hold KM_CPU_NONE or more bufs, or whose pages
+ * sit above KM_CPU_PAGE_BITS, don't get CPU slabs.
+ *
+ * A pop reads the first buf's link before its CAS, so the page
+ * must not be freed under it: pops count themselves in readers,
+ * and reaped slabs wait on cp->retired until every count is 0
+ * (like the hash's retired nodes, but with one count)
+ */
+#define KM_CPU_PAGE_BITS 36
+#define KM_CPU_NONE 0x3ffull
+#define KM_CPU_TAG_SHIFT (KM_CPU_PAGE_BITS + 10)
+#define KM_CPU_WORD(page, idx, tag) \
+        ((uint64_t)(tag) << KM_CPU_TAG_SHIFT | ((uint64_t)(idx) & KM_CPU_NONE) << KM_CPU_PAGE_BITS \
+         | (uintptr_t)(page) >> system_pageshift)
+#define KM_CPU_PAGE(w) (((w) & ((1ull << KM_CPU_PAGE_BITS) - 1)) << system_pageshift)
+#define KM_CPU_IDX(w) (((w) >> KM_CPU_PAGE_BITS) & KM_CPU_NONE)
+#define KM_CPU_TAG(w) ((w) >> KM_CPU_TAG_SHIFT)
+#define KM_CPU_FITS(page) ((uintptr_t)(page) >> system_pageshift >> KM_CPU_PAGE_BITS == 0)
+
+struct kmem_cpu_slab {
+        _Atomic uint64_t freelist;      /* tag | first free index | page */
+        atomic_uint readers;            /* Pops in flight */
+} __attribute__((aligned(64)));
+
+static inline struct kmem_cpu_slab *
+__cpu_slab(struct kmem_cache *cp)
+{
+        int cpu = sched_getcpu();
+
+        return &cp->cpu_slabs[cpu > 0 ? (unsigned)cpu % cp->ncpu_slabs : 0];
+}
+
+/**
+ * Can a page that's no CPU slab's anymore be freed yet?
+ * The fence pairs with the seq_cst add and load in __cpu_slab_pop:
+ * either that pop registered before we looked, or it loads a word
+ * that no longer has the page in it
+ */
+static inline int
+__cpu_slabs_quiet(struct kmem_cache *cp)
+{
+        unsigned i;
+
+        atomic_thread_fence(memory_order_seq_cst);
+        for (i = 0; i < cp->ncpu_slabs; i++) {
+                if (atomic_load_explicit(&cp->cpu_slabs[i].readers, memory_order_acquire)) {
+                        return 0;
+                }
+        }
+        return 1;
+}
+
+/**
+ * Seqlock-protected update of a cache's published counters
+ * ASSUMED: the caller holds cp->lock, so there's only one writer
+ */
+static inline void
+__shm_publish(struct kmem_cache *cp)
+{
+        struct kmem_shm_cache *slot = cp->shm_slot;
+        unsigned seq;
+
+        seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+        atomic_store_explicit(&slot->seq, seq + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+
+        atomic_store_explicit(&slot->objects, cp->allocs - cp->frees, memory_order_relaxed);
+        atomic_store_explicit(&slot->slabs, cp->slab_count, memory_order_relaxed);
+        atomic_store_explicit(&slot->allocs, cp->allocs, memory_order_relaxed);
+        atomic_store_explicit(&slot->frees, cp->frees, memory_order_relaxed);
+
+        atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+}
+
+/**
+ * Publish, if anyone's listening
+ * ASSUMED: the caller holds cp->lock
+ */
+static inline void
+__cache_publish(struct kmem_cache *cp)
+{
+        if (__builtin_expect(cp->shm_slot != NULL, 0)) {
+                __shm_publish(cp);
+        }
+}
+
+/**
+ * Give a cache a slot in the shared segment, if there's one free
+ * Sigsafe caches never publish (nothing in them is allowed a lock)
+ * ASSUMED: the caller holds cache_chain_lock and cp->lock
+ */
+static void
+__shm_attach(struct kmem_cache *cp)
+{
+        struct kmem_shm_cache *slot;
+        unsigned seq;
+        int i;
+
+        if (cp->flags & KM_CACHE_SIGSAFE) return;
+
+        for (i = 0; i < KM_SHM_MAX_CACHES; i++) {
+                slot = &shm_stats->caches[i];
+                if (!atomic_load_explicit(&slot->active, memory_order_relaxed)) break;
+        }
+        if (i == KM_SHM_MAX_CACHES) {
+                DEBUG_PRINT("No room to publish cache %s\n", cp->name);
+                return;
+        }
+
+        seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+        atomic_store_explicit(&slot->seq, seq + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+
+        atomic_store_explicit(&slot->id, shm_next_id++, memory_order_relaxed);
+        strncpy(slot->name, cp->name, KM_SHM_NAME_LEN - 1);
+        slot->name[KM_SHM_NAME_LEN - 1] = '\0';
+        atomic_store_explicit(&slot->object_size, cp->object_size, memory_order_relaxed);
+        atomic_store_explicit(&slot->active, 1, memory_order_relaxed);
+
+        atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+
+        // Single thread caches check it without cp->lock
+        __atomic_store_n(&cp->shm_slot, slot, __ATOMIC_RELEASE);
+        __shm_publish(cp);
+}
+
+/**
+ * Give a cache's slot back
+ * ASSUMED: the caller holds cp->lock
+ */
+static void
+__shm_detach(struct kmem_cache *cp)
+{
+        if (!cp->shm_slot) return;
+
+        atomic_store_explicit(&cp->shm_slot->active, 0, memory_order_release);
+        __atomic_store_n(&cp->shm_slot, NULL, __ATOMIC_RELEASE);
+}
+
+/**
+ * Empty out a cache's slab sets
+ */
+static inline void
+__cache_init_sets(struct kmem_cache *cp)
+{
+        memset(cp->sets, 0, sizeof(cp->sets));
+        cp->slab_count = 0;
+        cp->peak_slabs = 0;
+}
+
+/**
+ * Pick the slab set an allocation's lifetime hint asks for
+ */
+static inline struct kmem_slab_set *
+__cache_set(struct kmem_cache *cp, int flags)
+{
+        if (flags & KM_SHORTLIVED) return &cp->sets[KM_LIFETIME_SHORT];
+        if (flags & KM_LONGLIVED) return &cp->sets[KM_LIFETIME_LONG];
+        return &cp->sets[cp->lifetime];
+}
+
+/**
+ * The order the cache's next slab gets
+ * One step up from min_order at KM_SLAB_ORDER_STEP slabs, and
+ * another each time the count doubles after that
+ */
+static inline unsigned
+__cache_order(struct kmem_cache *cp)
+{
+        unsigned order;
+        unsigned steps;
+
+        order = cp->min_order;
+        for (steps = cp->slab_count / KM_SLAB_ORDER_STEP; steps && order < cp->max_order; steps /= 2) {
+                order++;
+        }
+        return order;
+}
+
+/**
+ * Add a new slab to the given set of the cache
  * Returns a pointer to the new slab, or 0 on error
  */
 static struct kmem_slab *
-__cache_grow(struct kmem_cache *cp, int flags)
+__cache_grow(struct kmem_cache *cp, struct kmem_slab_set *set, int flags)
 {
         void *page;
         struct kmem_slab *slab;
+        unsigned order;
 
-        DEBUG_PRINT("Allocating new slab for cache %s...\n", cp->name);
+        order = __cache_order(cp);
+        DEBUG_PRINT("Allocating new order %u slab for cache %s...\n", order, cp->name);
 
-        // Allocate page-aligned memory
-        if (0 != posix_memalign(&page, system_pagesize, system_pagesize))
-                return NULL;
+        // Page-aligned memory, from the cache's provider
+        page = cp->provider->alloc_pages(system_pagesize << order, cp->provider->arg);
+        if (!page) return NULL;
+        assert((uintptr_t)page % system_pagesize == 0);
 
-        slab = cp->type == KM_SMALL_CACHE
-                ? __slab_init_small(cp, page, 0 /* No offset */)
-                : __slab_init_large(cp, page, flags);
+        slab = cp->ops->init(cp, page, order, flags);
         slab->start = page;
+        slab->set = set;
+        if (cp->ctor) {
+                for (size_t i = 0; i < slab->size; i++) {
+                        cp->ctor((void*)((uintptr_t)page + i * cp->object_size), cp->object_size);
+                }
+        }
+        KM_TRACE(KM_TRACE_GROW, cp, page, slab);
 
         // Add the slab into the cache's freelist
         __cache_add_slab(cp, slab);
@@ -261,24 +648,79 @@ __cache_grow(struct kmem_cache *cp, int flags)
 }
 
 /**
- * Return all bufctls from a slab to their cache
- * ASSUMES: cache type is KM_REGULAR_CACHE
+ * Return all bufctls from a slab to their cache, drop their
+ * entries from the cache's hash, and free the slab itself
+ * (small slabs live on their own page, so only these came
+ * out of slab_cache)
  */
-static inline void
-__slab_reap_large(struct kmem_slab *slab)
+static void
+__large_slab_reap(struct kmem_cache *cp, struct kmem_slab *slab)
 {
         struct kmem_bufctl *bufctl;
+        struct kmem_bufctl *next;
         unsigned count;
 
         bufctl = slab->firstbuf.bufctl;
         for (count = 0; bufctl && count < slab->size; count++) {
+                next = bufctl->next;
+                kmem_hash_remove(cp->hash, bufctl->buf);
                 kmem_cache_free(bufctl_cache, bufctl);
-                bufctl = bufctl->next;
+                bufctl = next;
+        }
+        kmem_cache_free(slab_cache, slab);
+}
+
+/**
+ * Hand a slab's memory back to the cache's provider, or if it
+ * doesn't take memory back, at least let it decommit the pages
+ */
+static inline void
+__slab_pages_free(struct kmem_cache *cp, void *pages, size_t size)
+{
+        if (cp->provider->free_pages) {
+                cp->provider->free_pages(pages, size, cp->provider->arg);
+        } else if (cp->provider->decommit) {
+                cp->provider->decommit(pages, size, cp->provider->arg);
         }
 }
 
 /**
- * Reclaims all empty slabs in the cache
+ * Give a slab's memory back to the system
+ * ASSUMES: the slab is already off the cache's list
+ */
+static inline void
+__slab_destroy(struct kmem_cache *cp, struct kmem_slab *slab)
+{
+        size_t size;
+        void *buf;
+
+        buf = (void*)((unsigned long)slab->start>> 12 << 12);
+        size = system_pagesize << slab->order;
+        KM_TRACE(KM_TRACE_REAP, cp, buf, slab);
+        if (cp->cpu_slabs && !__cpu_slabs_quiet(cp)) {
+                DEBUG_PRINT("CPU slab pops in flight, retiring %p\n", buf);
+                slab->next = cp->retired;
+                cp->retired = slab;
+                return;
+        }
+
+        for (size_t i = 0; cp->dtor && i < slab->size; i++) {
+                cp->dtor((void*)((uintptr_t)slab->start + i * cp->object_size), cp->object_size);
+        }
+        if (cp->ops->reap) {
+                cp->ops->reap(cp, slab);
+        }
+
+        DEBUG_PRINT("Freeing %p, from slab\n", buf);
+        __slab_pages_free(cp, buf, size);
+}
+
+/**
+ * Reclaims all empty slabs in the cache, down to keep slabs
+ * With force set, slabs still in use go too (only for destroy)
+ * Empty slabs sit at the tail of the list, so work backwards
+ * from there until we hit one that's still in use
+ * Returns the number of bytes given back
  *   ___o .--.
  *  /___| |OO|
  *      |_|  |_
@@ -286,182 +728,716 @@ __slab_reap_large(struct kmem_slab *slab)
  *      | |   \
  *      | |___/
  */
-static void
-__cache_reap(struct kmem_cache *cp, unsigned force)
+static size_t
+__set_reap(struct kmem_cache *cp, struct kmem_slab_set *set, unsigned force, unsigned keep)
 {
         struct kmem_slab *slab;
-        struct kmem_slab *next;
-        void *buf;
+        size_t freed;
 
-        if (!cp->slabs) return;
-        DEBUG_PRINT("Reaping slabs from cache %s (starts with %u, at %p)\n", cp->name, cp->slab_count, (void*)cp->slabs);
-        slab = cp->slabs;
-        while (force || (slab->refcount == 0 && cp->slab_count > 1)) {
+        if (!set->slabs) return 0;
+        DEBUG_PRINT("Reaping slabs from cache %s (starts with %u, at %p)\n", cp->name, set->slab_count, (void*)set->slabs);
+        freed = 0;
+        while (set->slabs) {
                 // For every slab that must meet their maker...
-                // (but don't free the last slab)
                 // https://xkcd.com/393/
-                __cache_remove_slab(cp, slab);
-                buf = (void*)((unsigned long)slab->start>> 12 << 12);
-                if (cp->type == KM_REGULAR_CACHE) {
-                        __slab_reap_large(slab);
-                }
+                slab = set->slabs->last;
+                if (!force && (slab->refcount || slab->frozen || set->slab_count <= keep)) break;
 
-                next = slab->next;
-                kmem_cache_free(slab_cache, slab);
-                DEBUG_PRINT("Freeing %p, from slab\n", buf);
-                free(buf);
-                if (slab == next) break;
-                slab = next;
+                __cache_remove_slab(cp, slab);
+                freed += system_pagesize << slab->order;
+                __slab_destroy(cp, slab);
         }
         DEBUG_PRINT("Cache %s now has %u slabs\n", cp->name, cp->slab_count);
+        return freed;
+}
+
+/**
+ * Reap every slab set in the cache, keep applies per set
+ */
+static size_t
+__cache_reap(struct kmem_cache *cp, unsigned force, unsigned keep)
+{
+        size_t freed;
+        int i;
+
+        freed = 0;
+        for (i = 0; i < KM_NR_LIFETIMES; i++) {
+                freed += __set_reap(cp, &cp->sets[i], force, keep);
+        }
+        return freed;
+}
+
+/**
+ * How many bytes reaping every empty slab would give back
+ * ASSUMED: the caller holds cp->lock
+ */
+static inline size_t
+__cache_reclaimable(struct kmem_cache *cp)
+{
+        struct kmem_slab_set *set;
+        struct kmem_slab *slab;
+        size_t bytes;
+        int i;
+
+        bytes = 0;
+        for (i = 0; i < KM_NR_LIFETIMES; i++) {
+                set = &cp->sets[i];
+                if (!set->slabs) continue;
+
+                slab = set->slabs->last;
+                do {
+                        if (slab->refcount || slab->frozen) break;
+                        bytes += system_pagesize << slab->order;
+                        slab = slab->last;
+                } while (slab != set->slabs->last);
+        }
+
+        return bytes;
 }
 
 /**
  * Called on a newly-full slab
- * This moves the given slab to the HEAD postion in the freelist
+ * The list is already sorted, so it just drops off the freelist,
+ * which moves on to the next slab (if that one has space)
  */
 static inline void
 __slab_complete(struct kmem_cache *cp, struct kmem_slab *slab)
 {
-        struct kmem_slab *old_last;
-        struct kmem_slab *old_next;
+        struct kmem_slab_set *set = slab->set;
+
+        if (set->freelist == slab) {
+                DEBUG_PRINT("Updating %s freelist pointer\n", cp->name);
+                set->freelist = slab->next != set->slabs
+                        ? slab->next
+                        : NULL;
+        }
+}
 
-        old_last = slab->last;
-        old_next = slab->next;
+/**
+ * Keep the list sorted after a buf came out of a slab that may
+ * not be the freelist head (see kmem_cache_alloc_near)
+ * Newly full slabs join the full ones, newly partial ones
+ * leave the empty ones at the tail
+ */
+static inline void
+__slab_resort(struct kmem_cache *cp, struct kmem_slab *slab)
+{
+        struct kmem_slab_set *set = slab->set;
+
+        if (slab->refcount == slab->size) {
+                if (set->freelist == slab) {
+                        __slab_complete(cp, slab);
+                } else if (set->freelist) {
+                        __slab_unlink(set, slab);
+                        __slab_link_before(set, slab, set->freelist);
+                }
+        } else if (slab->refcount == 1) {
+                __cache_partial_slab(cp, slab);
+        }
+}
 
-        slab->last = cp->slabs->last;
-        slab->next = cp->slabs->next;
-        cp->slabs = slab;
+/**
+ * Small slabs keep their header at the end of the buf's page
+ */
+static inline struct kmem_slab *
+__slab_of_small(void *buf)
+{
+        void *page;
 
-        old_last->next = old_next;
-        old_next->last = old_last;
+        // Find the start of the page
+        page = (void*)((unsigned long)buf >> 12 << 12);
+        DEBUG_PRINT("Found start of page at %p\n", page);
 
-        if (cp->freelist == slab) {
-                DEBUG_PRINT("Updating freelist pointer\n");
-                cp->freelist = old_next;
-        }
+        return (struct kmem_slab *)((uintptr_t)page + system_pagesize - sizeof(struct kmem_slab));
 }
 
 /**
- * Allocate a buf out of the given slab
+ * Take the first buf off a small slab's freelist
  * Remember, these are formatted (link)(buf)
- * So take the first one, and then update the freelist
- * ASSUMED: that the cache type == KM_SMALL_CACHE
- * ASSUMED: that the slab has free bufs available
  */
-static inline void *
-__cache_alloc_small(struct kmem_cache *cp, struct kmem_slab *slab)
+static void *
+__small_slab_alloc(struct kmem_cache *UNUSED(cp), struct kmem_slab *slab)
 {
         void **buf;
 
         buf = slab->firstbuf.buf;
-        if (!buf) {
-                DEBUG_PRINT("Unable to obtain buf, slab is full...\n");
-                DEBUG_PRINT("Slab size %lu, refcount %lu\n", slab->size, slab->refcount);
-                slab = __cache_grow(cp, KM_SLEEP);
-                buf = slab->firstbuf.buf;
-                if (!buf) return NULL;
-        }
-        DEBUG_PRINT("Allocating item from small cache at %p\n", (void*)buf);
         slab->firstbuf.buf = *buf;
-        slab->refcount++;
+        return buf;
+}
 
-        DEBUG_PRINT("Slab refcount is now %lu\n", slab->refcount);
+/**
+ * Take the first bufctl off a large slab's freelist
+ */
+static void *
+__large_slab_alloc(struct kmem_cache *UNUSED(cp), struct kmem_slab *slab)
+{
+        struct kmem_bufctl *bufctl;
 
-        return buf;
+        bufctl = slab->firstbuf.bufctl;
+        slab->firstbuf.bufctl = bufctl->next;
+        return bufctl->buf;
 }
 
+/**
+ * Defined with the other layout below. Most caches are small, so
+ * the hot paths call its functions directly when cp->ops is this,
+ * which the compiler can inline, and only go through cp->ops for
+ * the rest
+ */
+static const struct kmem_slab_ops __small_slab_ops;
+
 /**
  * Allocate a buf out of the given slab
- * We need to take a bufctl from the slab's freelist
- * ASSUMED: that the cache type == KM_REGULAR_CACHE
  * ASSUMED: that the slab has free bufs available
  */
 static inline void *
-__cache_alloc_large(struct kmem_cache *cp, struct kmem_slab *slab)
+__slab_alloc(struct kmem_cache *cp, struct kmem_slab *slab)
 {
-        struct kmem_bufctl *bufctl;
+        void *buf;
 
-        bufctl = slab->firstbuf.bufctl;
-        if (!bufctl) {
-                DEBUG_PRINT("Unable to obtain bufctl, slab is full...\n");
-                slab = __cache_grow(cp, KM_SLEEP);
-                bufctl = slab->firstbuf.bufctl;
-                if (!bufctl) return NULL;
-        }
+        buf = cp->ops == &__small_slab_ops
+                ? __small_slab_alloc(cp, slab)
+                : cp->ops->alloc(cp, slab);
         slab->refcount++;
-        slab->firstbuf.bufctl = bufctl->next;
+        DEBUG_PRINT("Allocated item %p from cache %s\n", buf, cp->name);
+        KM_TRACE(KM_TRACE_ALLOC, cp, buf, slab);
 
         DEBUG_PRINT("Slab refcount is now %lu\n", slab->refcount);
 
-        return bufctl->buf;
+        return buf;
 }
 
 /**
- * Free an item from the cache
- * ASSUMED: the cache type == KM_SMALL_CACHE
+ * Lock a cache for allocation and free
+ * Single thread caches skip the lock, as only their owner ever
+ * gets here. Debug builds check that it's the same thread each
+ * time, the first one through becoming the owner
  */
 static inline void
-__cache_free_small(struct kmem_cache *cp, void *buf)
+__cache_lock(struct kmem_cache *cp)
 {
-        void *page;
-        struct kmem_slab *slab;
+        if (cp->flags & KM_CACHE_SINGLE_THREAD) {
+#if DEBUG
+                if (!cp->owned) {
+                        cp->owner = pthread_self();
+                        cp->owned = 1;
+                }
+                assert(pthread_equal(cp->owner, pthread_self()));
+#endif
+                return;
+        }
+        pthread_mutex_lock(&cp->lock);
+}
 
-        // Find the start of the page
-        DEBUG_PRINT("Freeing item %p from small cache %s\n", buf, cp->name);
-        page = (void*)((unsigned long)buf >> 12 << 12);
-        DEBUG_PRINT("Found start of page at %p\n", page);
+static inline void
+__cache_unlock(struct kmem_cache *cp)
+{
+        if (!(cp->flags & KM_CACHE_SINGLE_THREAD)) {
+                pthread_mutex_unlock(&cp->lock);
+        }
+}
 
-        slab = (struct kmem_slab *)((uintptr_t)page + system_pagesize - sizeof(struct kmem_slab));
+/**
+ * Publish, then unlock what __cache_lock locked
+ * A single thread cache's owner doesn't hold cp->lock, but
+ * kmem_stats_publish writes the same slot under it, so the
+ * owner takes it just to publish, and only once there's a slot
+ */
+static inline void
+__cache_publish_unlock(struct kmem_cache *cp)
+{
+        if (!(cp->flags & KM_CACHE_SINGLE_THREAD)) {
+                __cache_publish(cp);
+                pthread_mutex_unlock(&cp->lock);
+                return;
+        }
+        if (__builtin_expect(__atomic_load_n(&cp->shm_slot, __ATOMIC_ACQUIRE) != NULL, 0)) {
+                pthread_mutex_lock(&cp->lock);
+                __cache_publish(cp);
+                pthread_mutex_unlock(&cp->lock);
+        }
+}
+
+/**
+ * Small slabs are found from the page, so this can't tell
+ * a stray pointer from one of ours
+ */
+static struct kmem_slab *
+__small_slab_owner(struct kmem_cache *UNUSED(cp), void *buf, void **handle)
+{
+        *handle = buf;
+        return __slab_of_small(buf);
+}
+
+/**
+ * Large slabs are found through the buf's bufctl, which is
+ * looked up without the cache lock (see hash.h)
+ */
+static struct kmem_slab *
+__large_slab_owner(struct kmem_cache *cp, void *buf, void **handle)
+{
+        struct kmem_bufctl *bufctl;
+
+        bufctl = cp->flags & KM_CACHE_SINGLE_THREAD
+                ? kmem_hash_get_local(cp->hash, buf)
+                : kmem_hash_get(cp->hash, buf);
+        *handle = bufctl;
+        return bufctl ? bufctl->slab : NULL;
+}
+
+/**
+ * kmem_hash_get_many overlaps the misses of a batch of lookups
+ */
+static void
+__large_slab_owner_many(struct kmem_cache *cp, size_t n, void **bufs,
+                        struct kmem_slab **slabs, void **handles)
+{
+        size_t i;
+
+        kmem_hash_get_many(cp->hash, bufs, handles, n);
+        for (i = 0; i < n; i++) {
+                slabs[i] = handles[i] ? ((struct kmem_bufctl *)handles[i])->slab : NULL;
+        }
+}
+
+/**
+ * Push a buf onto the head of its small slab's freelist
+ */
+static void
+__small_slab_free(struct kmem_cache *UNUSED(cp), struct kmem_slab *slab, void *buf)
+{
+        *((void**)buf) = slab->firstbuf.buf;
+        slab->firstbuf.buf = buf;
+}
+
+/**
+ * Push a bufctl back onto the head of its slab's freelist
+ */
+static void
+__large_slab_free(struct kmem_cache *UNUSED(cp), struct kmem_slab *slab, void *handle)
+{
+        struct kmem_bufctl *bufctl = handle;
 
-        // Update the last buffer pointer to this one
-        // And make this buf point to NULL (end of list)
-        *((void**)slab->lastbuf.buf) = buf;
+        assert(bufctl->slab == slab);
+        bufctl->next = slab->firstbuf.bufctl;
+        slab->firstbuf.bufctl = bufctl;
+}
+
+/**
+ * Drop a slab's refcount after one of its bufs went back on
+ * its freelist, and move or reap it to match
+ * ASSUMED: the caller holds cp->lock
+ */
+static inline void
+__slab_release(struct kmem_cache *cp, struct kmem_slab *slab)
+{
+        if ((slab->refcount--) == slab->size) {
+                __cache_partial_slab(cp, slab);
+        }
 
-        if((--slab->refcount) == 0 && cp->slab_count > 1) {
-                // Don't reap the last slab in the cache
+        if (slab->refcount == 0) {
+                // Empty slabs go to the tail, past the ones we keep
                 DEBUG_PRINT("Slab is no longer referenced. Reaping...\n");
                 __cache_empty_slab(cp, slab);
-                __cache_reap(cp, 0);
+                __set_reap(cp, slab->set, 0, cp->keep_slabs);
         } else {
                 DEBUG_PRINT("Slab refcount is now %lu\n", slab->refcount);
         }
 }
 
-
 /**
  * Free an item from the cache
- * Here, we need to obtain the bufctl from the cache's hash
- * That buf gets added back to the slab's freelist
- * ASSUMED: the cache type == KM_REGULAR_CACHE
+ * The caller already found its slab and handle with the
+ * layout's owner, which doesn't need the cache lock
+ * ASSUMED: the caller holds cp->lock
  */
 static inline void
-__cache_free_large(struct kmem_cache *cp, void *buf)
+__cache_free(struct kmem_cache *cp, struct kmem_slab *slab, void *buf, void *handle)
+{
+        DEBUG_PRINT("Freeing item %p from cache %s\n", buf, cp->name);
+        KM_TRACE(KM_TRACE_FREE, cp, buf, slab);
+        cp->frees++;
+        if (cp->ops == &__small_slab_ops) {
+                __small_slab_free(cp, slab, handle);
+        } else {
+                cp->ops->free(cp, slab, handle);
+        }
+        __slab_release(cp, slab);
+}
+
+/**
+ * Take the first n bufs off a small slab's freelist, if
+ * they're back to back in memory
+ */
+static void *
+__small_slab_take_run(struct kmem_cache *cp, struct kmem_slab *slab, size_t n)
+{
+        void **buf;
+        void *first;
+        size_t i;
+
+        first = buf = slab->firstbuf.buf;
+        for (i = 1; i < n; i++) {
+                if (*buf != (void*)((uintptr_t)buf + cp->object_size)) return NULL;
+                buf = *buf;
+        }
+        slab->firstbuf.buf = *buf;
+        return first;
+}
+
+static void *
+__large_slab_take_run(struct kmem_cache *cp, struct kmem_slab *slab, size_t n)
 {
-        struct kmem_slab *slab;
         struct kmem_bufctl *bufctl;
+        void *first;
+        size_t i;
 
-        DEBUG_PRINT("Freeing item %p from large cache %s\n", buf, cp->name);
-        bufctl = kmem_hash_get(cp->hash, buf);
-        if (!bufctl) {
-                DEBUG_PRINT("Unable to find bufctl for item %p\n", buf);
-                return;
+        bufctl = slab->firstbuf.bufctl;
+        first = bufctl->buf;
+        for (i = 1; i < n; i++) {
+                if (bufctl->next->buf != (void*)((uintptr_t)bufctl->buf + cp->object_size)) {
+                        return NULL;
+                }
+                bufctl = bufctl->next;
+        }
+        slab->firstbuf.bufctl = bufctl->next;
+        return first;
+}
+
+/**
+ * Relink a small slab's freelist as every buf from the nth
+ * on, in address order
+ */
+static void *
+__small_slab_carve(struct kmem_cache *cp, struct kmem_slab *slab, size_t n)
+{
+        void **prev;
+        void *buf;
+        size_t i;
+
+        slab->firstbuf.buf = NULL;
+        prev = NULL;
+        for (i = n; i < slab->size; i++) {
+                buf = (void*)((uintptr_t)slab->start + i * cp->object_size);
+                if (prev) {
+                        *prev = buf;
+                } else {
+                        slab->firstbuf.buf = buf;
+                }
+                prev = buf;
         }
-        slab = bufctl->slab;
-        assert(slab);
+        if (prev) *prev = NULL;
 
-        // Insert this bufctl back into the freelist
-        slab->lastbuf.bufctl->next = bufctl;
-        slab->lastbuf.bufctl = bufctl;
+        return slab->start;
+}
 
-        if ((--slab->refcount) == 0 && cp->slab_count > 1) {
-                // Don't reap the slab slab in the cache
-                DEBUG_PRINT("Slab is no longer referenced. Reaping...\n");
-                __cache_empty_slab(cp, slab);
+static void *
+__large_slab_carve(struct kmem_cache *cp, struct kmem_slab *slab, size_t n)
+{
+        struct kmem_bufctl *bufctl;
+        struct kmem_bufctl *last;
+        size_t i;
+
+        slab->firstbuf.bufctl = NULL;
+        last = NULL;
+        for (i = n; i < slab->size; i++) {
+                bufctl = kmem_hash_get(cp->hash, (void*)((uintptr_t)slab->start + i * cp->object_size));
+                if (last) {
+                        last->next = bufctl;
+                } else {
+                        slab->firstbuf.bufctl = bufctl;
+                }
+                last = bufctl;
+        }
+        if (last) last->next = NULL;
 
-                // Reclaim the slab
-                __cache_reap(cp, 0);
-        } else {
-                DEBUG_PRINT("Slab refcount is now %lu\n", slab->refcount);
+        return slab->start;
+}
+
+/**
+ * Take a run of n bufs for kmem_cache_alloc_contig: off the
+ * head of the slab's freelist if they're back to back there,
+ * as they are in the rest of a carved slab, or else (when
+ * carve is set) the first n of an empty slab, relinking the
+ * rest of its freelist in address order after them, so the
+ * next allocations out of it keep going in order
+ * Returns the first buf of the run, or NULL (taking nothing)
+ * ASSUMED: the slab has at least n free bufs, and is empty and
+ * not frozen when carving
+ */
+static void *
+__slab_take_run(struct kmem_cache *cp, struct kmem_slab *slab, size_t n, unsigned carve)
+{
+        void *first;
+        size_t i;
+
+        first = carve
+                ? cp->ops->carve(cp, slab, n)
+                : cp->ops->take_run(cp, slab, n);
+        if (!first) return NULL;
+
+        DEBUG_PRINT("Took a run of %lu bufs at %p off slab %p\n", n, first, (void*)slab);
+        for (i = 0; i < n; i++) {
+                KM_TRACE(KM_TRACE_ALLOC, cp, (void*)((uintptr_t)first + i * cp->object_size), slab);
+        }
+        slab->refcount += n;
+
+        return first;
+}
+
+/**
+ * The two built in layouts
+ * Small objects (under 1/8th of a page) keep their freelist
+ * links in the bufs themselves and the slab header at the end
+ * of the page, so everything is found from the buf's address.
+ * Anything bigger, or constructed, gets a bufctl per buf, and
+ * slabs that grow past a page
+ */
+static const struct kmem_slab_ops __small_slab_ops = {
+        .name = "small",
+        .multi_page = 0,
+        .hashed = 0,
+        .init = __small_slab_init,
+        .alloc = __small_slab_alloc,
+        .owner = __small_slab_owner,
+        .owner_many = NULL,
+        .free = __small_slab_free,
+        .reap = NULL,
+        .take_run = __small_slab_take_run,
+        .carve = __small_slab_carve,
+};
+
+static const struct kmem_slab_ops __large_slab_ops = {
+        .name = "large",
+        .multi_page = 1,
+        .hashed = 1,
+        .init = __large_slab_init,
+        .alloc = __large_slab_alloc,
+        .owner = __large_slab_owner,
+        .owner_many = __large_slab_owner_many,
+        .free = __large_slab_free,
+        .reap = __large_slab_reap,
+        .take_run = __large_slab_take_run,
+        .carve = __large_slab_carve,
+};
+
+/**
+ * Pop a buf off a CPU slab, lock-free
+ * Returns NULL once it's used up
+ */
+static inline void *
+__cpu_slab_pop(struct kmem_cache *cp, struct kmem_cpu_slab *cs)
+{
+        uintptr_t page;
+        uint64_t word;
+        uint64_t new;
+        void **buf;
+        void *next;
+
+        assert(cp->ops == &__small_slab_ops);
+
+        // Both seq_cst rather than a fence between them, which costs
+        // more than the locked add that's already a full barrier on x86
+        atomic_fetch_add_explicit(&cs->readers, 1, memory_order_seq_cst);
+        word = atomic_load_explicit(&cs->freelist, memory_order_seq_cst);
+        do {
+                if (KM_CPU_IDX(word) == KM_CPU_NONE) {
+                        buf = NULL;
+                        break;
+                }
+                page = KM_CPU_PAGE(word);
+                buf = (void**)(page + KM_CPU_IDX(word) * cp->object_size);
+
+                // Stale if someone else got to buf first, but then the CAS fails
+                next = __atomic_load_n(buf, __ATOMIC_RELAXED);
+                new = KM_CPU_WORD(page,
+                                  next ? ((uintptr_t)next - page) / cp->object_size : KM_CPU_NONE,
+                                  KM_CPU_TAG(word) + 1);
+        } while (!atomic_compare_exchange_weak_explicit(&cs->freelist, &word, new,
+                                                        memory_order_acquire,
+                                                        memory_order_acquire));
+
+        atomic_fetch_sub_explicit(&cs->readers, 1, memory_order_release);
+        return buf;
+}
+
+/**
+ * Push a buf back onto a CPU slab, lock-free, if that's the slab it's from
+ * Returns 1 if it went back, 0 if it has to go through the lock
+ */
+static inline int
+__cpu_slab_push(struct kmem_cache *cp, struct kmem_cpu_slab *cs, void *buf)
+{
+        uintptr_t page;
+        uint64_t word;
+
+        assert(cp->ops == &__small_slab_ops);
+
+        page = (uintptr_t)buf & ~(uintptr_t)(system_pagesize - 1);
+        word = atomic_load_explicit(&cs->freelist, memory_order_relaxed);
+        do {
+                if (KM_CPU_PAGE(word) != page) return 0;
+                __atomic_store_n((void**)buf,
+                                 KM_CPU_IDX(word) == KM_CPU_NONE
+                                 ? NULL
+                                 : (void*)(page + KM_CPU_IDX(word) * cp->object_size),
+                                 __ATOMIC_RELAXED);
+        } while (!atomic_compare_exchange_weak_explicit(&cs->freelist, &word,
+                                                        KM_CPU_WORD(page,
+                                                                    ((uintptr_t)buf - page) / cp->object_size,
+                                                                    KM_CPU_TAG(word) + 1),
+                                                        memory_order_release,
+                                                        memory_order_relaxed));
+        return 1;
+}
+
+/**
+ * Free the retired slabs, if no pop can still be reading them
+ * ASSUMED: the caller holds cp->lock
+ */
+static void
+__cpu_slabs_reclaim(struct kmem_cache *cp, unsigned force)
+{
+        struct kmem_slab *slab;
+
+        if (!cp->retired || (!force && !__cpu_slabs_quiet(cp))) return;
+
+        while (cp->retired) {
+                slab = cp->retired;
+                cp->retired = slab->next;
+                __slab_pages_free(cp, slab->start, system_pagesize << slab->order);
+        }
+}
+
+/**
+ * A CPU slab's slab isn't active there anymore, so reap
+ * it if it went empty in the meantime
+ * ASSUMED: the caller holds cp->lock
+ */
+static inline void
+__cpu_slab_thaw(struct kmem_cache *cp, struct kmem_slab *slab)
+{
+        if (--slab->frozen || slab->refcount) return;
+
+        __cache_empty_slab(cp, slab);
+        __set_reap(cp, slab->set, 0, cp->keep_slabs);
+}
+
+/**
+ * Swap a used up CPU slab for the first slab with free bufs,
+ * which hands every one of them to the CPU slab
+ * Returns 0 to go try the CPU slab again, -1 if there's no
+ * memory (KM_NOSLEEP only) or no slab with room (KM_NOGROW)
+ */
+static int
+__cpu_slab_refill(struct kmem_cache *cp, struct kmem_cpu_slab *cs, int flags)
+{
+        struct kmem_slab_set *set = &cp->sets[KM_LIFETIME_DEFAULT];
+        struct kmem_slab *slab;
+        uint64_t word;
+        void **first;
+        size_t n;
+
+        pthread_mutex_lock(&cp->lock);
+
+        // Someone else may have refilled it (or freed onto it) already
+        word = atomic_load_explicit(&cs->freelist, memory_order_relaxed);
+        if (KM_CPU_IDX(word) != KM_CPU_NONE) {
+                pthread_mutex_unlock(&cp->lock);
+                return 0;
+        }
+
+        slab = set->freelist;
+        while (!slab || slab->refcount >= slab->size) {
+                if (flags & KM_NOGROW) {
+                        slab = NULL;
+                        break;
+                }
+                DEBUG_PRINT("Growing the cache...\n");
+                slab = __cache_grow(cp, set, flags & KM_NOSLEEP);
+                if (!slab && (flags & KM_NOSLEEP)) break;
+        }
+        if (!slab) {
+                pthread_mutex_unlock(&cp->lock);
+                return -1;
+        }
+        assert(cp->ops == &__small_slab_ops && KM_CPU_FITS(slab->start));
+
+        // Take all of its free bufs, the list is already NULL terminated
+        n = slab->size - slab->refcount;
+        first = slab->firstbuf.buf;
+
+        slab->firstbuf.buf = NULL;
+        slab->refcount = slab->size;
+        __slab_complete(cp, slab);
+
+        if (!atomic_compare_exchange_strong_explicit(&cs->freelist, &word,
+                                                     KM_CPU_WORD(slab->start,
+                                                                 ((uintptr_t)first - (uintptr_t)slab->start)
+                                                                 / cp->object_size,
+                                                                 KM_CPU_TAG(word) + 1),
+                                                     memory_order_release,
+                                                     memory_order_relaxed)) {
+                // A free landed on it first, so use that and put these back
+                slab->firstbuf.buf = first;
+                slab->refcount -= n;
+                __cache_partial_slab(cp, slab);
+                pthread_mutex_unlock(&cp->lock);
+                return 0;
+        }
+
+        DEBUG_PRINT("CPU slab %p of cache %s now has %lu bufs from slab %p\n",
+                    (void*)cs, cp->name, n, (void*)slab);
+        slab->frozen++;
+        cp->allocs += n;
+        if (KM_CPU_PAGE(word)) {
+                __cpu_slab_thaw(cp, __slab_of_small((void*)KM_CPU_PAGE(word)));
+        }
+        __cpu_slabs_reclaim(cp, 0);
+        __cache_publish(cp);
+
+        pthread_mutex_unlock(&cp->lock);
+        return 0;
+}
+
+/**
+ * Hand every buf still on the CPU slabs back to their slab
+ * ASSUMED: the caller holds cp->lock
+ */
+static void
+__cpu_slabs_drain(struct kmem_cache *cp)
+{
+        struct kmem_cpu_slab *cs;
+        struct kmem_slab *slab;
+        uintptr_t page;
+        uint64_t word;
+        void **buf;
+        void **next;
+        unsigned i;
+
+        for (i = 0; i < cp->ncpu_slabs; i++) {
+                cs = &cp->cpu_slabs[i];
+                word = atomic_load_explicit(&cs->freelist, memory_order_relaxed);
+                while (!atomic_compare_exchange_weak_explicit(&cs->freelist, &word,
+                                                              KM_CPU_WORD(0, KM_CPU_NONE,
+                                                                          KM_CPU_TAG(word) + 1),
+                                                              memory_order_acquire,
+                                                              memory_order_relaxed));
+                page = KM_CPU_PAGE(word);
+                if (!page) continue;
+
+                // Frozen, so none of these free calls can reap it
+                slab = __slab_of_small((void*)page);
+                buf = KM_CPU_IDX(word) == KM_CPU_NONE
+                        ? NULL
+                        : (void**)(page + KM_CPU_IDX(word) * cp->object_size);
+                while (buf) {
+                        next = *buf;
+                        cp->frees++;
+                        __small_slab_free(cp, slab, buf);
+                        __slab_release(cp, slab);
+                        buf = next;
+                }
+                __cpu_slab_thaw(cp, slab);
         }
 }
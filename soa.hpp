@@ -0,0 +1,373 @@
+#ifndef PLOPREIATO_SLAB_SOA_HPP
+#define PLOPREIATO_SLAB_SOA_HPP
+
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "slab.h"
+
+/**
+ * Structure-of-arrays caches, for types that get scanned a field
+ * or two at a time across lots of objects
+ *
+ *     struct particle { float x, y, vx, vy; uint32_t flags; };
+ *     kmem::soa_cache<particle, &particle::x, &particle::vx> particles("particles");
+ *
+ *     auto h = particles.alloc();
+ *     particles.get<&particle::x>(h) = 1.0f;
+ *     for (auto span : particles.spans<&particle::x>()) {
+ *             for (float x : span) total += x;
+ *     }
+ *
+ * Objects are grouped into slabs of slab_slots, each slab one
+ * object from an ordinary kmem cache, holding one cache line
+ * aligned array per field. A scan reads just the arrays of the
+ * fields it wants, a slab at a time, instead of striding over
+ * whole objects. Only the listed fields are stored; load() and
+ * store() convert to and from a T.
+ *
+ * Objects are named by handle, which stays good until the object
+ * is freed. A slab's span covers every slot it has handed out up
+ * to the highest one still in use, so freed slots can show up in
+ * the middle: they read as zero, and alive() tells them apart.
+ * Allocation takes the lowest free slot, which keeps the spans
+ * short.
+ *
+ * Like a standard container, one thread at a time: alloc(), free()
+ * and shrink() change what the accessors and spans look at.
+ */
+
+namespace kmem {
+
+template <typename M>
+struct soa_member;
+
+template <typename C, typename F>
+struct soa_member<F C::*> {
+        using object = C;
+        using type = F;
+};
+
+/* The type of the field a member pointer names */
+template <auto Field>
+using soa_field_t = typename soa_member<decltype(Field)>::type;
+
+/**
+ * One slab's worth of a field, for the inner loop of a scan
+ */
+template <typename F>
+class soa_span : public std::span<F> {
+public:
+        soa_span(F *values, size_t n, const uint64_t *live)
+                : std::span<F>(values, n), live_(live) {}
+
+        /* Whether slot i holds an object (or was freed, and reads as zero) */
+        bool alive(size_t i) const
+        {
+                return live_[i / 64] >> (i % 64) & 1;
+        }
+
+private:
+        const uint64_t *live_;
+};
+
+template <typename T, auto... Fields>
+class soa_cache {
+        static_assert(sizeof...(Fields) > 0, "soa_cache needs at least one field");
+        static_assert((std::is_same_v<typename soa_member<decltype(Fields)>::object, T> && ...),
+                      "fields have to be members of T");
+        static_assert((std::is_trivially_copyable_v<soa_field_t<Fields>> && ...),
+                      "fields are zeroed and copied as bytes");
+
+        static constexpr size_t line = 64;
+        static constexpr size_t target_bytes = 16384;
+        static constexpr size_t row_bytes = (sizeof(soa_field_t<Fields>) + ...);
+
+public:
+        /* Objects per slab, whole words of the live bitmap */
+        static constexpr size_t slab_slots =
+                target_bytes / row_bytes < 64 ? 64 : target_bytes / row_bytes / 64 * 64;
+
+        struct handle {
+                uint32_t slab = UINT32_MAX;
+                uint32_t slot = 0;
+
+                explicit operator bool() const { return slab != UINT32_MAX; }
+                bool operator==(const handle &) const = default;
+        };
+
+private:
+        struct soa_slab {
+                uint64_t live[slab_slots / 64];
+                uint32_t count;         /* Objects allocated */
+                uint32_t high;          /* One past the highest slot in use */
+                uint32_t index;         /* Where it is in slabs_ */
+                bool open;              /* On open_, it has free slots */
+        };
+
+        static constexpr size_t round_up(size_t n)
+        {
+                return (n + line - 1) / line * line;
+        }
+
+        /* Where each field's array starts, and (last) the slab's size */
+        static constexpr std::array<size_t, sizeof...(Fields) + 1> layout()
+        {
+                std::array<size_t, sizeof...(Fields) + 1> at{};
+                const size_t sizes[] = { sizeof(soa_field_t<Fields>)... };
+
+                at[0] = round_up(sizeof(soa_slab));
+                for (size_t i = 0; i < sizeof...(Fields); i++) {
+                        at[i + 1] = at[i] + round_up(sizes[i] * slab_slots);
+                }
+                return at;
+        }
+        static constexpr auto layout_ = layout();
+
+        template <auto A, auto B>
+        static constexpr bool same_field()
+        {
+                if constexpr (std::is_same_v<decltype(A), decltype(B)>) {
+                        return A == B;
+                } else {
+                        return false;
+                }
+        }
+
+        template <auto F>
+        static constexpr size_t index_of()
+        {
+                constexpr bool hits[] = { same_field<F, Fields>()... };
+
+                for (size_t i = 0; i < sizeof...(Fields); i++) {
+                        if (hits[i]) return i;
+                }
+                return sizeof...(Fields);
+        }
+
+        template <auto F>
+        static soa_field_t<F> *array(soa_slab *s)
+        {
+                static_assert(index_of<F>() < sizeof...(Fields), "not one of this cache's fields");
+                return reinterpret_cast<soa_field_t<F> *>(reinterpret_cast<char *>(s) + layout_[index_of<F>()]);
+        }
+
+        static bool alive(const soa_slab *s, size_t slot)
+        {
+                return s->live[slot / 64] >> (slot % 64) & 1;
+        }
+
+public:
+        /**
+         * Every slab of a field, in slab order, for range for
+         */
+        template <auto F>
+        class span_range {
+        public:
+                class iterator {
+                public:
+                        iterator(soa_slab *const *at, soa_slab *const *end) : at_(at), end_(end)
+                        {
+                                skip();
+                        }
+
+                        soa_span<soa_field_t<F>> operator*() const
+                        {
+                                return { array<F>(*at_), (*at_)->high, (*at_)->live };
+                        }
+
+                        iterator &operator++()
+                        {
+                                at_++;
+                                skip();
+                                return *this;
+                        }
+
+                        bool operator!=(const iterator &other) const
+                        {
+                                return at_ != other.at_;
+                        }
+
+                private:
+                        // Over slabs shrink() gave back, and ones with nothing in them
+                        void skip()
+                        {
+                                while (at_ != end_ && (!*at_ || !(*at_)->high)) at_++;
+                        }
+
+                        soa_slab *const *at_;
+                        soa_slab *const *end_;
+                };
+
+                span_range(soa_slab *const *begin, soa_slab *const *end) : begin_(begin), end_(end) {}
+
+                iterator begin() const { return { begin_, end_ }; }
+                iterator end() const { return { end_, end_ }; }
+
+        private:
+                soa_slab *const *begin_;
+                soa_slab *const *end_;
+        };
+
+        explicit soa_cache(const char *name) : name_(name)
+        {
+                cp_ = kmem_cache_create(name_.data(), layout_.back(), line);
+        }
+
+        ~soa_cache()
+        {
+                for (soa_slab *s : slabs_) {
+                        if (s) kmem_cache_free(cp_, s);
+                }
+                kmem_cache_destroy(cp_);
+        }
+
+        soa_cache(const soa_cache &) = delete;
+        soa_cache &operator=(const soa_cache &) = delete;
+
+        /**
+         * A new object, every field zero
+         * flags as for kmem_cache_alloc; an empty handle if a new
+         * slab was needed and couldn't be had
+         */
+        handle alloc(int flags = KM_SLEEP)
+        {
+                soa_slab *s;
+                uint32_t slot;
+                size_t w;
+
+                if (open_.empty() && !grow(flags)) return {};
+
+                s = slabs_[open_.back()];
+                for (w = 0; !~s->live[w]; w++);
+                slot = w * 64 + std::countr_one(s->live[w]);
+                s->live[w] |= 1ull << (slot % 64);
+                s->count++;
+                if (slot >= s->high) s->high = slot + 1;
+                if (s->count == slab_slots) {
+                        s->open = false;
+                        open_.pop_back();
+                }
+                count_++;
+
+                return { s->index, slot };
+        }
+
+        void free(handle h)
+        {
+                soa_slab *s = slabs_[h.slab];
+
+                (std::memset(&array<Fields>(s)[h.slot], 0, sizeof(soa_field_t<Fields>)), ...);
+                s->live[h.slot / 64] &= ~(1ull << (h.slot % 64));
+                s->count--;
+                while (s->high && !alive(s, s->high - 1)) s->high--;
+                if (!s->open) {
+                        s->open = true;
+                        open_.push_back(h.slab);
+                }
+                count_--;
+        }
+
+        /* A field of one object */
+        template <auto F>
+        soa_field_t<F> &get(handle h)
+        {
+                return array<F>(slabs_[h.slab])[h.slot];
+        }
+
+        /* Gather an object's fields into a T (the rest value-initialized) */
+        T load(handle h) const
+        {
+                T obj{};
+
+                ((obj.*Fields = array<Fields>(slabs_[h.slab])[h.slot]), ...);
+                return obj;
+        }
+
+        /* Scatter a T's fields into an object */
+        void store(handle h, const T &obj)
+        {
+                ((array<Fields>(slabs_[h.slab])[h.slot] = obj.*Fields), ...);
+        }
+
+        bool alive(handle h) const
+        {
+                return h.slab < slabs_.size() && slabs_[h.slab] && alive(slabs_[h.slab], h.slot);
+        }
+
+        template <auto F>
+        span_range<F> spans() const
+        {
+                return { slabs_.data(), slabs_.data() + slabs_.size() };
+        }
+
+        /* Objects allocated */
+        size_t size() const
+        {
+                return count_;
+        }
+
+        /**
+         * Give empty slabs back to the underlying cache, and shrink it
+         * Returns the bytes kmem_cache_shrink gave back
+         */
+        size_t shrink()
+        {
+                open_.clear();
+                for (soa_slab *&s : slabs_) {
+                        if (s && !s->count) {
+                                free_ids_.push_back(s->index);
+                                kmem_cache_free(cp_, s);
+                                s = nullptr;
+                        } else if (s && s->open) {
+                                open_.push_back(s->index);
+                        }
+                }
+                return kmem_cache_shrink(cp_);
+        }
+
+        /* The cache the slabs come from, for stats, hooks and accounts */
+        kmem_cache *cache() const
+        {
+                return cp_;
+        }
+
+private:
+        bool grow(int flags)
+        {
+                soa_slab *s;
+
+                s = static_cast<soa_slab *>(kmem_cache_alloc(cp_, flags));
+                if (!s) return false;
+                std::memset(static_cast<void *>(s), 0, layout_.back());
+
+                if (free_ids_.empty()) {
+                        s->index = slabs_.size();
+                        slabs_.push_back(s);
+                } else {
+                        s->index = free_ids_.back();
+                        free_ids_.pop_back();
+                        slabs_[s->index] = s;
+                }
+                s->open = true;
+                open_.push_back(s->index);
+                return true;
+        }
+
+        std::string name_;
+        kmem_cache *cp_;
+        std::vector<soa_slab *> slabs_;     /* By handle.slab, nullptr once given back */
+        std::vector<uint32_t> open_;        /* Slabs with free slots, the last is used first */
+        std::vector<uint32_t> free_ids_;    /* Unused places in slabs_ */
+        size_t count_ = 0;
+};
+
+}
+
+#endif
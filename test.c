@@ -1,7 +1,23 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include "slab.h"
 #include "hash.h"
+#include "pressure.h"
+#include "account.h"
+#include "kmem_shm.h"
+#include "trace.h"
+#include "vcache.h"
+#include "kmem_alloc.h"
+#include "pages.h"
+#include "mempool.h"
 
 struct big_foo {
         int nums[128];
@@ -13,6 +29,193 @@ struct foo {
         int c;
 };
 
+/* Hammer a large object cache from a few threads at once */
+#define TEST_THREADS 4
+#define TEST_THREAD_ITEMS 64
+static void *
+big_cache_worker(void *arg)
+{
+        struct kmem_cache *cp = arg;
+        struct big_foo *items[TEST_THREAD_ITEMS];
+        long bad = 0;
+
+        for (int round = 0; round < 16; round++) {
+                for (int i = 0; i < TEST_THREAD_ITEMS; i++) {
+                        items[i] = kmem_cache_alloc(cp, KM_SLEEP);
+                        items[i]->nums[0] = i;
+                }
+                for (int i = 0; i < TEST_THREAD_ITEMS; i++) {
+                        if (items[i]->nums[0] != i) bad++;
+                        kmem_cache_free(cp, items[i]);
+                }
+        }
+
+        return (void*)bad;
+}
+
+/* The same, for a small object cache */
+static void *
+small_cache_worker(void *arg)
+{
+        struct kmem_cache *cp = arg;
+        struct foo *items[TEST_THREAD_ITEMS];
+        long bad = 0;
+
+        for (int round = 0; round < 256; round++) {
+                for (int i = 0; i < TEST_THREAD_ITEMS; i++) {
+                        items[i] = kmem_cache_alloc(cp, KM_SLEEP);
+                        items[i]->a = i;
+                        items[i]->c = round;
+                }
+                for (int i = 0; i < TEST_THREAD_ITEMS; i++) {
+                        if (items[i]->a != i || items[i]->c != round) bad++;
+                        kmem_cache_free(cp, items[i]);
+                }
+        }
+
+        return (void*)bad;
+}
+
+/* Leaves some stock charged to an account, then keeps a cache's lock busy */
+static struct kmem_cache *fork_accounted;
+static atomic_int fork_ready;
+static atomic_int fork_stop;
+static void *
+fork_worker(void *arg)
+{
+        struct kmem_cache *cp = arg;
+
+        kmem_cache_free(fork_accounted, kmem_cache_alloc(fork_accounted, KM_SLEEP));
+        atomic_store(&fork_ready, 1);
+        while (!atomic_load(&fork_stop)) {
+                kmem_cache_free(cp, kmem_cache_alloc(cp, KM_SLEEP));
+        }
+        return NULL;
+}
+
+/* Leaves some stock charged to an account, then waits to exit */
+static atomic_int stock_ready;
+static atomic_int stock_stop;
+static void *
+stock_worker(void *arg)
+{
+        struct kmem_cache *cp = arg;
+
+        kmem_cache_free(cp, kmem_cache_alloc(cp, KM_SLEEP));
+        atomic_store(&stock_ready, 1);
+        while (!atomic_load(&stock_stop));
+        return NULL;
+}
+
+/* Counts calls into the arg it's given */
+static void
+count_hook(struct kmem_cache *UNUSED(cp), void *UNUSED(buf), void *arg)
+{
+        (*(int *)arg)++;
+}
+
+/* A page provider handing out a fixed arena, that never takes pages back */
+#define ARENA_PAGES 64
+static char arena[ARENA_PAGES * 4096] __attribute__((aligned(4096)));
+static size_t arena_used;
+static size_t arena_decommitted;
+static void *
+arena_alloc(size_t size, void *UNUSED(arg))
+{
+        void *pages;
+
+        if (arena_used + size > sizeof(arena)) return NULL;
+        pages = arena + arena_used;
+        arena_used += size;
+        return pages;
+}
+static void
+arena_decommit(void *UNUSED(pages), size_t size, void *UNUSED(arg))
+{
+        arena_decommitted += size;
+}
+static const struct kmem_page_provider arena_pages = {
+        "arena", arena_alloc, NULL, arena_decommit, NULL
+};
+
+/* Looks keys up in a hash while they come and go, until told to stop */
+#define HASH_KEYS 64
+static int hash_keys[HASH_KEYS];
+static int hash_value;
+static int hash_reader_stop;
+static void *
+hash_reader(void *arg)
+{
+        long bad = 0;
+        void *value;
+
+        while (!__atomic_load_n(&hash_reader_stop, __ATOMIC_ACQUIRE)) {
+                for (int i = 0; i < HASH_KEYS; i++) {
+                        // A node freed under us could hold anything
+                        value = kmem_hash_get(arg, &hash_keys[i]);
+                        if (value && value != &hash_value) bad++;
+                }
+        }
+        return (void*)bad;
+}
+
+/* Uses a single thread cache from a thread that doesn't own it */
+static void *
+stray_alloc(void *arg)
+{
+        return kmem_cache_alloc(arg, KM_SLEEP);
+}
+
+/* Owns a single thread cache, allocating and freeing while it's published */
+static void *
+owner_churn(void *arg)
+{
+        void *buf;
+
+        for (int i = 0; i < 20000; i++) {
+                buf = kmem_cache_alloc(arg, KM_SLEEP);
+                kmem_cache_free(arg, buf);
+        }
+        return NULL;
+}
+
+/* Constructor and destructor that count, and mark their bufs */
+static int ctor_calls;
+static int dtor_calls;
+static void
+count_ctor(void *buf, size_t UNUSED(size))
+{
+        ((struct foo *)buf)->c = 42;
+        ctor_calls++;
+}
+static void
+count_dtor(void *UNUSED(buf), size_t UNUSED(size))
+{
+        dtor_calls++;
+}
+
+/* Allocates from a signal-safe cache, from a signal handler */
+static struct kmem_cache *signal_cache;
+static void *volatile signal_buf;
+static void
+signal_alloc(int UNUSED(sig))
+{
+        signal_buf = kmem_cache_alloc(signal_cache, KM_NOSLEEP);
+}
+
+/* Write a fake sysfs/procfs file for the pressure monitor */
+static void
+write_file(const char *dir, const char *name, const char *contents)
+{
+        char path[256];
+        FILE *f;
+
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+        f = fopen(path, "w");
+        fputs(contents, f);
+        fclose(f);
+}
+
 int
 main()
 {
@@ -59,9 +262,36 @@ main()
         printf("\n----------\nTesting Hash Table\n----------\n\n");
         int test = 7;
         int test2 = 8;
+        cache = kmem_cache_create("hashed", sizeof(struct big_foo), 0);
         kmem_hash_insert(cache->hash, &test, &test2);
         int *res = kmem_hash_get(cache->hash, &test);
-        printf("Result: %d", *res);
+        printf("Result: %d, expected 8\n", *res);
+        kmem_hash_remove(cache->hash, &test);
+        printf("Removed: %p, expected (nil)\n", kmem_hash_get(cache->hash, &test));
+
+        // Removed nodes are freed while lookups keep coming, and
+        // never while one of them could still be on it
+        pthread_t reader;
+        void *misread;
+        size_t unfreed = 0;
+        pthread_create(&reader, NULL, hash_reader, cache->hash);
+        for (int round = 0; round < 2000; round++) {
+                for (int i = 0; i < HASH_KEYS; i++) {
+                        kmem_hash_insert(cache->hash, &hash_keys[i], &hash_value);
+                }
+                for (int i = 0; i < HASH_KEYS; i++) {
+                        kmem_hash_remove(cache->hash, &hash_keys[i]);
+                }
+        }
+        printf("Epochs passed under lookups: %d, expected 1\n", cache->hash->epoch > 2000);
+        __atomic_store_n(&hash_reader_stop, 1, __ATOMIC_RELEASE);
+        pthread_join(reader, &misread);
+        printf("Misread lookups: %ld, expected 0\n", (long)misread);
+        kmem_hash_reclaim(cache->hash);
+        for (struct kmem_hash_node *node = cache->hash->retired; node; node = node->retired_next) unfreed++;
+        for (struct kmem_hash_node *node = cache->hash->waiting; node; node = node->retired_next) unfreed++;
+        printf("Removed nodes left once lookups stop: %lu, expected 0\n", unfreed);
+        kmem_cache_destroy(cache);
 
         printf("\n----------\nTesting Big Cache\n----------\n\n");
         struct kmem_cache *big_cache = kmem_cache_create("woof", sizeof(struct big_foo), 0);
@@ -72,8 +302,841 @@ main()
 
         printf("Test value %d, expected 9\n", big_datas[2]->nums[0] + big_datas[7]->nums[0]);
 
+        for (int i = 0; i < 5; i++) {
+                kmem_cache_free(big_cache, big_datas[i]);
+        }
+        kmem_cache_free_bulk(big_cache, 5, (void**)&big_datas[5]);
+        printf("Num slabs after bulk free: %d, expected 1\n", big_cache->slab_count);
+        kmem_cache_destroy(big_cache);
+
+        printf("\n----------\nTesting Shrink\n----------\n\n");
+        cache = kmem_cache_create("shrinky", sizeof(struct foo), 0);
+        for (int i = 0; i < 340; i++) {
+                datas[i] = kmem_cache_alloc(cache, KM_SLEEP);
+        }
+        for (int i = 0; i < 340; i++) {
+                kmem_cache_free(cache, datas[i]);
+        }
+        printf("Num slabs: %d, expected 1\n", cache->slab_count);
+        printf("Shrink released %lu bytes, expected 4096\n", kmem_cache_shrink(cache));
+        printf("Num slabs: %d, expected 0\n", cache->slab_count);
+        datas[0] = kmem_cache_alloc(cache, KM_SLEEP);
+        printf("Num slabs after regrowing: %d, expected 1\n", cache->slab_count);
+        kmem_cache_free(cache, datas[0]);
+        printf("Global shrink released %lu bytes, expected at least 4096\n", kmem_shrink_all(1));
+        printf("Num slabs: %d, expected 0\n", cache->slab_count);
+        kmem_cache_destroy(cache);
+
+        printf("\n----------\nTesting Pressure Monitor\n----------\n\n");
+        char fake_dir[] = "/tmp/slab_pressure_XXXXXX";
+        char psi_path[64];
+        struct kmem_pressure monitor;
+        mkdtemp(fake_dir);
+        snprintf(psi_path, sizeof(psi_path), "%s/memory.pressure", fake_dir);
+        write_file(fake_dir, "memory.pressure",
+                   "some avg10=0.00 avg60=0.00 avg300=0.00 total=0\n"
+                   "full avg10=0.00 avg60=0.00 avg300=0.00 total=0\n");
+        write_file(fake_dir, "memory.current", "1048576\n");
+        write_file(fake_dir, "memory.high", "max\n");
+        kmem_pressure_init(&monitor, psi_path, fake_dir);
+
+        cache = kmem_cache_create("pressured", sizeof(struct foo), 0);
+        printf("Released with no pressure: %lu, expected 0\n", kmem_pressure_check(&monitor));
+        write_file(fake_dir, "memory.high", "1048576\n");
+        printf("Released near memory.high: %lu, expected at least 4096\n", kmem_pressure_check(&monitor));
+        printf("Num slabs: %d, expected 0\n", cache->slab_count);
+
+        kmem_cache_free(cache, kmem_cache_alloc(cache, KM_SLEEP));
+        write_file(fake_dir, "memory.high", "max\n");
+        write_file(fake_dir, "memory.pressure",
+                   "some avg10=42.00 avg60=10.00 avg300=1.00 total=123456\n"
+                   "full avg10=5.00 avg60=1.00 avg300=0.10 total=1234\n");
+        printf("Released under PSI pressure: %lu, expected at least 4096\n", kmem_pressure_check(&monitor));
+        printf("Num slabs: %d, expected 0\n", cache->slab_count);
+        kmem_cache_destroy(cache);
+
+        // A trigger that only ever errors (a pipe with no reader) is
+        // dropped for the timer, rather than spun on
+        int broken[2];
+        pipe(broken);
+        close(broken[0]);
+        monitor.interval_ms = 1000;
+        monitor.psi_fd = broken[1];
+        kmem_pressure_start(&monitor);
+        usleep(100000);
+        printf("Failed trigger dropped: %d, expected 1\n",
+               __atomic_load_n(&monitor.psi_fd, __ATOMIC_ACQUIRE) == -1);
+        kmem_pressure_stop(&monitor);
+
+        char path[64];
+        const char *fake_files[] = { "memory.pressure", "memory.current", "memory.high" };
+        for (int i = 0; i < 3; i++) {
+                snprintf(path, sizeof(path), "%s/%s", fake_dir, fake_files[i]);
+                unlink(path);
+        }
+        rmdir(fake_dir);
+
+        printf("\n----------\nTesting Accounting\n----------\n\n");
+        struct kmem_account tenant;
+        struct kmem_account_stats report;
+        int got = 0;
+        kmem_account_init(&tenant, "tenant", 100 * sizeof(struct foo));
+        cache = kmem_cache_create("tenant foo", sizeof(struct foo), 0);
+        kmem_cache_set_account(cache, &tenant);
+        for (int i = 0; i < 340; i++) {
+                datas[i] = kmem_cache_alloc(cache, KM_NOSLEEP);
+                if (datas[i]) got++;
+        }
+        kmem_account_report(&tenant, &report);
+        printf("Allocations under limit: %d, expected 100\n", got);
+        printf("Usage: %lu, expected %lu\n", report.usage, 100 * sizeof(struct foo));
+        printf("Failures: %lu, expected 240\n", report.failcnt);
+        for (int i = 0; i < got; i++) {
+                kmem_cache_free(cache, datas[i]);
+        }
+        kmem_account_flush();
+        kmem_account_report(&tenant, &report);
+        printf("Usage after frees: %lu, expected 0, max %lu\n", report.usage, report.max_usage);
+        kmem_cache_destroy(cache);
+
+        // Another thread's stock still points at the account
+        pthread_t stocker;
+        kmem_account_init(&tenant, "short lived", 0);
+        cache = kmem_cache_create("short lived foo", sizeof(struct foo), 0);
+        kmem_cache_set_account(cache, &tenant);
+        pthread_create(&stocker, NULL, stock_worker, cache);
+        while (!atomic_load(&stock_ready));
+        kmem_account_report(&tenant, &report);
+        printf("Stocked by another thread: %lu, expected %lu\n", report.usage,
+               KM_ACCOUNT_BATCH + sizeof(struct foo));
+        kmem_cache_destroy(cache);
+        kmem_account_destroy(&tenant);
+        kmem_account_report(&tenant, &report);
+        printf("Usage after destroy: %lu, expected 0\n", report.usage);
+        atomic_store(&stock_stop, 1);
+        pthread_join(stocker, NULL);
+        kmem_account_report(&tenant, &report);
+        printf("Usage after the thread exits: %lu, expected 0\n", report.usage);
+
+        printf("\n----------\nTesting Mempools\n----------\n\n");
+        struct kmem_mempool pool;
+        struct kmem_mempool_stats pool_stats;
+        struct kmem_cache_stats budget_stats;
+        kmem_account_init(&tenant, "budget", 8 * sizeof(struct foo));
+        cache = kmem_cache_create("budget foo", sizeof(struct foo), 0);
+        kmem_cache_set_account(cache, &tenant);
+        printf("Pool init: %d, expected 0\n", kmem_mempool_init(&pool, "budget pool", cache, 4));
+        got = 0;
+        for (int i = 0; i < 9; i++) {
+                datas[i] = kmem_mempool_alloc(&pool, KM_NOSLEEP);
+                if (datas[i]) got++;
+        }
+        kmem_mempool_get_stats(&pool, &pool_stats);
+        printf("Allocations with the budget spent: %d, expected 8\n", got);
+        printf("From the reserve: %lu, expected 4\n", pool_stats.reserve_allocs);
+        printf("Reserve left: %lu, expected 0, failures %lu, expected 1\n",
+               pool_stats.curr_nr, pool_stats.failcnt);
+        datas[8] = kmem_mempool_alloc(&pool, KM_SLEEP);
+        printf("KM_SLEEP with the reserve empty: %d, expected 1\n", datas[8] != NULL);
+        for (int i = 0; i < 9; i++) {
+                kmem_mempool_free(&pool, datas[i]);
+        }
+        kmem_mempool_get_stats(&pool, &pool_stats);
+        kmem_cache_get_stats(cache, &budget_stats);
+        printf("Reserve refilled: %lu, expected 4, objects %lu, expected 4\n",
+               pool_stats.curr_nr, budget_stats.objects);
+        kmem_mempool_destroy(&pool);
+        kmem_account_flush();
+        kmem_account_report(&tenant, &report);
+        printf("Usage after destroy: %lu, expected 0\n", report.usage);
+        kmem_cache_destroy(cache);
+
+        printf("\n----------\nTesting Lifetime Hints\n----------\n\n");
+        struct kmem_cache_stats stats;
+        cache = kmem_cache_create("lifetimes", sizeof(struct foo), 0);
+        meow = kmem_cache_alloc(cache, KM_SLEEP | KM_LONGLIVED);
+        woof = kmem_cache_alloc(cache, KM_SLEEP | KM_SHORTLIVED);
+        kmem_cache_get_stats(cache, &stats);
+        printf("Objects: %lu, expected 2\n", stats.objects);
+        printf("Slabs (default, short, long): %u %u %u, expected 1 1 1\n",
+               stats.set_slabs[KM_LIFETIME_DEFAULT], stats.set_slabs[KM_LIFETIME_SHORT],
+               stats.set_slabs[KM_LIFETIME_LONG]);
+        printf("Long and short share a page: %d, expected 0\n",
+               ((uintptr_t)meow >> 12) == ((uintptr_t)woof >> 12));
+        kmem_cache_free(cache, meow);
+        kmem_cache_free(cache, woof);
+        kmem_cache_destroy(cache);
+
+        printf("\n----------\nTesting Hooks\n----------\n\n");
+        int cache_calls = 0;
+        int global_calls = 0;
+        struct kmem_hooks cache_hooks = { count_hook, count_hook, &cache_calls };
+        struct kmem_hooks global_hooks = { count_hook, NULL, &global_calls };
+        cache = kmem_cache_create("hooked", sizeof(struct foo), 0);
+        kmem_cache_set_hooks(cache, &cache_hooks);
+        kmem_set_hooks(&global_hooks);
+        meow = kmem_cache_alloc(cache, KM_SLEEP);
+        kmem_cache_free(cache, meow);
+        kmem_cache_set_hooks(cache, NULL);
+        kmem_set_hooks(NULL);
+        meow = kmem_cache_alloc(cache, KM_SLEEP);
+        kmem_cache_free(cache, meow);
+        printf("Cache hook calls: %d, expected 2\n", cache_calls);
+        printf("Global hook calls: %d, expected 1\n", global_calls);
+        kmem_cache_destroy(cache);
+
+        printf("\n----------\nTesting Slab Growth\n----------\n\n");
+        static struct big_foo *many[2000];
+        big_cache = kmem_cache_create("growing", sizeof(struct big_foo), 0);
+        kmem_cache_get_stats(big_cache, &stats);
+        printf("Order to start: %u (%u to %u), expected 0 (0 to 3)\n",
+               stats.slab_order, stats.min_order, stats.max_order);
+        for (int i = 0; i < 2000; i++) {
+                many[i] = kmem_cache_alloc(big_cache, KM_SLEEP);
+                many[i]->nums[127] = i;
+        }
+        kmem_cache_get_stats(big_cache, &stats);
+        printf("Order after 2000: %u, slabs %u, pages %lu, expected 3 53 256\n",
+               stats.slab_order, stats.slab_count, stats.pages);
+        int moved = 0;
+        for (int i = 0; i < 2000; i++) {
+                moved += many[i]->nums[127] != i;
+        }
+        printf("Objects overwritten: %d, expected 0\n", moved);
+        kmem_cache_free_bulk(big_cache, 2000, (void **)many);
+        kmem_cache_shrink(big_cache);
+        kmem_cache_get_stats(big_cache, &stats);
+        printf("Order after shrink: %u, expected 0\n", stats.slab_order);
+        kmem_cache_destroy(big_cache);
+        big_cache = kmem_cache_create("bigger than a page", 5000, 0);
+        kmem_cache_get_stats(big_cache, &stats);
+        printf("Orders for 5000 byte objects: %u to %u, expected 2 3\n",
+               stats.min_order, stats.max_order);
+        meow = kmem_cache_alloc(big_cache, KM_SLEEP);
+        woof = kmem_cache_alloc(big_cache, KM_SLEEP);
+        printf("Two on one slab: %d, expected 1\n", (char *)woof - (char *)meow == 5000
+               || (char *)meow - (char *)woof == 5000);
+        kmem_cache_free(big_cache, meow);
+        kmem_cache_free(big_cache, woof);
+        kmem_cache_destroy(big_cache);
+
+        printf("\n----------\nTesting Allocation Hints\n----------\n\n");
+        cache = kmem_cache_create("near foo", sizeof(struct foo), 0);
+        for (int i = 0; i < 340; i++) {
+                datas[i] = kmem_cache_alloc(cache, KM_SLEEP);
+        }
+        kmem_cache_free(cache, datas[5]);
+        kmem_cache_free(cache, datas[339]);
+        meow = kmem_cache_alloc_near(cache, datas[0], KM_SLEEP);
+        printf("On the hint's slab: %d, expected 1\n", meow == datas[5]);
+        woof = kmem_cache_alloc_near(cache, datas[0], KM_SLEEP);
+        printf("Hint's slab full, so from the other: %d, expected 1\n", woof == datas[339]);
+        datas[5] = meow;
+        datas[339] = woof;
+        for (int i = 0; i < 340; i++) {
+                kmem_cache_free(cache, datas[i]);
+        }
+        kmem_cache_destroy(cache);
+        big_cache = kmem_cache_create("near woof", sizeof(struct big_foo), 0);
+        for (int i = 0; i < 10; i++) {
+                big_datas[i] = kmem_cache_alloc(big_cache, KM_SLEEP);
+        }
+        struct kmem_bufctl *near = kmem_hash_get(big_cache->hash, big_datas[2]);
+        struct kmem_bufctl *hint = kmem_hash_get(big_cache->hash, big_datas[9]);
+        printf("Big objects on two slabs: %d, expected 1\n", near->slab != hint->slab);
+        kmem_cache_free(big_cache, big_datas[2]);
+        big_datas[2] = kmem_cache_alloc_near(big_cache, big_datas[9], KM_SLEEP);
+        near = kmem_hash_get(big_cache->hash, big_datas[2]);
+        printf("Big object on the hint's slab: %d, expected 1\n", near->slab == hint->slab);
+        for (int i = 0; i < 10; i++) {
+                kmem_cache_free(big_cache, big_datas[i]);
+        }
+        kmem_cache_destroy(big_cache);
+
+        printf("\n----------\nTesting Contiguous Runs\n----------\n\n");
+        cache = kmem_cache_create("contig foo", sizeof(struct foo), 0);
+        meow = kmem_cache_alloc(cache, KM_SLEEP);
+        char *run = kmem_cache_alloc_contig(cache, 100, KM_SLEEP);
+        printf("Run carries on from the freelist: %d, expected 1\n",
+               run == (char *)meow + cache->object_size);
+        for (int i = 0; i < 100; i++) {
+                ((struct foo *)(run + i * cache->object_size))->a = i;
+        }
+        int in_order = 1;
+        for (int i = 0; i < 100; i++) {
+                in_order &= ((struct foo *)(run + i * cache->object_size))->a == i;
+        }
+        printf("Run holds its objects: %d, expected 1\n", in_order);
+        woof = kmem_cache_alloc(cache, KM_SLEEP);
+        printf("Next alloc follows the run: %d, expected 1\n",
+               (char *)woof == run + 100 * cache->object_size);
+        printf("Too long a run: %p, expected (nil)\n",
+               kmem_cache_alloc_contig(cache, 4096, KM_SLEEP));
+        kmem_cache_get_stats(cache, &stats);
+        printf("Objects in use: %lu, expected 102\n", stats.objects);
+        kmem_cache_free_contig(cache, run, 100);
+        kmem_cache_free(cache, woof);
+        kmem_cache_free(cache, meow);
+        kmem_cache_get_stats(cache, &stats);
+        printf("Objects in use after freeing the run: %lu, expected 0\n", stats.objects);
+        kmem_cache_destroy(cache);
+        big_cache = kmem_cache_create("contig woof", sizeof(struct big_foo), 0);
+        run = kmem_cache_alloc_contig(big_cache, 6, KM_SLEEP);
+        in_order = 1;
+        for (int i = 0; i < 6; i++) {
+                near = kmem_hash_get(big_cache->hash, run + i * big_cache->object_size);
+                in_order &= near && near->slab == ((struct kmem_bufctl *)kmem_hash_get(big_cache->hash, run))->slab;
+        }
+        printf("Big run on one slab: %d, expected 1\n", in_order);
+        woof = kmem_cache_alloc(big_cache, KM_SLEEP);
+        printf("Next big alloc follows the run: %d, expected 1\n",
+               (char *)woof == run + 6 * big_cache->object_size);
+        kmem_cache_free(big_cache, woof);
+        kmem_cache_free_contig(big_cache, run, 6);
+        kmem_cache_get_stats(big_cache, &stats);
+        printf("Big objects in use: %lu, expected 0\n", stats.objects);
+        kmem_cache_destroy(big_cache);
+
+        // A kept empty slab from before the cache moved up an order
+        // is too small for a run the size of a new slab
+        big_cache = kmem_cache_create_attr("contig orders", &(struct kmem_cache_attr){
+                .size = sizeof(struct big_foo),
+                .keep_slabs = 64,
+        });
+        void *contig_bufs[512];
+        size_t first_slab = 0;
+        size_t big_n = 0;
+        kmem_cache_get_stats(big_cache, &stats);
+        while (stats.slab_order < 2 && big_n < 512) {
+                contig_bufs[big_n++] = kmem_cache_alloc(big_cache, KM_SLEEP);
+                kmem_cache_get_stats(big_cache, &stats);
+                if (stats.slab_count == 1) first_slab = big_n;
+        }
+        for (size_t i = 0; i < first_slab; i++) {
+                kmem_cache_free(big_cache, contig_bufs[i]);
+        }
+        size_t big_run = ((size_t)sysconf(_SC_PAGESIZE) << 2) / big_cache->object_size;
+        run = kmem_cache_alloc_contig(big_cache, big_run, KM_SLEEP);
+        printf("Run past a small empty slab: %d, expected 1\n", run != NULL);
+        if (run) kmem_cache_free_contig(big_cache, run, big_run);
+        for (size_t i = first_slab; i < big_n; i++) {
+                kmem_cache_free(big_cache, contig_bufs[i]);
+        }
+        kmem_cache_destroy(big_cache);
+
+        printf("\n----------\nTesting Cache Attributes\n----------\n\n");
+        cache = kmem_cache_create_attr("constructed", &(struct kmem_cache_attr){
+                .size = sizeof(struct foo),
+                .ctor = count_ctor,
+                .dtor = count_dtor,
+        });
+        printf("Constructed small objects use bufctls: %d, expected 1\n",
+               cache->ops->hashed);
+        meow = kmem_cache_alloc(cache, KM_SLEEP);
+        printf("Constructed: %d, expected 42\n", meow->c);
+        printf("Constructor ran once a buf: %d, expected 1\n",
+               ctor_calls == (int)cache->slab_count * (int)(4096 / cache->object_size));
+        meow->c = 7;
+        kmem_cache_free(cache, meow);
+        woof = kmem_cache_alloc(cache, KM_SLEEP);
+        printf("State kept across free: %d, expected 1\n", woof == meow && woof->c == 7);
+        kmem_cache_free(cache, woof);
+        int constructed = ctor_calls;
+        kmem_cache_destroy(cache);
+        printf("Destructor calls: %d, expected %d\n", dtor_calls, constructed);
+
+        cache = kmem_cache_create_attr("long by default", &(struct kmem_cache_attr){
+                .size = sizeof(struct foo),
+                .lifetime = KM_LIFETIME_LONG,
+        });
+        meow = kmem_cache_alloc(cache, KM_SLEEP);
+        woof = kmem_cache_alloc(cache, KM_SLEEP | KM_SHORTLIVED);
+        kmem_cache_get_stats(cache, &stats);
+        printf("Slabs (default, short, long): %u %u %u, expected 0 1 1\n",
+               stats.set_slabs[KM_LIFETIME_DEFAULT], stats.set_slabs[KM_LIFETIME_SHORT],
+               stats.set_slabs[KM_LIFETIME_LONG]);
+        kmem_cache_free(cache, meow);
+        kmem_cache_free(cache, woof);
+        kmem_cache_destroy(cache);
+
+        static void *kept[2000];
+        cache = kmem_cache_create_attr("kept", &(struct kmem_cache_attr){
+                .size = sizeof(struct foo),
+                .keep_slabs = 3,
+        });
+        for (int i = 0; i < 2000; i++) {
+                kept[i] = kmem_cache_alloc(cache, KM_SLEEP);
+        }
+        kmem_cache_free_bulk(cache, 2000, kept);
+        kmem_cache_get_stats(cache, &stats);
+        printf("Empty slabs kept: %u, expected 3\n", stats.set_slabs[KM_LIFETIME_DEFAULT]);
+        kmem_cache_shrink(cache);
+        kmem_cache_get_stats(cache, &stats);
+        printf("After shrink: %u, expected 0\n", stats.set_slabs[KM_LIFETIME_DEFAULT]);
+        kmem_cache_destroy(cache);
+
+        big_cache = kmem_cache_create_attr("presized", &(struct kmem_cache_attr){
+                .size = sizeof(struct big_foo),
+                .nobjs = 1000,
+                .slab_pages = 4,
+        });
+        kmem_cache_get_stats(big_cache, &stats);
+        printf("Orders for 1000 objects: %u to %u, expected 2 2\n", stats.min_order, stats.max_order);
+        printf("Made up front: %u slabs, expected 32\n", stats.slab_count);
+        kmem_cache_destroy(big_cache);
+
+        cache = kmem_cache_create_attr("aligned", &(struct kmem_cache_attr){
+                .size = 10,
+                .align = 8,
+        });
+        int aligned = 1;
+        for (int i = 0; i < 20; i++) {
+                datas[i] = kmem_cache_alloc(cache, KM_SLEEP);
+                aligned &= (uintptr_t)datas[i] % 8 == 0;
+        }
+        printf("Size 10 at align 8: %lu bytes, aligned %d, expected 16 1\n", cache->object_size, aligned);
+        for (int i = 0; i < 20; i++) {
+                kmem_cache_free(cache, datas[i]);
+        }
+        kmem_cache_destroy(cache);
+
+        printf("Bad attributes: %p %p %p %p, expected (nil) (nil) (nil) (nil)\n",
+               (void *)kmem_cache_create_attr("no size", &(struct kmem_cache_attr){ 0 }),
+               (void *)kmem_cache_create_attr("odd align", &(struct kmem_cache_attr){
+                       .size = 8, .align = 12 }),
+               (void *)kmem_cache_create_attr("no reserve", &(struct kmem_cache_attr){
+                       .size = 8, .flags = KM_CACHE_SIGSAFE }),
+               (void *)kmem_cache_create_attr("constructed cpu", &(struct kmem_cache_attr){
+                       .size = 8, .ctor = count_ctor, .flags = KM_CACHE_CPUSLAB }));
+
+        printf("\n----------\nTesting Page Providers\n----------\n\n");
+        kmem_set_page_provider(&arena_pages);
+        cache = kmem_cache_create("arena foo", sizeof(struct foo), 0);
+        kmem_set_page_provider(NULL);
+        big_cache = kmem_cache_create("malloc woof", sizeof(struct big_foo), 0);
+        printf("Providers: %s %s, expected arena malloc\n", cache->provider->name, big_cache->provider->name);
+        for (int i = 0; i < 340; i++) {
+                datas[i] = kmem_cache_alloc(cache, KM_SLEEP);
+        }
+        printf("Slabs from the arena: %d, expected 1\n",
+               (char *)datas[0] >= arena && (char *)datas[339] < arena + sizeof(arena));
+        kmem_cache_free_bulk(cache, 340, (void **)datas);
+        kmem_cache_shrink(cache);
+        printf("Decommitted: %lu of %lu bytes, expected all\n", arena_decommitted, arena_used);
+        kmem_cache_destroy(cache);
+        kmem_cache_destroy(big_cache);
+        const struct kmem_page_provider *providers[] = { &kmem_pages_mmap, &kmem_pages_huge };
+        for (int p = 0; p < 2; p++) {
+                big_cache = kmem_cache_create_attr("provided woof", &(struct kmem_cache_attr){
+                        .size = sizeof(struct big_foo),
+                        .provider = providers[p],
+                });
+                for (int i = 0; i < 2000; i++) {
+                        many[i] = kmem_cache_alloc(big_cache, KM_SLEEP);
+                        many[i]->nums[127] = i;
+                }
+                moved = 0;
+                for (int i = 0; i < 2000; i++) {
+                        moved += many[i]->nums[127] != i;
+                }
+                kmem_cache_free_bulk(big_cache, 2000, (void **)many);
+                kmem_cache_get_stats(big_cache, &stats);
+                printf("%s: objects overwritten %d, left %lu, expected 0 0\n",
+                       providers[p]->name, moved, stats.objects);
+                kmem_cache_destroy(big_cache);
+        }
+        // Mixed sizes out of one huge page: the tail too short for
+        // the next 512KB slab goes on the free lists instead
+        char *huge[6];
+        do {
+                huge[0] = kmem_pages_huge.alloc_pages(512 << 10, NULL);
+        } while ((uintptr_t)huge[0] % (2 << 20));
+        huge[1] = kmem_pages_huge.alloc_pages(64 << 10, NULL);
+        huge[2] = kmem_pages_huge.alloc_pages(512 << 10, NULL);
+        huge[3] = kmem_pages_huge.alloc_pages(512 << 10, NULL);
+        huge[4] = kmem_pages_huge.alloc_pages(512 << 10, NULL);
+        huge[5] = kmem_pages_huge.alloc_pages(256 << 10, NULL);
+        printf("Huge page tail reused: %d, expected 1\n",
+               huge[4] != huge[3] + (512 << 10) && huge[5] == huge[3] + (512 << 10));
+        kmem_pages_huge.free_pages(huge[0], 512 << 10, NULL);
+        kmem_pages_huge.free_pages(huge[1], 64 << 10, NULL);
+        for (int i = 2; i < 5; i++) {
+                kmem_pages_huge.free_pages(huge[i], 512 << 10, NULL);
+        }
+        kmem_pages_huge.free_pages(huge[5], 256 << 10, NULL);
+
+        printf("\n----------\nTesting Published Stats\n----------\n\n");
+        char shm_name[64];
+        struct kmem_shm_header *shm;
+        struct kmem_shm_cache *slot = NULL;
+        snprintf(shm_name, sizeof(shm_name), "/kmem_test_%d", getpid());
+        printf("Publish: %d, expected 0\n", kmem_stats_publish(shm_name));
+        printf("Publish again: %d, expected -1\n", kmem_stats_publish(shm_name));
+        cache = kmem_cache_create("published", sizeof(struct foo), 0);
+        meow = kmem_cache_alloc(cache, KM_SLEEP);
+        woof = kmem_cache_alloc(cache, KM_SLEEP);
+        kmem_cache_free(cache, meow);
+        int fd = shm_open(shm_name, O_RDONLY, 0);
+        shm = mmap(NULL, sizeof(struct kmem_shm_header), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        for (int i = 0; i < KM_SHM_MAX_CACHES; i++) {
+                if (shm->caches[i].active && !strcmp(shm->caches[i].name, "published")) {
+                        slot = &shm->caches[i];
+                }
+        }
+        printf("Found slot: %d, expected 1\n", slot != NULL);
+        if (slot) {
+                printf("Objects %lu, allocs %lu, frees %lu, expected 1 2 1\n",
+                       slot->objects, slot->allocs, slot->frees);
+        }
+        kmem_cache_free(cache, woof);
+        kmem_cache_destroy(cache);
+        printf("Slot released on destroy: %d, expected 1\n", slot && !slot->active);
+        munmap(shm, sizeof(struct kmem_shm_header));
+        kmem_stats_unpublish();
+        printf("Segment removed: %d, expected 1\n", shm_open(shm_name, O_RDONLY, 0) < 0);
+
+        printf("\n----------\nTesting Tracing\n----------\n\n");
+        char trace_path[64];
+        struct kmem_trace_file_header th;
+        struct kmem_trace_file_name tn;
+        struct kmem_trace_file_ring tr;
+        struct kmem_trace_event ev;
+        int traced[KM_TRACE_KMEM_ALLOC + 1] = { 0 };
+        snprintf(trace_path, sizeof(trace_path), "/tmp/kmem_trace_%d", getpid());
+        cache = kmem_cache_create("traced", sizeof(struct foo), 0);
+        kmem_trace_enable(1);
+        meow = kmem_cache_alloc(cache, KM_SLEEP);
+        woof = kmem_cache_alloc(cache, KM_SLEEP);
+        kmem_cache_free(cache, meow);
+        kmem_trace_enable(0);
+        kmem_cache_free(cache, woof);
+        printf("Dump: %d, expected 0\n", kmem_trace_dump(trace_path));
+        FILE *tf = fopen(trace_path, "rb");
+        if (fread(&th, sizeof(th), 1, tf) == 1) {
+                printf("Magic ok: %d, expected 1\n", th.magic == KM_TRACE_MAGIC);
+                for (uint32_t i = 0; i < th.nnames; i++) {
+                        if (fread(&tn, sizeof(tn), 1, tf) != 1) break;
+                }
+                for (uint32_t r = 0; r < th.nrings && fread(&tr, sizeof(tr), 1, tf) == 1; r++) {
+                        for (uint32_t i = 0; i < tr.count && fread(&ev, sizeof(ev), 1, tf) == 1; i++) {
+                                if (ev.cache == (uintptr_t)cache) traced[ev.type]++;
+                        }
+                }
+        }
+        fclose(tf);
+        unlink(trace_path);
+        printf("Traced allocs %d, frees %d, expected 2 1\n",
+               traced[KM_TRACE_ALLOC], traced[KM_TRACE_FREE]);
+        kmem_cache_destroy(cache);
+
+        printf("\n----------\nTesting Variable-Length Cache\n----------\n\n");
+        struct kmem_vcache vcache;
+        struct kmem_vcache_stats vstats;
+        printf("Too big: %d, expected -1\n",
+               kmem_vcache_init(&vcache, "huge", sizeof(struct foo), 1, 1 << 20, 0));
+        int vinit = kmem_vcache_init(&vcache, "crooked", sizeof(struct foo), 1, 100, 3);
+        printf("Bad align: %d, expected -1, buckets %u, expected 0\n", vinit, vcache.nbuckets);
+        kmem_vcache_init(&vcache, "vfoo", sizeof(struct foo), sizeof(int), 100, 0);
+        printf("Buckets: %u, last holds %lu, expected 8 100\n",
+               vcache.nbuckets, vcache.bucket_elems[vcache.nbuckets - 1]);
+        printf("Room for 3: %lu, for 70: %lu, expected 4 100\n",
+               kmem_vcache_capacity(&vcache, 3), kmem_vcache_capacity(&vcache, 70));
+        meow = kmem_vcache_alloc(&vcache, 3, KM_SLEEP);
+        woof = kmem_vcache_alloc(&vcache, 70, KM_SLEEP);
+        memset(woof, 0xff, sizeof(struct foo) + 100 * sizeof(int));
+        printf("Past the max: %p, expected (nil)\n", kmem_vcache_alloc(&vcache, 101, KM_SLEEP));
+        kmem_vcache_get_stats(&vcache, &vstats);
+        printf("Objects %lu (bucket 4: %lu, bucket 100: %lu), expected 2 (1 1)\n",
+               vstats.objects, vstats.bucket_objects[2], vstats.bucket_objects[7]);
+        kmem_vcache_free(&vcache, meow, 3);
+        kmem_vcache_free(&vcache, woof, 70);
+        kmem_vcache_get_stats(&vcache, &vstats);
+        printf("Objects after free: %lu, expected 0\n", vstats.objects);
+        kmem_vcache_destroy(&vcache);
+
+        printf("\n----------\nTesting kmem_alloc\n----------\n\n");
+        printf("Classes for 1, 24, 100, 4096, 5000: %lu %lu %lu %lu %lu, expected 8 32 128 4096 0\n",
+               kmem_alloc_class(1), kmem_alloc_class(24), kmem_alloc_class(100),
+               kmem_alloc_class(4096), kmem_alloc_class(5000));
+        meow = kmem_alloc(100, KM_SLEEP);
+        woof = kmem_alloc(5000, KM_SLEEP);
+        memset(meow, 0xaa, 128);
+        memset(woof, 0xbb, 5000);
+        kmem_cache_get_stats(kmem_alloc_cache(100), &stats);
+        printf("%s objects: %lu, expected 1\n", stats.name, stats.objects);
+        kmem_free(meow, 100);
+        kmem_free(woof, 5000);
+        kmem_cache_get_stats(kmem_alloc_cache(100), &stats);
+        printf("%s objects after free: %lu, expected 0\n", stats.name, stats.objects);
+
+        printf("\n----------\nTesting Class Fallback\n----------\n\n");
+        struct kmem_alloc_fallback_stats fallback;
+        printf("Fallback past the max: %d, expected -1\n", kmem_alloc_set_fallback(3));
+        kmem_alloc_set_fallback(1);
+        for (int i = 0; i < 20; i++) {
+                datas[i] = kmem_alloc(128, KM_SLEEP);
+        }
+        for (int i = 10; i < 20; i++) {
+                kmem_free(datas[i], 128);
+        }
+        kmem_cache_shrink(kmem_alloc_cache(96));
+        for (int i = 10; i < 20; i++) {
+                datas[i] = kmem_alloc(96, KM_SLEEP);
+        }
+        kmem_alloc_fallback_stats(&fallback);
+        printf("Borrowed: %lu, expected 10, bytes %lu, expected 960\n",
+               fallback.borrows, fallback.bytes_borrowed);
+        // Ten 96 byte objects don't fill a page of their own
+        printf("Pages saved: %lu, expected 0\n", fallback.pages_saved);
+        kmem_cache_get_stats(kmem_alloc_cache(96), &stats);
+        printf("%s slabs: %u, expected 0\n", stats.name, stats.slab_count);
+        kmem_cache_get_stats(kmem_alloc_cache(128), &stats);
+        printf("%s objects: %lu, expected 20\n", stats.name, stats.objects);
+        for (int i = 10; i < 20; i++) {
+                kmem_free(datas[i], 96);
+        }
+        kmem_cache_get_stats(kmem_alloc_cache(128), &stats);
+        printf("%s objects after sized frees: %lu, expected 10\n", stats.name, stats.objects);
+
+        // Classes past the next one are left alone
+        for (int i = 0; i < 10; i++) {
+                kmem_free(datas[i], 128);
+        }
+        kmem_cache_shrink(kmem_alloc_cache(64));
+        datas[0] = kmem_alloc(64, KM_SLEEP);
+        kmem_alloc_fallback_stats(&fallback);
+        kmem_cache_get_stats(kmem_alloc_cache(64), &stats);
+        printf("%s slabs: %u, expected 1, grows %lu, expected 1\n",
+               stats.name, stats.slab_count, fallback.grows);
+        kmem_free(datas[0], 64);
+        kmem_alloc_set_fallback(0);
+
+        printf("\n----------\nTesting Signal-Safe Cache\n----------\n\n");
+        void *reserved[3];
+        signal_cache = kmem_cache_create_sigsafe("sigsafe", sizeof(struct foo), 0, 2);
+        signal(SIGUSR1, signal_alloc);
+        raise(SIGUSR1);
+        signal(SIGUSR1, SIG_DFL);
+        printf("Allocated in a handler: %d, expected 1\n", signal_buf != NULL);
+        reserved[0] = signal_buf;
+        reserved[1] = kmem_cache_alloc(signal_cache, KM_SLEEP);
+        reserved[2] = kmem_cache_alloc(signal_cache, KM_SLEEP);
+        printf("Third of two: %p, expected (nil)\n", reserved[2]);
+        kmem_cache_free(signal_cache, reserved[0]);
+        reserved[2] = kmem_cache_alloc(signal_cache, KM_SLEEP);
+        printf("Reused after free: %d, expected 1\n", reserved[2] == reserved[0]);
+        kmem_cache_get_stats(signal_cache, &stats);
+        printf("Objects %lu, slabs %u, expected 2 0\n", stats.objects, stats.slab_count);
+        kmem_cache_free(signal_cache, reserved[1]);
+        kmem_cache_free(signal_cache, reserved[2]);
+        kmem_cache_destroy(signal_cache);
+
+        printf("\n----------\nTesting Concurrent Big Cache\n----------\n\n");
+        pthread_t threads[TEST_THREADS];
+        long bad = 0;
+        void *ret;
+        big_cache = kmem_cache_create("concurrent woof", sizeof(struct big_foo), 0);
+        for (int i = 0; i < TEST_THREADS; i++) {
+                pthread_create(&threads[i], NULL, big_cache_worker, big_cache);
+        }
+        for (int i = 0; i < TEST_THREADS; i++) {
+                pthread_join(threads[i], &ret);
+                bad += (long)ret;
+        }
+        printf("Corrupted items: %ld, expected 0\n", bad);
+        kmem_cache_destroy(big_cache);
+
+        printf("\n----------\nTesting CPU Slabs\n----------\n\n");
+        cache = kmem_cache_create_cpuslab("cpu foo", sizeof(struct foo), 0);
+        printf("CPU slabs: %d, expected 1\n", (cache->flags & KM_CACHE_CPUSLAB) != 0);
+        for (int i = 0; i < 340; i++) {
+                datas[i] = kmem_cache_alloc(cache, KM_SLEEP);
+                datas[i]->a = i;
+        }
+        bad = 0;
+        for (int i = 0; i < 340; i++) {
+                if (datas[i]->a != i) bad++;
+        }
+        printf("Overwritten items: %ld, expected 0\n", bad);
+        kmem_cache_get_stats(cache, &stats);
+        printf("Objects %lu, slabs %u, expected 340 2\n", stats.objects, stats.slab_count);
+        for (int i = 0; i < 340; i++) {
+                kmem_cache_free(cache, datas[i]);
+        }
+        meow = kmem_cache_alloc(cache, KM_SLEEP);
+        kmem_cache_free(cache, meow);
+        woof = kmem_cache_alloc(cache, KM_SLEEP);
+        printf("Reused after a lock-free free: %d, expected 1\n", meow == woof);
+        kmem_cache_free(cache, woof);
+        kmem_cache_get_stats(cache, &stats);
+        printf("Objects after frees: %lu, expected 0\n", stats.objects);
+        kmem_cache_shrink(cache);
+        kmem_cache_get_stats(cache, &stats);
+        printf("Slabs after shrink: %u, expected 0\n", stats.slab_count);
+        kmem_cache_destroy(cache);
+        big_cache = kmem_cache_create_cpuslab("cpu woof", sizeof(struct big_foo), 0);
+        printf("CPU slabs for big objects: %d, expected 0\n",
+               (big_cache->flags & KM_CACHE_CPUSLAB) != 0);
+        kmem_cache_destroy(big_cache);
+
+        printf("\n----------\nTesting Concurrent CPU Slabs\n----------\n\n");
+        bad = 0;
+        cache = kmem_cache_create_cpuslab("concurrent cpu foo", sizeof(struct foo), 0);
+        for (int i = 0; i < TEST_THREADS; i++) {
+                pthread_create(&threads[i], NULL, small_cache_worker, cache);
+        }
+        for (int i = 0; i < TEST_THREADS; i++) {
+                pthread_join(threads[i], &ret);
+                bad += (long)ret;
+        }
+        kmem_cache_get_stats(cache, &stats);
+        printf("Corrupted items: %ld, expected 0\n", bad);
+        printf("Objects: %lu, expected 0\n", stats.objects);
+        kmem_cache_destroy(cache);
+
+        printf("\n----------\nTesting Fork\n----------\n\n");
+        pthread_t worker;
+        pid_t pid;
+        int status;
+        int children = 0;
+        kmem_account_init(&tenant, "forked tenant", 0);
+        fork_accounted = kmem_cache_create("forked tenant foo", sizeof(struct foo), 0);
+        kmem_cache_set_account(fork_accounted, &tenant);
+        cache = kmem_cache_create("prefork", sizeof(struct foo), 0);
+        for (int i = 0; i < 340; i++) {
+                datas[i] = kmem_cache_alloc(cache, KM_SLEEP);
+        }
+        kmem_cache_get_stats(cache, &stats);
+        big_cache = kmem_cache_create("forked woof", sizeof(struct big_foo), 0);
+        pthread_create(&worker, NULL, fork_worker, big_cache);
+        while (!atomic_load(&fork_ready));
+        for (int f = 0; f < 16; f++) {
+                fflush(stdout);
+                pid = fork();
+                if (!pid) {
+                        struct kmem_cache_stats child_stats;
+                        // Locks the worker held at the fork would hang us here
+                        for (int i = 0; i < TEST_THREAD_ITEMS; i++) {
+                                big_datas[i % 10] = kmem_cache_alloc(big_cache, KM_SLEEP);
+                                kmem_cache_free(big_cache, big_datas[i % 10]);
+                        }
+                        // The parent's slabs are still there to refill
+                        for (int i = 0; i < 340; i++) {
+                                kmem_cache_free(cache, datas[i]);
+                        }
+                        for (int i = 0; i < 340; i++) {
+                                datas[i] = kmem_cache_alloc(cache, KM_SLEEP);
+                        }
+                        kmem_cache_get_stats(cache, &child_stats);
+                        kmem_account_flush();
+                        kmem_account_report(&tenant, &report);
+                        if (!f) {
+                                printf("Child slabs: %u, expected %u\n",
+                                       child_stats.slab_count, stats.slab_count);
+                                printf("Child account usage: %lu, expected 0\n", report.usage);
+                                fflush(stdout);
+                        }
+                        _exit(child_stats.slab_count != stats.slab_count || report.usage);
+                }
+                if (pid > 0 && waitpid(pid, &status, 0) == pid
+                    && WIFEXITED(status) && !WEXITSTATUS(status)) {
+                        children++;
+                }
+        }
+        atomic_store(&fork_stop, 1);
+        pthread_join(worker, NULL);
+        printf("Children that came out fine: %d, expected 16\n", children);
+        for (int i = 0; i < 340; i++) {
+                kmem_cache_free(cache, datas[i]);
+        }
+        kmem_cache_destroy(cache);
+        kmem_cache_destroy(big_cache);
+        kmem_cache_destroy(fork_accounted);
+
+        printf("\n----------\nTesting Single-Thread Cache\n----------\n\n");
+        cache = kmem_cache_create_attr("one thread foo", &(struct kmem_cache_attr){
+                .size = sizeof(struct foo),
+                .flags = KM_CACHE_SINGLE_THREAD,
+        });
+        big_cache = kmem_cache_create_attr("one thread woof", &(struct kmem_cache_attr){
+                .size = sizeof(struct big_foo),
+                .flags = KM_CACHE_SINGLE_THREAD,
+        });
+        for (int i = 0; i < 340; i++) {
+                datas[i] = kmem_cache_alloc(cache, KM_SLEEP);
+                datas[i]->a = i;
+        }
+        for (int i = 0; i < 10; i++) {
+                big_datas[i] = kmem_cache_alloc(big_cache, KM_SLEEP);
+                big_datas[i]->nums[0] = i;
+        }
+        int intact = 1;
+        for (int i = 0; i < 340; i++) {
+                intact &= datas[i]->a == i;
+        }
+        for (int i = 0; i < 10; i++) {
+                intact &= big_datas[i]->nums[0] == i;
+        }
+        printf("Objects intact: %d, expected 1\n", intact);
+        kmem_cache_free_bulk(cache, 340, (void **)datas);
         for (int i = 0; i < 10; i++) {
                 kmem_cache_free(big_cache, big_datas[i]);
         }
+        kmem_shrink_all(SIZE_MAX);
+        kmem_cache_get_stats(big_cache, &stats);
+        printf("Left alone by kmem_shrink_all: %d, expected 1\n", stats.slab_count > 0);
+        kmem_cache_shrink(big_cache);
+        kmem_cache_get_stats(big_cache, &stats);
+        printf("Objects %lu, slabs %u after the owner shrinks, expected 0 0\n",
+               stats.objects, stats.slab_count);
+        printf("With CPU slabs: %p, expected (nil)\n",
+               (void *)kmem_cache_create_attr("one thread cpu", &(struct kmem_cache_attr){
+                       .size = 8, .flags = KM_CACHE_SINGLE_THREAD | KM_CACHE_CPUSLAB }));
+
+        // The owner publishes under cp->lock, or it would write a slot
+        // that's being given back (or unmapped) under it
+        struct kmem_cache *churned = kmem_cache_create_attr("published one thread", &(struct kmem_cache_attr){
+                .size = sizeof(struct foo),
+                .flags = KM_CACHE_SINGLE_THREAD,
+        });
+        pthread_create(&threads[0], NULL, owner_churn, churned);
+        for (int i = 0; i < 200; i++) {
+                kmem_stats_publish(shm_name);
+                kmem_stats_unpublish();
+        }
+        pthread_join(threads[0], NULL);
+        kmem_cache_get_stats(churned, &stats);
+        printf("Published while churning: objects %lu, allocs %lu, expected 0 20000\n",
+               stats.objects, stats.allocs);
+        kmem_cache_destroy(churned);
+        fflush(stdout);
+        pid = fork();
+        if (!pid) {
+                void *stray;
+
+                // Another thread allocating trips the owner check
+                close(STDERR_FILENO);
+                pthread_create(&worker, NULL, stray_alloc, cache);
+                pthread_join(worker, &stray);
+                _exit(0);
+        }
+        waitpid(pid, &status, 0);
+        printf("Stray thread caught: %d, expected 1\n", WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+        kmem_cache_destroy(cache);
+        kmem_cache_destroy(big_cache);
+
+        printf("\n----------\nTesting Concurrent Signal-Safe Cache\n----------\n\n");
+        bad = 0;
+        big_cache = kmem_cache_create_sigsafe("concurrent sigsafe", sizeof(struct big_foo), 0,
+                                              TEST_THREADS * TEST_THREAD_ITEMS);
+        for (int i = 0; i < TEST_THREADS; i++) {
+                pthread_create(&threads[i], NULL, big_cache_worker, big_cache);
+        }
+        for (int i = 0; i < TEST_THREADS; i++) {
+                pthread_join(threads[i], &ret);
+                bad += (long)ret;
+        }
+        printf("Corrupted items: %ld, expected 0\n", bad);
         kmem_cache_destroy(big_cache);
 }
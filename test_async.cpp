@@ -0,0 +1,75 @@
+#include <cstdio>
+#include <deque>
+#include <exception>
+
+#include "async.hpp"
+
+/* Just enough of a coroutine type to run one to its first co_await */
+struct task {
+        struct promise_type {
+                task get_return_object() { return {}; }
+                std::suspend_never initial_suspend() { return {}; }
+                std::suspend_never final_suspend() noexcept { return {}; }
+                void return_void() {}
+                void unhandled_exception() { std::terminate(); }
+        };
+};
+
+static task
+worker(kmem_cache *cp, void **out)
+{
+        *out = co_await kmem::async_alloc(cp);
+}
+
+int
+main()
+{
+        kmem_account acct;
+        kmem_cache *cp;
+        void *a;
+        void *b;
+        void *got = nullptr;
+        void *posted = nullptr;
+
+        printf("\n----------\nTesting Async Alloc\n----------\n\n");
+        cp = kmem_cache_create((char *)"async", 64, 0);
+        kmem_account_init(&acct, (char *)"async", 2 * 64);
+        kmem_cache_set_account(cp, &acct);
+
+        {
+                kmem::waitq q(&acct);
+                a = kmem_cache_alloc(cp, KM_NOSLEEP);
+                b = kmem_cache_alloc(cp, KM_NOSLEEP);
+                worker(cp, &got);
+                printf("Parked: %zu, got %d, expected 1 0\n", q.waiting(), got != nullptr);
+                kmem_cache_free(cp, a);
+                printf("Parked: %zu, got %d, expected 0 1\n", q.waiting(), got != nullptr);
+        }
+
+        {
+                std::deque<std::function<void()>> loop;
+                kmem::waitq q(&acct, [&](std::function<void()> fn) { loop.push_back(std::move(fn)); });
+                worker(cp, &posted);
+                kmem_cache_free(cp, b);
+                printf("Posted: %zu, got %d, expected 1 0\n", loop.size(), posted != nullptr);
+                while (!loop.empty()) {
+                        loop.front()();
+                        loop.pop_front();
+                }
+                printf("After the loop ran, got %d, expected 1\n", posted != nullptr);
+        }
+
+        kmem_cache_free(cp, got);
+        kmem_cache_free(cp, posted);
+        kmem_cache_destroy(cp);
+
+        // No account to wait on, and nothing left in the reserve
+        void *reserved;
+        void *none = &reserved;
+        cp = kmem_cache_create_sigsafe((char *)"async sigsafe", 64, 0, 1);
+        reserved = kmem_cache_alloc(cp, KM_SLEEP);
+        worker(cp, &none);
+        printf("Exhausted reserve: %p, expected (nil)\n", none);
+        kmem_cache_free(cp, reserved);
+        kmem_cache_destroy(cp);
+}
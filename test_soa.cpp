@@ -0,0 +1,89 @@
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "soa.hpp"
+
+struct particle {
+        float x;
+        float y;
+        float vx;
+        float vy;
+        uint32_t flags;
+};
+
+using particles = kmem::soa_cache<particle, &particle::x, &particle::vx, &particle::flags>;
+
+int
+main()
+{
+        particles cache("soa particles");
+        std::vector<particles::handle> handles;
+        kmem_cache_stats stats;
+        double sum;
+        size_t seen;
+        size_t slabs;
+
+        printf("\n----------\nTesting Structure of Arrays\n----------\n\n");
+        for (size_t i = 0; i < 3 * particles::slab_slots / 2; i++) {
+                handles.push_back(cache.alloc());
+                cache.get<&particle::x>(handles.back()) = i;
+                cache.get<&particle::vx>(handles.back()) = 1;
+        }
+        printf("Objects: %zu, expected %zu\n", cache.size(), 3 * particles::slab_slots / 2);
+        printf("Second slab: %u, expected 1\n", handles.back().slab);
+
+        slabs = 0;
+        sum = 0;
+        for (auto span : cache.spans<&particle::x>()) {
+                slabs++;
+                printf("Field array aligned: %d, expected 1\n", (uintptr_t)span.data() % 64 == 0);
+                for (float x : span) sum += x;
+        }
+        printf("Slabs scanned: %zu, expected 2\n", slabs);
+        printf("Sum of x: %.0f, expected %.0f\n", sum,
+               (3.0 * particles::slab_slots / 2) * (3.0 * particles::slab_slots / 2 - 1) / 2);
+
+        particle p = cache.load(handles[7]);
+        printf("Loaded: x %.0f vx %.0f y %.0f, expected 7 1 0\n", p.x, p.vx, p.y);
+        p.x = 70;
+        p.y = 5;
+        p.flags = 3;
+        cache.store(handles[7], p);
+        p = cache.load(handles[7]);
+        printf("Stored: x %.0f flags %u y %.0f, expected 70 3 0\n", p.x, p.flags, p.y);
+
+        cache.free(handles[7]);
+        seen = 0;
+        sum = 0;
+        for (auto span : cache.spans<&particle::vx>()) {
+                for (size_t i = 0; i < span.size(); i++) {
+                        seen += span.alive(i);
+                        sum += span[i];
+                }
+        }
+        printf("Alive after a free: %zu, expected %zu\n", seen, 3 * particles::slab_slots / 2 - 1);
+        printf("Sum of vx: %.0f, expected %zu\n", sum, 3 * particles::slab_slots / 2 - 1);
+        printf("Freed handle alive: %d, expected 0\n", cache.alive(handles[7]));
+        handles[7] = cache.alloc();
+        printf("Slot reused: %u %u, expected 0 7\n", handles[7].slab, handles[7].slot);
+
+        for (size_t i = particles::slab_slots; i < handles.size(); i++) {
+                cache.free(handles[i]);
+        }
+        handles.resize(particles::slab_slots);
+        slabs = 0;
+        for (auto span : cache.spans<&particle::flags>()) {
+                slabs++;
+                (void)span;
+        }
+        printf("Empty slab skipped: %zu, expected 1\n", slabs);
+        cache.shrink();
+        kmem_cache_get_stats(cache.cache(), &stats);
+        printf("SoA slabs left after shrink: %lu, expected 1\n", stats.objects);
+
+        for (auto h : handles) {
+                cache.free(h);
+        }
+        printf("Objects: %zu, expected 0\n", cache.size());
+}
@@ -0,0 +1,223 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "slab.h"
+#include "trace.h"
+
+/**
+ * One thread's events. Only the owning thread writes, so head
+ * only needs to be atomic for kmem_trace_dump's sake
+ * Rings are never freed: when a thread exits its ring is left
+ * for the next new thread, keeping its events until then
+ */
+struct kmem_trace_ring {
+        struct kmem_trace_ring *next;
+        atomic_int owned;
+        uint32_t tid;
+        atomic_ulong head;              /* Events ever recorded */
+        struct kmem_trace_event events[KM_TRACE_RING];
+};
+
+atomic_int kmem_trace_on = 0;
+
+/* Every ring ever handed out, only pushed onto */
+static struct kmem_trace_ring *_Atomic rings = NULL;
+static _Thread_local struct kmem_trace_ring *ring = NULL;
+
+/* Hands a thread's ring back when it exits */
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static struct kmem_trace_file_name names[KM_TRACE_MAX_NAMES];
+static unsigned nnames = 0;
+static pthread_mutex_t names_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+__ring_release(void *arg)
+{
+        struct kmem_trace_ring *r = arg;
+
+        atomic_store_explicit(&r->owned, 0, memory_order_release);
+}
+
+static void
+__ring_key_init()
+{
+        pthread_key_create(&ring_key, __ring_release);
+}
+
+/**
+ * Find this thread a ring, reusing one from a dead thread if we can
+ * Returns NULL if there's none and malloc fails
+ */
+static struct kmem_trace_ring *
+__ring_get()
+{
+        struct kmem_trace_ring *r;
+        int unowned;
+
+        for (r = atomic_load_explicit(&rings, memory_order_acquire); r; r = r->next) {
+                unowned = 0;
+                if (atomic_compare_exchange_strong(&r->owned, &unowned, 1)) break;
+        }
+
+        if (!r) {
+                r = malloc(sizeof(struct kmem_trace_ring));
+                if (!r) return NULL;
+                atomic_init(&r->owned, 1);
+                r->next = atomic_load_explicit(&rings, memory_order_relaxed);
+                while (!atomic_compare_exchange_weak_explicit(&rings, &r->next, r,
+                                                              memory_order_release,
+                                                              memory_order_relaxed));
+        }
+
+        r->tid = syscall(SYS_gettid);
+        atomic_store_explicit(&r->head, 0, memory_order_relaxed);
+
+        pthread_once(&ring_key_once, __ring_key_init);
+        pthread_setspecific(ring_key, r);
+        return r;
+}
+
+void
+__kmem_trace_record(enum kmem_trace_type type, const void *cp, const void *obj, const void *slab)
+{
+        struct kmem_trace_event *ev;
+        struct timespec ts;
+        unsigned long head;
+
+        if (__builtin_expect(!ring, 0)) {
+                ring = __ring_get();
+                if (!ring) return;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        ev = &ring->events[head & (KM_TRACE_RING - 1)];
+        ev->ts = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+        ev->type = type;
+        ev->cache = (uintptr_t)cp;
+        ev->obj = (uintptr_t)obj;
+        ev->slab = (uintptr_t)slab;
+        atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void
+__kmem_trace_fork_prepare()
+{
+        pthread_mutex_lock(&names_lock);
+}
+
+void
+__kmem_trace_fork_parent()
+{
+        pthread_mutex_unlock(&names_lock);
+}
+
+void
+__kmem_trace_fork_child()
+{
+        struct kmem_trace_ring *r;
+
+        pthread_mutex_init(&names_lock, NULL);
+
+        // Only the forking thread came with us, everyone else's
+        // ring is free for the child's threads to claim
+        for (r = atomic_load_explicit(&rings, memory_order_relaxed); r; r = r->next) {
+                if (r != ring) atomic_store_explicit(&r->owned, 0, memory_order_relaxed);
+                atomic_store_explicit(&r->head, 0, memory_order_relaxed);
+        }
+        if (ring) ring->tid = syscall(SYS_gettid);
+}
+
+void
+kmem_trace_name(const void *cp, const char *name)
+{
+        unsigned i;
+
+        pthread_mutex_lock(&names_lock);
+
+        // Caches can land where a destroyed one used to be
+        for (i = 0; i < nnames; i++) {
+                if (names[i].cache == (uintptr_t)cp) break;
+        }
+        if (i == nnames) {
+                if (nnames == KM_TRACE_MAX_NAMES) {
+                        pthread_mutex_unlock(&names_lock);
+                        return;
+                }
+                nnames++;
+        }
+
+        names[i].cache = (uintptr_t)cp;
+        strncpy(names[i].name, name, KM_TRACE_NAME_LEN - 1);
+        names[i].name[KM_TRACE_NAME_LEN - 1] = '\0';
+        pthread_mutex_unlock(&names_lock);
+}
+
+void
+kmem_trace_enable(int on)
+{
+        DEBUG_PRINT("Tracing %s\n", on ? "on" : "off");
+        atomic_store_explicit(&kmem_trace_on, on, memory_order_relaxed);
+}
+
+int
+kmem_trace_dump(const char *path)
+{
+        struct kmem_trace_file_header header;
+        struct kmem_trace_file_ring rh;
+        struct kmem_trace_ring *list;
+        struct kmem_trace_ring *r;
+        unsigned long head;
+        unsigned long first;
+        size_t wrap;
+        FILE *f;
+        int ret;
+
+        f = fopen(path, "wb");
+        if (!f) return -1;
+
+        // Rings are only ever pushed on the front, so everything
+        // from this snapshot of the head stays put while we write
+        list = atomic_load_explicit(&rings, memory_order_acquire);
+
+        header.magic = KM_TRACE_MAGIC;
+        header.version = KM_TRACE_VERSION;
+        header.nrings = 0;
+        for (r = list; r; r = r->next) {
+                header.nrings++;
+        }
+
+        pthread_mutex_lock(&names_lock);
+        header.nnames = nnames;
+        ret = fwrite(&header, sizeof(header), 1, f) == 1
+                && fwrite(names, sizeof(struct kmem_trace_file_name), nnames, f) == nnames
+                ? 0 : -1;
+        pthread_mutex_unlock(&names_lock);
+
+        for (r = list; r && !ret; r = r->next) {
+                head = atomic_load_explicit(&r->head, memory_order_acquire);
+                first = head > KM_TRACE_RING ? head - KM_TRACE_RING : 0;
+                rh.tid = r->tid;
+                rh.count = head - first;
+
+                // Oldest first, which is two pieces once the ring has wrapped
+                first &= KM_TRACE_RING - 1;
+                wrap = first ? KM_TRACE_RING - first : rh.count;
+                if (fwrite(&rh, sizeof(rh), 1, f) != 1
+                    || fwrite(&r->events[first], sizeof(struct kmem_trace_event), wrap, f) != wrap
+                    || fwrite(r->events, sizeof(struct kmem_trace_event), rh.count - wrap, f)
+                       != rh.count - wrap) {
+                        ret = -1;
+                }
+        }
+
+        if (fclose(f)) ret = -1;
+        return ret;
+}
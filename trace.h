@@ -0,0 +1,126 @@
+#ifndef PLOPREIATO_SLAB_TRACE_H
+#define PLOPREIATO_SLAB_TRACE_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/**
+ * Binary event tracing
+ * Each thread records fixed size events (timestamp, event, cache,
+ * object, slab) into its own ring, so recording never takes a lock
+ * or makes a syscall, and is cheap enough to leave on in optimized
+ * builds. Older events are overwritten once a ring wraps.
+ *
+ * kmem_trace_dump writes every ring to a file, and the kmemtrace
+ * tool turns that back into a timeline. Dump while the traced
+ * threads are quiet, or the newest few events may be torn.
+ */
+
+#define KM_TRACE_RING 4096              /* Events per thread, power of 2 */
+#define KM_TRACE_MAX_NAMES 256
+#define KM_TRACE_NAME_LEN 32
+
+#define KM_TRACE_MAGIC 0x6b6d7472       /* "kmtr" */
+#define KM_TRACE_VERSION 1
+
+enum kmem_trace_type {
+        KM_TRACE_ALLOC = 1,
+        KM_TRACE_FREE,
+        KM_TRACE_GROW,                  /* New slab */
+        KM_TRACE_REAP,                  /* Slab given back */
+        KM_TRACE_CREATE,                /* Cache created */
+        KM_TRACE_DESTROY,               /* Cache destroyed */
+        KM_TRACE_KMEM_ALLOC,            /* kmem_alloc, slab holds the size
+                                         * asked for (see kmemtune) */
+};
+
+struct kmem_trace_event {
+        uint64_t ts;                    /* CLOCK_MONOTONIC ns */
+        uint64_t type;
+        uint64_t cache;
+        uint64_t obj;
+        uint64_t slab;
+};
+
+/*
+ * Dump file layout, all native endian:
+ *   struct kmem_trace_file_header
+ *   struct kmem_trace_file_name[nnames]
+ *   nrings x { struct kmem_trace_file_ring, struct kmem_trace_event[count] }
+ * Each ring's events are oldest first
+ */
+struct kmem_trace_file_header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t nnames;
+        uint32_t nrings;
+};
+
+struct kmem_trace_file_name {
+        uint64_t cache;
+        char name[KM_TRACE_NAME_LEN];
+};
+
+struct kmem_trace_file_ring {
+        uint32_t tid;
+        uint32_t count;
+};
+
+/* Set by kmem_trace_enable, checked before every record */
+extern atomic_int kmem_trace_on;
+
+/**
+ * Record an event, when tracing is on
+ */
+#define KM_TRACE(type, cp, obj, slab)                                           \
+        do {                                                                    \
+                if (__builtin_expect(atomic_load_explicit(&kmem_trace_on,       \
+                                                          memory_order_relaxed), 0)) \
+                        __kmem_trace_record((type), (cp), (obj), (slab));       \
+        } while (0)
+
+void
+__kmem_trace_record(
+        enum kmem_trace_type type,
+        const void *cp,
+        const void *obj,
+        const void *slab
+);
+
+/**
+ * Fork handling, called from slab.c's pthread_atfork handlers
+ * The child keeps the forking thread's ring, under its new tid,
+ * hands back every other thread's, and starts them all empty
+ */
+void __kmem_trace_fork_prepare(void);
+void __kmem_trace_fork_parent(void);
+void __kmem_trace_fork_child(void);
+
+/**
+ * Remember a cache's name, so dumps can show it
+ * Called on every cache create, traced or not
+ */
+void
+kmem_trace_name(
+        const void *cp,
+        const char *name
+);
+
+/**
+ * Turn tracing on (1) or off (0)
+ */
+void
+kmem_trace_enable(
+        int on
+);
+
+/**
+ * Write every thread's ring to path
+ * Returns 0 on success, -1 on error
+ */
+int
+kmem_trace_dump(
+        const char *path
+);
+
+#endif
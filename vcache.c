@@ -0,0 +1,123 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "slab.h"
+#include "vcache.h"
+
+/**
+ * Which bucket holds n elements: the smallest power of 2 >= n,
+ * except the last bucket, which is max_elems exactly
+ * ASSUMED: n <= vcp->max_elems
+ */
+static inline unsigned
+__vcache_bucket(struct kmem_vcache *vcp, size_t n)
+{
+        unsigned i;
+
+        i = n <= 1 ? 0 : 8 * sizeof(unsigned long) - __builtin_clzl(n - 1);
+        return i < vcp->nbuckets ? i : vcp->nbuckets - 1;
+}
+
+int
+kmem_vcache_init(struct kmem_vcache *vcp, char *name, size_t header_size,
+                 size_t elem_size, size_t max_elems, size_t align)
+{
+        size_t elems;
+        unsigned i;
+
+        memset(vcp, 0, sizeof(struct kmem_vcache));
+        vcp->name = name;
+        vcp->header_size = header_size;
+        vcp->elem_size = elem_size;
+        vcp->max_elems = max_elems ? max_elems : 1;
+
+        if (vcp->max_elems > 1ul << (KM_VCACHE_MAX_BUCKETS - 1)) {
+                DEBUG_PRINT("vcache %s: %lu elements needs too many buckets\n", name, vcp->max_elems);
+                return -1;
+        }
+
+        for (i = 0, elems = 1; ; i++, elems *= 2) {
+                if (elems > vcp->max_elems) elems = vcp->max_elems;
+                vcp->bucket_elems[i] = elems;
+                snprintf(vcp->names[i], KM_VCACHE_NAME_LEN, "%s-%lu", name, elems);
+                vcp->buckets[i] = kmem_cache_create(vcp->names[i],
+                                                    header_size + elems * elem_size, align);
+                if (!vcp->buckets[i]) {
+                        DEBUG_PRINT("vcache %s: unable to create bucket %s\n", name, vcp->names[i]);
+                        vcp->nbuckets = i;
+                        kmem_vcache_destroy(vcp);
+                        return -1;
+                }
+                if (elems == vcp->max_elems) break;
+        }
+        vcp->nbuckets = i + 1;
+
+        DEBUG_PRINT("vcache %s has %u buckets, up to %lu elements\n", name, vcp->nbuckets,
+                    vcp->max_elems);
+        return 0;
+}
+
+void *
+kmem_vcache_alloc(struct kmem_vcache *vcp, size_t n, int flags)
+{
+        if (n > vcp->max_elems) return NULL;
+        return kmem_cache_alloc(vcp->buckets[__vcache_bucket(vcp, n)], flags);
+}
+
+void
+kmem_vcache_free(struct kmem_vcache *vcp, void *buf, size_t n)
+{
+        struct kmem_cache *cp;
+
+        assert(n <= vcp->max_elems);
+        cp = vcp->buckets[__vcache_bucket(vcp, n)];
+#if DEBUG
+        // The wrong n would put buf on another bucket's slabs
+        assert(kmem_cache_owns(cp, buf));
+#endif
+        kmem_cache_free(cp, buf);
+}
+
+size_t
+kmem_vcache_capacity(struct kmem_vcache *vcp, size_t n)
+{
+        if (n > vcp->max_elems) return 0;
+        return vcp->bucket_elems[__vcache_bucket(vcp, n)];
+}
+
+void
+kmem_vcache_get_stats(struct kmem_vcache *vcp, struct kmem_vcache_stats *stats)
+{
+        struct kmem_cache_stats bucket;
+        size_t pages = 0;
+        unsigned i;
+
+        memset(stats, 0, sizeof(struct kmem_vcache_stats));
+        stats->name = vcp->name;
+        stats->nbuckets = vcp->nbuckets;
+        for (i = 0; i < vcp->nbuckets; i++) {
+                kmem_cache_get_stats(vcp->buckets[i], &bucket);
+                stats->objects += bucket.objects;
+                stats->allocs += bucket.allocs;
+                stats->frees += bucket.frees;
+                stats->slab_count += bucket.slab_count;
+                pages += bucket.pages;
+                stats->bucket_elems[i] = vcp->bucket_elems[i];
+                stats->bucket_objects[i] = bucket.objects;
+        }
+        stats->bytes = pages * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+void
+kmem_vcache_destroy(struct kmem_vcache *vcp)
+{
+        unsigned i;
+
+        for (i = 0; i < vcp->nbuckets; i++) {
+                kmem_cache_destroy(vcp->buckets[i]);
+                vcp->buckets[i] = NULL;
+        }
+        vcp->nbuckets = 0;
+}
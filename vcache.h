@@ -0,0 +1,124 @@
+#ifndef PLOPREIATO_SLAB_VCACHE_H
+#define PLOPREIATO_SLAB_VCACHE_H
+
+#include <stddef.h>
+
+#include "slab.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Variable-length object caches
+ * For types that are a fixed header plus a trailing array, like
+ *
+ *     struct msg {
+ *             size_t len;
+ *             char data[];
+ *     };
+ *
+ * A vcache keeps one cache per power of 2 element count (1, 2, 4,
+ * ... up to max_elems) and picks the smallest that fits on each
+ * alloc. Frees are sized: pass the same element count the object
+ * was allocated with, since nothing on the object says which
+ * bucket it came from.
+ */
+
+#define KM_VCACHE_MAX_BUCKETS 16
+#define KM_VCACHE_NAME_LEN 32
+
+struct kmem_vcache {
+        char *name;
+        size_t header_size;
+        size_t elem_size;
+        size_t max_elems;
+        unsigned nbuckets;
+        size_t bucket_elems[KM_VCACHE_MAX_BUCKETS];     /* Elements each bucket holds */
+        struct kmem_cache *buckets[KM_VCACHE_MAX_BUCKETS];
+        char names[KM_VCACHE_MAX_BUCKETS][KM_VCACHE_NAME_LEN]; /* "name-elems" */
+};
+
+struct kmem_vcache_stats {
+        char *name;
+        size_t objects;             /* Objects currently allocated, all buckets */
+        size_t allocs;
+        size_t frees;
+        size_t bytes;               /* Held in slabs, all buckets */
+        unsigned slab_count;
+        unsigned nbuckets;
+        size_t bucket_elems[KM_VCACHE_MAX_BUCKETS];
+        size_t bucket_objects[KM_VCACHE_MAX_BUCKETS];
+};
+
+/**
+ * Set up a vcache for header_size + n * elem_size objects,
+ * with n up to max_elems
+ * Returns 0 on success, -1 if max_elems needs more than
+ * KM_VCACHE_MAX_BUCKETS buckets or a bucket's cache can't be
+ * created (align not a power of 2, or no memory)
+ */
+int
+kmem_vcache_init(
+        struct kmem_vcache *vcp,
+        char *name,
+        size_t header_size,
+        size_t elem_size,
+        size_t max_elems,
+        size_t align
+);
+
+/**
+ * Allocate an object with room for (at least) n elements
+ * Returns NULL past max_elems, or as kmem_cache_alloc would
+ */
+void *
+kmem_vcache_alloc(
+        struct kmem_vcache *vcp,
+        size_t n,
+        int flags
+);
+
+/**
+ * Free an object allocated for n elements
+ * Debug builds check buf really is from n's bucket
+ */
+void
+kmem_vcache_free(
+        struct kmem_vcache *vcp,
+        void *buf,
+        size_t n
+);
+
+/**
+ * How many elements an object allocated for n really has room
+ * for, so it can grow in place up to that
+ */
+size_t
+kmem_vcache_capacity(
+        struct kmem_vcache *vcp,
+        size_t n
+);
+
+/**
+ * Fill in stats summed over every bucket
+ */
+void
+kmem_vcache_get_stats(
+        struct kmem_vcache *vcp,
+        struct kmem_vcache_stats *stats
+);
+
+/**
+ * Destroy every bucket's cache
+ */
+void
+kmem_vcache_destroy(
+        struct kmem_vcache *vcp
+);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif